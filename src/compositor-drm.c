@@ -56,6 +56,52 @@
 #define DRM_CAP_TIMESTAMP_MONOTONIC 0x6
 #endif
 
+/* KMS properties set by atomic commits, in the order of the names below */
+enum drm_plane_prop {
+	PLANE_TYPE = 0,
+	PLANE_FB_ID,
+	PLANE_CRTC_ID,
+	PLANE_SRC_X,
+	PLANE_SRC_Y,
+	PLANE_SRC_W,
+	PLANE_SRC_H,
+	PLANE_CRTC_X,
+	PLANE_CRTC_Y,
+	PLANE_CRTC_W,
+	PLANE_CRTC_H,
+	PLANE_PROP_COUNT
+};
+
+enum drm_crtc_prop {
+	CRTC_MODE_ID = 0,
+	CRTC_ACTIVE,
+	CRTC_PROP_COUNT
+};
+
+enum drm_connector_prop {
+	CONNECTOR_CRTC_ID = 0,
+	CONNECTOR_PROP_COUNT
+};
+
+#ifndef DRM_PLANE_TYPE_OVERLAY
+#define DRM_PLANE_TYPE_OVERLAY 0
+#define DRM_PLANE_TYPE_PRIMARY 1
+#define DRM_PLANE_TYPE_CURSOR 2
+#endif
+
+/* Overlay configurations the kernel was asked about, per output */
+#define DRM_PLANE_TEST_CACHE 8
+#define DRM_PLANE_TEST_OVERLAYS 4
+
+/* Views not updated for longer are left to the renderer */
+#define DRM_VIEW_IDLE_MSECS 1000
+
+/* Cursor images kept in bos per output, to switch to without an upload */
+#define DRM_CURSOR_CACHE 8
+
+/* the most buffers the pixman and v4l2 renderers may cycle through */
+#define DRM_DUMB_MAX 4
+
 static int option_current_mode = 0;
 
 enum output_config {
@@ -107,6 +153,15 @@ struct drm_compositor {
 
 	int use_v4l2;
 
+	/* dumb buffers per output for the pixman and v4l2 renderers */
+	int dumb_count;
+
+	/* outputs are updated with one atomic commit per frame */
+	int atomic_modeset;
+
+	/* gem handles of imported dmabufs, shared by the fbs of a buffer */
+	struct wl_array gem_handles;
+
 	uint32_t prev_state;
 
 	clockid_t clock;
@@ -133,6 +188,15 @@ struct drm_fb {
 
 	/* Used by dumb fbs */
 	void *map;
+
+	/* Used by fbs of dmabuf client buffers */
+	uint32_t gem_handles[V4L2_DMABUF_MAX_PLANES];
+	int num_gem_handles;
+};
+
+struct drm_gem_handle {
+	uint32_t handle;
+	int refcount;
 };
 
 struct drm_edid {
@@ -142,6 +206,26 @@ struct drm_edid {
 	char serial_number[13];
 };
 
+/*
+ * What a TEST_ONLY commit of the planes of an output checks: the primary
+ * plane and the placement and layout of the overlays.
+ */
+struct drm_planes_key {
+	int32_t width, height;
+	uint32_t stride;
+	int sprites_hidden;
+	int count;
+	struct {
+		uint32_t plane_id;
+		int shown;
+		uint32_t format, stride;
+		int32_t src_x, src_y;
+		uint32_t src_w, src_h;
+		uint32_t dest_x, dest_y;
+		uint32_t dest_w, dest_h;
+	} planes[DRM_PLANE_TEST_OVERLAYS];
+};
+
 struct drm_output {
 	struct weston_output   base;
 
@@ -153,23 +237,67 @@ struct drm_output {
 	drmModePropertyPtr dpms_prop;
 	uint32_t format;
 
+	/* for atomic commits */
+	struct drm_sprite *primary_sprite, *cursor_sprite;
+	uint32_t crtc_props[CRTC_PROP_COUNT];
+	uint32_t connector_props[CONNECTOR_PROP_COUNT];
+	uint32_t mode_blob;
+
+	/* results of recent TEST_ONLY commits, by configuration */
+	struct drm_plane_test {
+		int valid;
+		struct drm_planes_key key;
+		int result;
+	} plane_tests[DRM_PLANE_TEST_CACHE];
+	int plane_test_next;
+
+	/* how the views shown on the output get updated */
+	struct wl_list view_states;
+
 	int vblank_pending;
 	int page_flip_pending;
 	int destroy_pending;
 
+	/* v4l2 renderer may complete the composition asynchronously */
+	int compose_pending;
+	int flip_deferred;
+	struct wl_listener v4l2_frame_listener;
+
+	/* the core waits for weston_output_finish_frame() */
+	int frame_owed;
+	struct wl_event_source *finish_idle;
+
 	struct gbm_surface *surface;
-	struct gbm_bo *cursor_bo[2];
+	struct drm_cursor {
+		struct gbm_bo *bo;
+		struct drm_fb *fb;	/* for atomic commits */
+		uint32_t hash;
+		uint32_t last_used;
+		int valid;
+		uint32_t image[64 * 64];
+	} cursors[DRM_CURSOR_CACHE];
+	int cursor_count;
+	uint32_t cursor_serial;
 	struct weston_plane cursor_plane;
 	struct weston_plane fb_plane;
+	/* picked by drm_assign_planes(), drawn by drm_output_repaint() */
 	struct weston_view *cursor_view;
 	int current_cursor;
-	struct drm_fb *current, *next;
+	/* the cursor to show with the frame being flipped */
+	int cursor_shown, cursor_changed;
+	int cursor_x, cursor_y;
+	/* a cursor bo is set on the legacy cursor plane */
+	int cursor_set;
+	/* on screen, waiting for the page flip, and being rendered */
+	struct drm_fb *current, *pending, *next;
 	struct backlight *backlight;
 
-	struct drm_fb *dumb[2];
-	pixman_image_t *image[2];
+	struct drm_fb *dumb[DRM_DUMB_MAX];
+	pixman_image_t *image[DRM_DUMB_MAX];
+	/* damage rendered into the other buffers since each one was */
+	pixman_region32_t dumb_damage[DRM_DUMB_MAX];
+	int dumb_count;
 	int current_image;
-	pixman_region32_t previous_damage;
 
 	struct vaapi_recorder *recorder;
 	struct wl_listener recorder_frame_listener;
@@ -184,7 +312,7 @@ struct drm_sprite {
 
 	struct weston_plane plane;
 
-	struct drm_fb *current, *next;
+	struct drm_fb *current, *pending, *next;
 	struct drm_output *output;
 	struct drm_compositor *compositor;
 
@@ -192,20 +320,48 @@ struct drm_sprite {
 	uint32_t plane_id;
 	uint32_t count_formats;
 
+	/* with universal planes, primary and cursor planes are listed too */
+	uint32_t type;
+	uint32_t props[PLANE_PROP_COUNT];
+
 	int32_t src_x, src_y;
 	uint32_t src_w, src_h;
 	uint32_t dest_x, dest_y;
 	uint32_t dest_w, dest_h;
+	uint32_t format;
 
 	uint32_t formats[];
 };
 
+/*
+ * Update statistics of a view on an output, to move the views that are
+ * the most expensive to composite to the overlays.
+ */
+struct drm_view_state {
+	struct wl_list link;		/* drm_output::view_states */
+	struct drm_output *output;
+	struct weston_view *view;
+	struct wl_listener view_destroy_listener;
+
+	uint32_t updates;
+	uint32_t last_update;		/* frame time of the last update */
+	uint32_t interval;		/* average msecs between updates */
+	uint32_t area;			/* average damaged pixels per update */
+
+	uint64_t score;
+	int overlay_candidate;
+	int on_overlay;
+	int tried;			/* visited by drm_assign_planes() */
+	int seen;
+};
+
 struct drm_parameters {
 	int connector;
 	int tty;
 	int use_pixman;
 	int use_v4l2;
 	const char *seat_id;
+	const char *device;
 };
 
 static struct gl_renderer_interface *gl_renderer;
@@ -235,6 +391,74 @@ drm_sprite_crtc_supported(struct weston_output *output_base, uint32_t supported)
 	return 0;
 }
 
+#ifdef HAVE_DRM_ATOMIC
+static const char * const plane_prop_names[PLANE_PROP_COUNT] = {
+	[PLANE_TYPE] = "type",
+	[PLANE_FB_ID] = "FB_ID",
+	[PLANE_CRTC_ID] = "CRTC_ID",
+	[PLANE_SRC_X] = "SRC_X",
+	[PLANE_SRC_Y] = "SRC_Y",
+	[PLANE_SRC_W] = "SRC_W",
+	[PLANE_SRC_H] = "SRC_H",
+	[PLANE_CRTC_X] = "CRTC_X",
+	[PLANE_CRTC_Y] = "CRTC_Y",
+	[PLANE_CRTC_W] = "CRTC_W",
+	[PLANE_CRTC_H] = "CRTC_H",
+};
+
+static const char * const crtc_prop_names[CRTC_PROP_COUNT] = {
+	[CRTC_MODE_ID] = "MODE_ID",
+	[CRTC_ACTIVE] = "ACTIVE",
+};
+
+static const char * const connector_prop_names[CONNECTOR_PROP_COUNT] = {
+	[CONNECTOR_CRTC_ID] = "CRTC_ID",
+};
+
+/*
+ * Looks up the ids of the named properties of a KMS object, and their
+ * current values if values isn't NULL. Returns -1 if any is missing.
+ */
+static int
+drm_get_prop_ids(int fd, uint32_t obj_id, uint32_t obj_type,
+		 const char * const *names, int count,
+		 uint32_t *ids, uint64_t *values)
+{
+	drmModeObjectPropertiesPtr props;
+	drmModePropertyPtr prop;
+	uint32_t i;
+	int j, found = 0;
+
+	memset(ids, 0, count * sizeof ids[0]);
+
+	props = drmModeObjectGetProperties(fd, obj_id, obj_type);
+	if (!props)
+		return -1;
+
+	for (i = 0; i < props->count_props; i++) {
+		prop = drmModeGetProperty(fd, props->props[i]);
+		if (!prop)
+			continue;
+
+		for (j = 0; j < count; j++) {
+			if (ids[j] || strcmp(prop->name, names[j]))
+				continue;
+
+			ids[j] = prop->prop_id;
+			if (values)
+				values[j] = props->prop_values[i];
+			found++;
+		}
+
+		drmModeFreeProperty(prop);
+	}
+
+	drmModeFreeObjectProperties(props);
+
+	return found == count ? 0 : -1;
+}
+#endif
+
 static void
 drm_fb_destroy_callback(struct gbm_bo *bo, void *data)
 {
@@ -414,14 +638,180 @@ drm_fb_set_buffer(struct drm_fb *fb, struct weston_buffer *buffer)
 	weston_buffer_reference(&fb->buffer_ref, buffer);
 }
 
+static void
+drm_gem_handle_close(struct drm_compositor *c, uint32_t handle)
+{
+	struct drm_gem_close close_arg;
+
+	memset(&close_arg, 0, sizeof close_arg);
+	close_arg.handle = handle;
+	drmIoctl(c->drm.fd, DRM_IOCTL_GEM_CLOSE, &close_arg);
+}
+
+/*
+ * Importing a dmabuf again returns the gem handle it already has, so fbs
+ * of the same buffer share their handles. The handle is closed once the
+ * last of them is gone.
+ */
+static int
+drm_gem_handle_ref(struct drm_compositor *c, uint32_t handle)
+{
+	struct drm_gem_handle *h;
+
+	wl_array_for_each(h, &c->gem_handles) {
+		if (h->handle == handle) {
+			h->refcount++;
+			return 0;
+		}
+	}
+
+	h = wl_array_add(&c->gem_handles, sizeof *h);
+	if (!h) {
+		drm_gem_handle_close(c, handle);
+		return -1;
+	}
+
+	h->handle = handle;
+	h->refcount = 1;
+
+	return 0;
+}
+
+static void
+drm_gem_handle_unref(struct drm_compositor *c, uint32_t handle)
+{
+	struct drm_gem_handle *h, *last;
+
+	wl_array_for_each(h, &c->gem_handles) {
+		if (h->handle != handle)
+			continue;
+
+		if (--h->refcount > 0)
+			return;
+
+		drm_gem_handle_close(c, handle);
+
+		last = (struct drm_gem_handle *)
+			((char *) c->gem_handles.data +
+			 c->gem_handles.size - sizeof *last);
+		*h = *last;
+		c->gem_handles.size -= sizeof *last;
+		return;
+	}
+}
+
+static void
+drm_fb_destroy_dmabuf(struct drm_compositor *c, struct drm_fb *fb)
+{
+	int i;
+
+	if (fb->fb_id)
+		drmModeRmFB(fb->fd, fb->fb_id);
+
+	weston_buffer_reference(&fb->buffer_ref, NULL);
+
+	for (i = 0; i < fb->num_gem_handles; i++)
+		drm_gem_handle_unref(c, fb->gem_handles[i]);
+
+	free(fb);
+}
+
+/*
+ * With the v4l2 renderer, clients share their buffers as dmabufs through
+ * wl_kms. Describes the buffer if it's one of those.
+ */
+static int
+drm_get_dmabuf(struct drm_compositor *c, struct weston_buffer *buffer,
+	       struct v4l2_dmabuf_desc *desc)
+{
+	if (!c->use_v4l2 || c->no_addfb2 || !v4l2_renderer->get_dmabuf)
+		return -1;
+
+	if (v4l2_renderer->get_dmabuf(buffer, desc) < 0)
+		return -1;
+
+	if (c->min_width > (uint32_t) desc->width ||
+	    (uint32_t) desc->width > c->max_width ||
+	    c->min_height > (uint32_t) desc->height ||
+	    (uint32_t) desc->height > c->max_height)
+		return -1;
+
+	return 0;
+}
+
+static struct drm_fb *
+drm_fb_get_from_dmabuf(struct drm_compositor *c, struct weston_buffer *buffer,
+		       struct v4l2_dmabuf_desc *desc, uint32_t format)
+{
+	uint32_t handles[4] = { 0 }, pitches[4] = { 0 }, offsets[4] = { 0 };
+	struct drm_fb *fb;
+	int i, j;
+
+	fb = zalloc(sizeof *fb);
+	if (!fb)
+		return NULL;
+
+	fb->fd = c->drm.fd;
+
+	for (i = 0; i < desc->num_planes; i++) {
+		if (drmPrimeFDToHandle(c->drm.fd, desc->fds[i], &handles[i])) {
+			weston_log("failed to import dmabuf: %m\n");
+			goto err_free;
+		}
+		pitches[i] = desc->strides[i];
+		offsets[i] = desc->offsets[i];
+
+		/* planes may share a dmabuf, and so a gem handle */
+		for (j = 0; j < fb->num_gem_handles; j++) {
+			if (fb->gem_handles[j] == handles[i])
+				break;
+		}
+		if (j < fb->num_gem_handles)
+			continue;
+
+		if (drm_gem_handle_ref(c, handles[i]) < 0)
+			goto err_free;
+		fb->gem_handles[fb->num_gem_handles++] = handles[i];
+	}
+
+	fb->handle = handles[0];
+	fb->stride = pitches[0];
+
+	if (drmModeAddFB2(c->drm.fd, desc->width, desc->height, format,
+			  handles, pitches, offsets, &fb->fb_id, 0)) {
+		weston_log("addfb2 of dmabuf failed: %m\n");
+		goto err_free;
+	}
+
+	drm_fb_set_buffer(fb, buffer);
+
+	return fb;
+
+err_free:
+	drm_fb_destroy_dmabuf(c, fb);
+	return NULL;
+}
+
+static int
+drm_output_is_dumb(struct drm_output *output, struct drm_fb *fb)
+{
+	int i;
+
+	for (i = 0; i < output->dumb_count; i++) {
+		if (fb == output->dumb[i])
+			return 1;
+	}
+
+	return 0;
+}
+
 static void
 drm_output_release_fb(struct drm_output *output, struct drm_fb *fb)
 {
 	if (!fb)
 		return;
 
-	if (fb->map &&
-            (fb != output->dumb[0] && fb != output->dumb[1])) {
+	if (fb->map && !drm_output_is_dumb(output, fb)) {
 		drm_fb_destroy_dumb(fb);
 	} else if (fb->bo) {
 		if (fb->is_client_buffer)
@@ -429,18 +819,18 @@ drm_output_release_fb(struct drm_output *output, struct drm_fb *fb)
 		else
 			gbm_surface_release_buffer(output->surface,
 						   fb->bo);
+	} else if (fb->num_gem_handles) {
+		drm_fb_destroy_dmabuf((struct drm_compositor *)
+				      output->base.compositor, fb);
 	}
 }
 
 static uint32_t
 drm_output_check_scanout_format(struct drm_output *output,
-				struct weston_surface *es, struct gbm_bo *bo)
+				struct weston_surface *es, uint32_t format)
 {
-	uint32_t format;
 	pixman_region32_t r;
 
-	format = gbm_bo_get_format(bo);
-
 	if (format == GBM_FORMAT_ARGB8888) {
 		/* We can scanout an ARGB buffer if the surface's
 		 * opaque region covers the whole output, but we have
@@ -471,18 +861,36 @@ drm_output_prepare_scanout_view(struct weston_output *_output,
 		(struct drm_compositor *) output->base.compositor;
 	struct weston_buffer *buffer = ev->surface->buffer_ref.buffer;
 	struct weston_buffer_viewport *viewport = &ev->surface->buffer_viewport;
+	struct v4l2_dmabuf_desc desc;
 	struct gbm_bo *bo;
 	uint32_t format;
 
 	if (ev->geometry.x != output->base.x ||
 	    ev->geometry.y != output->base.y ||
-	    buffer == NULL || c->gbm == NULL ||
+	    buffer == NULL || (c->gbm == NULL && !c->use_v4l2) ||
 	    buffer->width != output->base.current_mode->width ||
 	    buffer->height != output->base.current_mode->height ||
 	    output->base.transform != viewport->buffer.transform ||
 	    ev->transform.enabled)
 		return NULL;
 
+	/* The renderer is bypassed entirely for the frame */
+	if (c->use_v4l2) {
+		if (drm_get_dmabuf(c, buffer, &desc) < 0)
+			return NULL;
+
+		format = drm_output_check_scanout_format(output, ev->surface,
+							 desc.format);
+		if (format == 0)
+			return NULL;
+
+		output->next = drm_fb_get_from_dmabuf(c, buffer, &desc, format);
+		if (!output->next)
+			return NULL;
+
+		return &output->fb_plane;
+	}
+
 	bo = gbm_bo_import(c->gbm, GBM_BO_IMPORT_WL_BUFFER,
 			   buffer->resource, GBM_BO_USE_SCANOUT);
 
@@ -490,7 +898,8 @@ drm_output_prepare_scanout_view(struct weston_output *_output,
 	if (!bo)
 		return NULL;
 
-	format = drm_output_check_scanout_format(output, ev->surface, bo);
+	format = drm_output_check_scanout_format(output, ev->surface,
+						 gbm_bo_get_format(bo));
 	if (format == 0) {
 		gbm_bo_destroy(bo);
 		return NULL;
@@ -530,55 +939,83 @@ drm_output_render_gl(struct drm_output *output, pixman_region32_t *damage)
 	}
 }
 
+/*
+ * Dumb buffers are rendered in turn. A frame is only rendered while at
+ * most two others are on screen or waiting for their page flip, so the
+ * next buffer is never in use. Its contents are as old as the number of
+ * frames rendered since, the damage of which has to be repainted as well.
+ */
 static void
-drm_output_render_pixman(struct drm_output *output, pixman_region32_t *damage)
+drm_output_next_dumb(struct drm_output *output, pixman_region32_t *damage,
+		     pixman_region32_t *total_damage)
 {
-	struct weston_compositor *ec = output->base.compositor;
-	pixman_region32_t total_damage, previous_damage;
+	int i;
 
-	pixman_region32_init(&total_damage);
-	pixman_region32_init(&previous_damage);
+	output->current_image = (output->current_image + 1) % output->dumb_count;
+	output->next = output->dumb[output->current_image];
+
+	for (i = 0; i < output->dumb_count; i++)
+		pixman_region32_union(&output->dumb_damage[i],
+				      &output->dumb_damage[i], damage);
 
-	pixman_region32_copy(&previous_damage, damage);
+	pixman_region32_copy(total_damage,
+			     &output->dumb_damage[output->current_image]);
+	pixman_region32_clear(&output->dumb_damage[output->current_image]);
+}
 
-	pixman_region32_union(&total_damage, damage, &output->previous_damage);
-	pixman_region32_copy(&output->previous_damage, &previous_damage);
+static void
+drm_output_init_dumb_damage(struct drm_output *output)
+{
+	int i;
 
-	output->current_image ^= 1;
+	for (i = 0; i < output->dumb_count; i++)
+		pixman_region32_init_rect(&output->dumb_damage[i],
+					  output->base.x, output->base.y,
+					  output->base.width, output->base.height);
+	output->current_image = 0;
+}
 
-	output->next = output->dumb[output->current_image];
+static void
+drm_output_fini_dumb_damage(struct drm_output *output)
+{
+	int i;
+
+	for (i = 0; i < output->dumb_count; i++)
+		pixman_region32_fini(&output->dumb_damage[i]);
+}
+
+static void
+drm_output_render_pixman(struct drm_output *output, pixman_region32_t *damage)
+{
+	struct weston_compositor *ec = output->base.compositor;
+	pixman_region32_t total_damage;
+
+	pixman_region32_init(&total_damage);
+
+	drm_output_next_dumb(output, damage, &total_damage);
 	pixman_renderer_output_set_buffer(&output->base,
 					  output->image[output->current_image]);
 
 	ec->renderer->repaint_output(&output->base, &total_damage);
 
 	pixman_region32_fini(&total_damage);
-	pixman_region32_fini(&previous_damage);
 }
 
 static void
 drm_output_render_v4l2(struct drm_output *output, pixman_region32_t *damage)
 {
 	struct weston_compositor *ec = output->base.compositor;
-	pixman_region32_t total_damage, previous_damage;
-
-	pixman_region32_init(&total_damage);
-	pixman_region32_init(&previous_damage);
 
-	pixman_region32_copy(&previous_damage, damage);
-
-	pixman_region32_union(&total_damage, damage, &output->previous_damage);
-	pixman_region32_copy(&output->previous_damage, &previous_damage);
-
-	output->current_image ^= 1;
+	output->current_image = (output->current_image + 1) % output->dumb_count;
 
 	output->next = output->dumb[output->current_image];
 	v4l2_renderer->set_output_buffer(&output->base, output->current_image);
 
-	ec->renderer->repaint_output(&output->base, &total_damage);
+	/* cleared by drm_output_v4l2_frame_notify() */
+	output->compose_pending = 1;
 
-	pixman_region32_fini(&total_damage);
-	pixman_region32_fini(&previous_damage);
+	/* the renderer accumulates the damage of each buffer itself */
+	ec->renderer->repaint_output(&output->base, damage);
 }
 
 static void
@@ -619,16 +1056,35 @@ drm_output_set_gamma(struct weston_output *output_base,
 		weston_log("set gamma failed: %m\n");
 }
 
+static int
+drm_output_flip(struct drm_output *output);
+
+static void
+drm_output_prepare_cursor(struct drm_output *output);
+
+static void
+drm_output_cursor_position(struct drm_output *output, struct weston_view *ev,
+			   int *x, int *y)
+{
+	*x = (ev->geometry.x - output->base.x) * output->base.current_scale;
+	*y = (ev->geometry.y - output->base.y) * output->base.current_scale;
+}
+
+/* The previous frame isn't on screen yet */
+static int
+drm_output_flip_busy(struct drm_output *output)
+{
+	return output->page_flip_pending || output->vblank_pending;
+}
+
 static int
 drm_output_repaint(struct weston_output *output_base,
 		   pixman_region32_t *damage)
 {
 	struct drm_output *output = (struct drm_output *) output_base;
-	struct drm_compositor *compositor =
-		(struct drm_compositor *) output->base.compositor;
-	struct drm_sprite *s;
-	struct drm_mode *mode;
-	int ret = 0;
+
+	/* the cursor view may be gone by the time the frame is flipped */
+	drm_output_prepare_cursor(output);
 
 	if (output->destroy_pending)
 		return -1;
@@ -638,6 +1094,428 @@ drm_output_repaint(struct weston_output *output_base,
 	if (!output->next)
 		return -1;
 
+	if (!output->compose_pending)
+		weston_output_repaint_composed(output_base);
+
+	output->frame_owed = 1;
+
+	/* The renderer is still composing, or the frame was rendered ahead
+	 * while the previous one waits for its page flip. Flip once both
+	 * are done, and let the main loop keep dispatching meanwhile. */
+	if (output->compose_pending || drm_output_flip_busy(output)) {
+		output->flip_deferred = 1;
+		return 0;
+	}
+
+	if (drm_output_flip(output) < 0) {
+		output->frame_owed = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+#ifdef HAVE_DRM_ATOMIC
+/* Shows fb on the plane, or disables it if fb is NULL. */
+static int
+drm_plane_add_state(drmModeAtomicReq *req, struct drm_sprite *p,
+		    uint32_t crtc_id, struct drm_fb *fb,
+		    int32_t x, int32_t y, uint32_t w, uint32_t h,
+		    uint32_t src_x, uint32_t src_y, uint32_t src_w, uint32_t src_h)
+{
+	uint64_t values[PLANE_PROP_COUNT];
+	int i, ret = 0;
+
+	values[PLANE_FB_ID] = fb ? fb->fb_id : 0;
+	values[PLANE_CRTC_ID] = fb ? crtc_id : 0;
+	values[PLANE_SRC_X] = src_x;
+	values[PLANE_SRC_Y] = src_y;
+	values[PLANE_SRC_W] = src_w;
+	values[PLANE_SRC_H] = src_h;
+	values[PLANE_CRTC_X] = (int64_t) x;
+	values[PLANE_CRTC_Y] = (int64_t) y;
+	values[PLANE_CRTC_W] = w;
+	values[PLANE_CRTC_H] = h;
+
+	for (i = PLANE_FB_ID; i < PLANE_PROP_COUNT; i++) {
+		if (drmModeAtomicAddProperty(req, p->plane_id,
+					     p->props[i], values[i]) < 0)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+/*
+ * Adds the primary plane showing fb and the overlays assigned to the
+ * output to an atomic request.
+ */
+static int
+drm_output_add_planes_state(struct drm_output *output, drmModeAtomicReq *req,
+			    struct drm_fb *fb)
+{
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->base.compositor;
+	struct weston_mode *mode = output->base.current_mode;
+	struct drm_sprite *s;
+	int ret;
+
+	ret = drm_plane_add_state(req, output->primary_sprite,
+				  output->crtc_id, fb,
+				  0, 0, mode->width, mode->height,
+				  0, 0, mode->width << 16, mode->height << 16);
+
+	wl_list_for_each(s, &c->sprite_list, link) {
+		if (s->type != DRM_PLANE_TYPE_OVERLAY || s->output != output ||
+		    (!s->current && !s->pending && !s->next))
+			continue;
+
+		if (drm_plane_add_state(req, s, output->crtc_id,
+					c->sprites_hidden ? NULL : s->next,
+					s->dest_x, s->dest_y,
+					s->dest_w, s->dest_h,
+					s->src_x, s->src_y,
+					s->src_w, s->src_h) < 0)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+static int
+drm_output_add_cursor_state(struct drm_output *output, drmModeAtomicReq *req)
+{
+	int x = output->cursor_x, y = output->cursor_y;
+
+	if (!output->cursor_sprite)
+		return 0;
+
+	if (!output->cursor_shown)
+		return drm_plane_add_state(req, output->cursor_sprite,
+					   output->crtc_id, NULL,
+					   0, 0, 0, 0, 0, 0, 0, 0);
+
+	output->cursor_plane.x = x;
+	output->cursor_plane.y = y;
+
+	return drm_plane_add_state(req, output->cursor_sprite, output->crtc_id,
+				   output->cursors[output->current_cursor].fb,
+				   x, y, 64, 64, 0, 0, 64 << 16, 64 << 16);
+}
+
+/*
+ * Fills in what a TEST_ONLY commit of the planes of the output checks.
+ * Returns -1 if there are too many overlays in use to tell.
+ */
+static int
+drm_output_planes_key(struct drm_output *output, struct drm_planes_key *key)
+{
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->base.compositor;
+	struct weston_mode *mode = output->base.current_mode;
+	struct drm_sprite *s;
+	int i;
+
+	/* compared with memcmp() */
+	memset(key, 0, sizeof *key);
+	key->width = mode->width;
+	key->height = mode->height;
+	key->stride = output->current->stride;
+	key->sprites_hidden = c->sprites_hidden;
+
+	wl_list_for_each(s, &c->sprite_list, link) {
+		if (s->type != DRM_PLANE_TYPE_OVERLAY || s->output != output ||
+		    (!s->current && !s->pending && !s->next))
+			continue;
+
+		if (key->count == DRM_PLANE_TEST_OVERLAYS)
+			return -1;
+
+		i = key->count++;
+		key->planes[i].plane_id = s->plane_id;
+		if (!s->next)
+			continue;
+
+		key->planes[i].shown = 1;
+		key->planes[i].format = s->format;
+		key->planes[i].stride = s->next->stride;
+		key->planes[i].src_x = s->src_x;
+		key->planes[i].src_y = s->src_y;
+		key->planes[i].src_w = s->src_w;
+		key->planes[i].src_h = s->src_h;
+		key->planes[i].dest_x = s->dest_x;
+		key->planes[i].dest_y = s->dest_y;
+		key->planes[i].dest_w = s->dest_w;
+		key->planes[i].dest_h = s->dest_h;
+	}
+
+	return 0;
+}
+
+/*
+ * Asks the kernel whether the overlays assigned to the output so far
+ * can be shown on top of its current frame.
+ */
+static int
+drm_output_test_planes(struct drm_output *output)
+{
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->base.compositor;
+	struct drm_plane_test *test;
+	struct drm_planes_key key;
+	drmModeAtomicReq *req;
+	int i, ret, cache;
+
+	if (!output->current)
+		return -1;
+
+	/* The scene is often the same as a few frames ago */
+	cache = drm_output_planes_key(output, &key) == 0;
+	for (i = 0; cache && i < DRM_PLANE_TEST_CACHE; i++) {
+		test = &output->plane_tests[i];
+		if (test->valid && !memcmp(&test->key, &key, sizeof key))
+			return test->result;
+	}
+
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -1;
+
+	ret = drm_output_add_planes_state(output, req, output->current);
+	if (ret == 0)
+		ret = drmModeAtomicCommit(c->drm.fd, req,
+					  DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+
+	drmModeAtomicFree(req);
+
+	ret = ret ? -1 : 0;
+	if (!cache)
+		return ret;
+
+	test = &output->plane_tests[output->plane_test_next];
+	test->valid = 1;
+	test->key = key;
+	test->result = ret;
+	output->plane_test_next =
+		(output->plane_test_next + 1) % DRM_PLANE_TEST_CACHE;
+
+	return ret;
+}
+
+/*
+ * Asks the kernel whether the cursor can be shown at the position of the
+ * view. Drivers may reject a cursor partly off the screen, for instance.
+ */
+static int
+drm_output_test_cursor(struct drm_output *output, struct weston_view *ev)
+{
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->base.compositor;
+	drmModeAtomicReq *req;
+	int x, y, ret;
+
+	if (!output->current)
+		return -1;
+
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -1;
+
+	drm_output_cursor_position(output, ev, &x, &y);
+	ret = drm_output_add_planes_state(output, req, output->current);
+	if (ret == 0)
+		ret = drm_plane_add_state(req, output->cursor_sprite,
+					  output->crtc_id,
+					  output->cursors[output->current_cursor].fb,
+					  x, y, 64, 64, 0, 0, 64 << 16, 64 << 16);
+	if (ret == 0)
+		ret = drmModeAtomicCommit(c->drm.fd, req,
+					  DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+
+	drmModeAtomicFree(req);
+
+	return ret ? -1 : 0;
+}
+
+/*
+ * Updates the CRTC, the primary plane, the overlays and the cursor of
+ * the output with a single commit. Its completion is reported to
+ * page_flip_handler().
+ */
+static int
+drm_output_flip_atomic(struct drm_output *output)
+{
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->base.compositor;
+	uint32_t flags = DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT;
+	struct drm_sprite *s;
+	struct drm_mode *mode;
+	drmModeAtomicReq *req;
+	uint32_t blob = 0;
+	int ret = 0;
+
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -1;
+
+	mode = container_of(output->base.current_mode, struct drm_mode, base);
+	if (!output->current ||
+	    output->current->stride != output->next->stride) {
+		if (drmModeCreatePropertyBlob(c->drm.fd, &mode->mode_info,
+					      sizeof mode->mode_info, &blob)) {
+			weston_log("failed to create mode blob: %m\n");
+			drmModeAtomicFree(req);
+			return -1;
+		}
+
+		if (drmModeAtomicAddProperty(req, output->crtc_id,
+					     output->crtc_props[CRTC_MODE_ID],
+					     blob) < 0 ||
+		    drmModeAtomicAddProperty(req, output->crtc_id,
+					     output->crtc_props[CRTC_ACTIVE],
+					     1) < 0 ||
+		    drmModeAtomicAddProperty(req, output->connector_id,
+					     output->connector_props[CONNECTOR_CRTC_ID],
+					     output->crtc_id) < 0)
+			ret = -1;
+
+		flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+	}
+
+	if (drm_output_add_planes_state(output, req, output->next) < 0 ||
+	    drm_output_add_cursor_state(output, req) < 0)
+		ret = -1;
+
+	if (ret == 0)
+		ret = drmModeAtomicCommit(c->drm.fd, req, flags, output);
+
+	drmModeAtomicFree(req);
+
+	if (ret) {
+		weston_log("atomic commit failed: %m\n");
+		if (blob)
+			drmModeDestroyPropertyBlob(c->drm.fd, blob);
+
+		/* the overlays keep showing their current buffers */
+		wl_list_for_each(s, &c->sprite_list, link) {
+			if (s->type != DRM_PLANE_TYPE_OVERLAY ||
+			    s->output != output || !s->next)
+				continue;
+
+			drm_output_release_fb(output, s->next);
+			s->next = NULL;
+		}
+		return -1;
+	}
+
+	if (blob) {
+		if (output->mode_blob)
+			drmModeDestroyPropertyBlob(c->drm.fd, output->mode_blob);
+		output->mode_blob = blob;
+	}
+
+	output->page_flip_pending = 1;
+
+	return 0;
+}
+#endif
+
+static void
+drm_output_finish_frame_now(struct drm_output *output);
+
+static void
+drm_output_finish_idle(void *data)
+{
+	struct drm_output *output = data;
+
+	output->finish_idle = NULL;
+
+	if (!output->frame_owed || output->destroy_pending)
+		return;
+
+	output->frame_owed = 0;
+	drm_output_finish_frame_now(output);
+}
+
+/*
+ * The frame is in the kernel's hands. With a buffer left to render into,
+ * the next frame may be rendered while this one waits for its page flip.
+ */
+static void
+drm_output_frame_queued(struct drm_output *output)
+{
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->base.compositor;
+	struct wl_event_loop *loop;
+	struct drm_sprite *s;
+
+	output->pending = output->next;
+	output->next = NULL;
+
+	wl_list_for_each(s, &c->sprite_list, link) {
+		if (s->type != DRM_PLANE_TYPE_OVERLAY || s->output != output)
+			continue;
+
+		s->pending = s->next;
+		s->next = NULL;
+	}
+
+	/* current, pending and the buffer to render next */
+	if (!output->frame_owed || output->dumb_count < 3 ||
+	    output->finish_idle)
+		return;
+
+	/* not from within the repaint that queued the frame */
+	loop = wl_display_get_event_loop(c->base.wl_display);
+	output->finish_idle =
+		wl_event_loop_add_idle(loop, drm_output_finish_idle, output);
+}
+
+/* With atomic commits, the overlays are flipped along with the output. */
+static void
+drm_output_flip_sprites(struct drm_output *output)
+{
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->base.compositor;
+	struct drm_sprite *s;
+
+	wl_list_for_each(s, &c->sprite_list, link) {
+		if (s->type != DRM_PLANE_TYPE_OVERLAY || s->output != output)
+			continue;
+
+		drm_output_release_fb(output, s->current);
+		s->current = s->pending;
+		s->pending = NULL;
+	}
+}
+
+static int
+drm_output_flip(struct drm_output *output)
+{
+	struct weston_output *output_base = &output->base;
+	struct drm_compositor *compositor =
+		(struct drm_compositor *) output->base.compositor;
+	struct drm_sprite *s;
+	struct drm_mode *mode;
+	int ret = 0;
+
+#ifdef HAVE_DRM_ATOMIC
+	if (compositor->atomic_modeset) {
+		if (drm_output_flip_atomic(output) == 0) {
+			drm_output_frame_queued(output);
+			return 0;
+		}
+
+		/* a frame lost on a running output */
+		if (output->current)
+			goto err_pageflip;
+
+		/* the kernel doesn't take what we build. keep going without. */
+		weston_log("falling back to legacy modesetting\n");
+		compositor->atomic_modeset = 0;
+	}
+#endif
+
 	mode = container_of(output->base.current_mode, struct drm_mode, base);
 	if (!output->current ||
 	    output->current->stride != output->next->stride) {
@@ -673,7 +1551,8 @@ drm_output_repaint(struct weston_output *output_base,
 			.request.sequence = 1,
 		};
 
-		if ((!s->current && !s->next) ||
+		if (s->type != DRM_PLANE_TYPE_OVERLAY ||
+		    (!s->current && !s->pending && !s->next) ||
 		    !drm_sprite_crtc_supported(output_base, s->possible_crtcs))
 			continue;
 
@@ -708,10 +1587,11 @@ drm_output_repaint(struct weston_output *output_base,
 		output->vblank_pending = 1;
 	}
 
+	drm_output_frame_queued(output);
+
 	return 0;
 
 err_pageflip:
-	output->cursor_view = NULL;
 	if (output->next) {
 		drm_output_release_fb(output, output->next);
 		output->next = NULL;
@@ -738,6 +1618,10 @@ drm_output_start_repaint_loop(struct weston_output *output_base)
 		goto finish_frame;
 	}
 
+	/* A frame rendered ahead is still waiting for its page flip */
+	if (drm_output_flip_busy(output))
+		goto finish_frame;
+
 	fb_id = output->current->fb_id;
 
 	if (drmModePageFlip(compositor->drm.fd, output->crtc_id, fb_id,
@@ -746,6 +1630,8 @@ drm_output_start_repaint_loop(struct weston_output *output_base)
 		goto finish_frame;
 	}
 
+	output->frame_owed = 1;
+
 	return;
 
 finish_frame:
@@ -755,6 +1641,26 @@ finish_frame:
 	weston_output_finish_frame(output_base, msec);
 }
 
+/*
+ * The previous frame is on screen. Flips the frame rendered meanwhile,
+ * or lets the core render the next one.
+ */
+static void
+drm_output_frame_done(struct drm_output *output, uint32_t msecs)
+{
+	if (output->flip_deferred && !output->compose_pending) {
+		output->flip_deferred = 0;
+		if (drm_output_flip(output) == 0)
+			return;
+	}
+
+	if (output->flip_deferred || !output->frame_owed)
+		return;
+
+	output->frame_owed = 0;
+	weston_output_finish_frame(&output->base, msecs);
+}
+
 static void
 vblank_handler(int fd, unsigned int frame, unsigned int sec, unsigned int usec,
 	       void *data)
@@ -766,12 +1672,12 @@ vblank_handler(int fd, unsigned int frame, unsigned int sec, unsigned int usec,
 	output->vblank_pending = 0;
 
 	drm_output_release_fb(output, s->current);
-	s->current = s->next;
-	s->next = NULL;
+	s->current = s->pending;
+	s->pending = NULL;
 
 	if (!output->page_flip_pending) {
 		msecs = sec * 1000 + usec / 1000;
-		weston_output_finish_frame(&output->base, msecs);
+		drm_output_frame_done(output, msecs);
 	}
 }
 
@@ -783,6 +1689,8 @@ page_flip_handler(int fd, unsigned int frame,
 		  unsigned int sec, unsigned int usec, void *data)
 {
 	struct drm_output *output = (struct drm_output *) data;
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->base.compositor;
 	uint32_t msecs;
 
 	/* We don't set page_flip_pending on start_repaint_loop, in that case
@@ -790,17 +1698,20 @@ page_flip_handler(int fd, unsigned int frame,
 	 * timestamp */
 	if (output->page_flip_pending) {
 		drm_output_release_fb(output, output->current);
-		output->current = output->next;
-		output->next = NULL;
+		output->current = output->pending;
+		output->pending = NULL;
+
+		if (c->atomic_modeset)
+			drm_output_flip_sprites(output);
 	}
 
 	output->page_flip_pending = 0;
 
-	if (output->destroy_pending)
+	if (output->destroy_pending) {
 		drm_output_destroy(&output->base);
-	else if (!output->vblank_pending) {
+	} else if (!output->vblank_pending) {
 		msecs = sec * 1000 + usec / 1000;
-		weston_output_finish_frame(&output->base, msecs);
+		drm_output_frame_done(output, msecs);
 
 		/* We can't call this from frame_notify, because the output's
 		 * repaint needed flag is cleared just after that */
@@ -809,13 +1720,51 @@ page_flip_handler(int fd, unsigned int frame,
 	}
 }
 
+static void
+drm_output_finish_frame_now(struct drm_output *output)
+{
+	struct drm_compositor *compositor = (struct drm_compositor *)
+		output->base.compositor;
+	struct timespec ts;
+	uint32_t msec;
+
+	clock_gettime(compositor->clock, &ts);
+	msec = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	weston_output_finish_frame(&output->base, msec);
+}
+
+static void
+drm_output_v4l2_frame_notify(struct wl_listener *listener, void *data)
+{
+	struct drm_output *output =
+		container_of(listener, struct drm_output, v4l2_frame_listener);
+
+	output->compose_pending = 0;
+	weston_output_repaint_composed(&output->base);
+
+	/* Composed synchronously; drm_output_repaint() flips by itself. */
+	if (!output->flip_deferred)
+		return;
+
+	/* Rendered ahead; flipped once the previous frame is on screen.
+	 * An output to be destroyed goes once its page flip completes. */
+	if (drm_output_flip_busy(output) || output->destroy_pending)
+		return;
+
+	output->flip_deferred = 0;
+
+	/* If we cannot page-flip, immediately finish frame */
+	if (drm_output_flip(output) < 0) {
+		output->frame_owed = 0;
+		drm_output_finish_frame_now(output);
+	}
+}
+
 static uint32_t
 drm_output_check_sprite_format(struct drm_sprite *s,
-			       struct weston_view *ev, struct gbm_bo *bo)
+			       struct weston_view *ev, uint32_t format)
 {
-	uint32_t i, format;
-
-	format = gbm_bo_get_format(bo);
+	uint32_t i;
 
 	if (format == GBM_FORMAT_ARGB8888) {
 		pixman_region32_t r;
@@ -845,6 +1794,34 @@ drm_view_transform_supported(struct weston_view *ev)
 		(ev->transform.matrix.type < WESTON_MATRIX_TRANSFORM_ROTATE);
 }
 
+/*
+ * Whether the buffer of the view could be shown on an overlay of the
+ * output as it is, regardless of the overlays left and the views above.
+ */
+static int
+drm_view_overlay_eligible(struct weston_output *output_base,
+			  struct weston_view *ev)
+{
+	struct weston_buffer_viewport *viewport = &ev->surface->buffer_viewport;
+
+	if (viewport->buffer.transform != output_base->transform)
+		return 0;
+
+	if (viewport->buffer.scale != output_base->current_scale)
+		return 0;
+
+	if (ev->surface->buffer_ref.buffer == NULL)
+		return 0;
+
+	if (ev->alpha != 1.0f)
+		return 0;
+
+	if (wl_shm_buffer_get(ev->surface->buffer_ref.buffer->resource))
+		return 0;
+
+	return drm_view_transform_supported(ev);
+}
+
 static struct weston_plane *
 drm_output_prepare_overlay_view(struct weston_output *output_base,
 				struct weston_view *ev)
@@ -852,43 +1829,36 @@ drm_output_prepare_overlay_view(struct weston_output *output_base,
 	struct weston_compositor *ec = output_base->compositor;
 	struct drm_compositor *c =(struct drm_compositor *) ec;
 	struct weston_buffer_viewport *viewport = &ev->surface->buffer_viewport;
+	struct drm_output *output = (struct drm_output *) output_base;
+	struct weston_buffer *buffer = ev->surface->buffer_ref.buffer;
+	struct v4l2_dmabuf_desc desc;
 	struct drm_sprite *s;
 	int found = 0;
 	struct gbm_bo *bo;
 	pixman_region32_t dest_rect, src_rect;
 	pixman_box32_t *box, tbox;
 	uint32_t format;
-	wl_fixed_t sx1, sy1, sx2, sy2;
-
-	if (c->gbm == NULL)
-		return NULL;
-
-	if (viewport->buffer.transform != output_base->transform)
-		return NULL;
-
-	if (viewport->buffer.scale != output_base->current_scale)
-		return NULL;
-
-	if (c->sprites_are_broken)
-		return NULL;
-
-	if (ev->output_mask != (1u << output_base->id))
-		return NULL;
+	wl_fixed_t sx1, sy1, sx2, sy2;
 
-	if (ev->surface->buffer_ref.buffer == NULL)
+	if (c->gbm == NULL && !c->use_v4l2)
 		return NULL;
 
-	if (ev->alpha != 1.0f)
+	if (c->sprites_are_broken)
 		return NULL;
 
-	if (wl_shm_buffer_get(ev->surface->buffer_ref.buffer->resource))
+	if (ev->output_mask != (1u << output_base->id))
 		return NULL;
 
-	if (!drm_view_transform_supported(ev))
+	if (!drm_view_overlay_eligible(output_base, ev))
 		return NULL;
 
 	wl_list_for_each(s, &c->sprite_list, link) {
-		if (!drm_sprite_crtc_supported(output_base, s->possible_crtcs))
+		if (s->type != DRM_PLANE_TYPE_OVERLAY ||
+		    !drm_sprite_crtc_supported(output_base, s->possible_crtcs))
+			continue;
+
+		/* still shown on another output until its next commit */
+		if (c->atomic_modeset && s->current && s->output != output)
 			continue;
 
 		if (!s->next) {
@@ -901,25 +1871,39 @@ drm_output_prepare_overlay_view(struct weston_output *output_base,
 	if (!found)
 		return NULL;
 
-	bo = gbm_bo_import(c->gbm, GBM_BO_IMPORT_WL_BUFFER,
-			   ev->surface->buffer_ref.buffer->resource,
-			   GBM_BO_USE_SCANOUT);
-	if (!bo)
-		return NULL;
+	if (c->use_v4l2) {
+		if (drm_get_dmabuf(c, buffer, &desc) < 0)
+			return NULL;
 
-	format = drm_output_check_sprite_format(s, ev, bo);
-	if (format == 0) {
-		gbm_bo_destroy(bo);
-		return NULL;
-	}
+		format = drm_output_check_sprite_format(s, ev, desc.format);
+		if (format == 0)
+			return NULL;
 
-	s->next = drm_fb_get_from_bo(bo, c, format);
-	if (!s->next) {
-		gbm_bo_destroy(bo);
-		return NULL;
-	}
+		s->next = drm_fb_get_from_dmabuf(c, buffer, &desc, format);
+		if (!s->next)
+			return NULL;
+	} else {
+		bo = gbm_bo_import(c->gbm, GBM_BO_IMPORT_WL_BUFFER,
+				   buffer->resource, GBM_BO_USE_SCANOUT);
+		if (!bo)
+			return NULL;
+
+		format = drm_output_check_sprite_format(s, ev,
+							gbm_bo_get_format(bo));
+		if (format == 0) {
+			gbm_bo_destroy(bo);
+			return NULL;
+		}
+
+		s->next = drm_fb_get_from_bo(bo, c, format);
+		if (!s->next) {
+			gbm_bo_destroy(bo);
+			return NULL;
+		}
 
-	drm_fb_set_buffer(s->next, ev->surface->buffer_ref.buffer);
+		drm_fb_set_buffer(s->next, buffer);
+	}
+	s->format = format;
 
 	box = pixman_region32_extents(&ev->transform.boundingbox);
 	s->plane.x = box->x1;
@@ -986,6 +1970,20 @@ drm_output_prepare_overlay_view(struct weston_output *output_base,
 	s->src_h = (tbox.y2 - tbox.y1) << 8;
 	pixman_region32_fini(&src_rect);
 
+#ifdef HAVE_DRM_ATOMIC
+	if (c->atomic_modeset) {
+		struct drm_output *prev = s->output;
+
+		s->output = output;
+		if (drm_output_test_planes(output) < 0) {
+			drm_output_release_fb(output, s->next);
+			s->next = NULL;
+			s->output = prev;
+			return NULL;
+		}
+	}
+#endif
+
 	return &s->plane;
 }
 
@@ -997,12 +1995,17 @@ drm_output_prepare_cursor_view(struct weston_output *output_base,
 		(struct drm_compositor *) output_base->compositor;
 	struct weston_buffer_viewport *viewport = &ev->surface->buffer_viewport;
 	struct drm_output *output = (struct drm_output *) output_base;
+	struct wl_shm_buffer *shm_buffer;
+	int32_t scale = output_base->current_scale;
 
 	if (c->gbm == NULL)
 		return NULL;
 	if (output->base.transform != WL_OUTPUT_TRANSFORM_NORMAL)
 		return NULL;
-	if (viewport->buffer.scale != output_base->current_scale)
+	/* other buffer scales are scaled by drm_output_draw_cursor() */
+	if (viewport->buffer.transform != WL_OUTPUT_TRANSFORM_NORMAL ||
+	    viewport->buffer.src_width != wl_fixed_from_int(-1) ||
+	    viewport->surface.width != -1)
 		return NULL;
 	if (output->cursor_view)
 		return NULL;
@@ -1010,65 +2013,193 @@ drm_output_prepare_cursor_view(struct weston_output *output_base,
 		return NULL;
 	if (c->cursors_are_broken)
 		return NULL;
-	if (ev->surface->buffer_ref.buffer == NULL ||
-	    !wl_shm_buffer_get(ev->surface->buffer_ref.buffer->resource) ||
-	    ev->surface->width > 64 || ev->surface->height > 64)
+	if (c->atomic_modeset && !output->cursors[0].fb)
 		return NULL;
+	if (ev->surface->buffer_ref.buffer == NULL)
+		return NULL;
+	shm_buffer = wl_shm_buffer_get(ev->surface->buffer_ref.buffer->resource);
+	if (!shm_buffer ||
+	    (wl_shm_buffer_get_format(shm_buffer) != WL_SHM_FORMAT_ARGB8888 &&
+	     wl_shm_buffer_get_format(shm_buffer) != WL_SHM_FORMAT_XRGB8888) ||
+	    ev->surface->width * scale > 64 || ev->surface->height * scale > 64)
+		return NULL;
+#ifdef HAVE_DRM_ATOMIC
+	/* the renderer draws the cursor where the plane can't show it */
+	if (c->atomic_modeset && drm_output_test_cursor(output, ev) < 0)
+		return NULL;
+#endif
 
 	output->cursor_view = ev;
 
 	return &output->cursor_plane;
 }
 
+/*
+ * Draws the cursor view into a 64x64 image as shown on the output,
+ * scaled from the buffer scale to the output scale.
+ */
 static void
-drm_output_set_cursor(struct drm_output *output)
+drm_output_draw_cursor(struct drm_output *output, struct weston_view *ev,
+		       uint32_t *image)
+{
+	struct weston_buffer *buffer = ev->surface->buffer_ref.buffer;
+	int32_t buffer_scale = ev->surface->buffer_viewport.buffer.scale;
+	int32_t output_scale = output->base.current_scale;
+	int width = MIN(ev->surface->width * output_scale, 64);
+	int height = MIN(ev->surface->height * output_scale, 64);
+	uint32_t *src, *row, alpha = 0;
+	int stride, x, y;
+
+	memset(image, 0, 64 * 64 * 4);
+
+	/* the cursor bo is ARGB8888. the padding of XRGB8888 is garbage. */
+	if (wl_shm_buffer_get_format(buffer->shm_buffer) ==
+	    WL_SHM_FORMAT_XRGB8888)
+		alpha = 0xff000000;
+
+	stride = wl_shm_buffer_get_stride(buffer->shm_buffer);
+	src = wl_shm_buffer_get_data(buffer->shm_buffer);
+	wl_shm_buffer_begin_access(buffer->shm_buffer);
+	if (buffer_scale == output_scale) {
+		for (y = 0; y < height; y++)
+			memcpy(image + y * 64,
+			       (char *) src + y * stride, width * 4);
+	} else {
+		for (y = 0; y < height; y++) {
+			row = (uint32_t *) ((char *) src + y * buffer_scale /
+					    output_scale * stride);
+			for (x = 0; x < width; x++)
+				image[y * 64 + x] =
+					row[x * buffer_scale / output_scale];
+		}
+	}
+	wl_shm_buffer_end_access(buffer->shm_buffer);
+
+	if (alpha) {
+		for (y = 0; y < height; y++)
+			for (x = 0; x < width; x++)
+				image[y * 64 + x] |= alpha;
+	}
+}
+
+static uint32_t
+drm_cursor_hash(const uint32_t *image)
+{
+	uint32_t hash = 2166136261u;
+	int i;
+
+	for (i = 0; i < 64 * 64; i++)
+		hash = (hash ^ image[i]) * 16777619;
+
+	return hash;
+}
+
+/*
+ * Makes current the cursor bo holding the image of the cursor view,
+ * writing it into the least recently used bo if none does. Animated
+ * cursors cycle through a few images, which then only cost a handle
+ * swap. Returns 1 if the cursor bo to show changed.
+ */
+static int
+drm_output_update_cursor_bo(struct drm_output *output, struct weston_view *ev)
+{
+	struct weston_buffer *buffer = ev->surface->buffer_ref.buffer;
+	struct drm_cursor *cursor;
+	uint32_t image[64 * 64];
+	uint32_t hash;
+	int i, lru = -1;
+
+	if (!buffer ||
+	    !pixman_region32_not_empty(&output->cursor_plane.damage))
+		return 0;
+
+	pixman_region32_fini(&output->cursor_plane.damage);
+	pixman_region32_init(&output->cursor_plane.damage);
+
+	drm_output_draw_cursor(output, ev, image);
+	hash = drm_cursor_hash(image);
+	output->cursor_serial++;
+
+	for (i = 0; i < output->cursor_count; i++) {
+		cursor = &output->cursors[i];
+		if (cursor->valid && cursor->hash == hash &&
+		    !memcmp(cursor->image, image, sizeof image)) {
+			cursor->last_used = output->cursor_serial;
+			if (i == output->current_cursor)
+				return 0;
+
+			output->current_cursor = i;
+			return 1;
+		}
+
+		/* the current one may still be scanned out */
+		if (i != output->current_cursor &&
+		    (lru < 0 ||
+		     cursor->last_used < output->cursors[lru].last_used))
+			lru = i;
+	}
+
+	cursor = &output->cursors[lru];
+	if (gbm_bo_write(cursor->bo, image, sizeof image) < 0) {
+		weston_log("failed update cursor: %m\n");
+		cursor->valid = 0;
+	} else {
+		memcpy(cursor->image, image, sizeof image);
+		cursor->hash = hash;
+		cursor->valid = 1;
+	}
+	cursor->last_used = output->cursor_serial;
+	output->current_cursor = lru;
+
+	return 1;
+}
+
+/*
+ * Draws the cursor picked for the frame into its bo while the view is
+ * still around, and keeps what the flip needs to show it.
+ */
+static void
+drm_output_prepare_cursor(struct drm_output *output)
 {
 	struct weston_view *ev = output->cursor_view;
-	struct weston_buffer *buffer;
-	struct drm_compositor *c =
-		(struct drm_compositor *) output->base.compositor;
-	EGLint handle, stride;
-	struct gbm_bo *bo;
-	uint32_t buf[64 * 64];
-	unsigned char *s;
-	int i, x, y;
 
 	output->cursor_view = NULL;
-	if (ev == NULL) {
-		drmModeSetCursor(c->drm.fd, output->crtc_id, 0, 0, 0);
+	output->cursor_shown = ev != NULL;
+	output->cursor_changed = 0;
+	if (ev == NULL)
 		return;
-	}
 
-	buffer = ev->surface->buffer_ref.buffer;
+	output->cursor_changed = drm_output_update_cursor_bo(output, ev);
+	drm_output_cursor_position(output, ev,
+				   &output->cursor_x, &output->cursor_y);
+}
 
-	if (buffer &&
-	    pixman_region32_not_empty(&output->cursor_plane.damage)) {
-		pixman_region32_fini(&output->cursor_plane.damage);
-		pixman_region32_init(&output->cursor_plane.damage);
-		output->current_cursor ^= 1;
-		bo = output->cursor_bo[output->current_cursor];
-		memset(buf, 0, sizeof buf);
-		stride = wl_shm_buffer_get_stride(buffer->shm_buffer);
-		s = wl_shm_buffer_get_data(buffer->shm_buffer);
-		wl_shm_buffer_begin_access(buffer->shm_buffer);
-		for (i = 0; i < ev->surface->height; i++)
-			memcpy(buf + i * 64, s + i * stride,
-			       ev->surface->width * 4);
-		wl_shm_buffer_end_access(buffer->shm_buffer);
+static void
+drm_output_set_cursor(struct drm_output *output)
+{
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->base.compositor;
+	EGLint handle;
+	int x = output->cursor_x, y = output->cursor_y;
 
-		if (gbm_bo_write(bo, buf, sizeof buf) < 0)
-			weston_log("failed update cursor: %m\n");
+	if (!output->cursor_shown) {
+		drmModeSetCursor(c->drm.fd, output->crtc_id, 0, 0, 0);
+		output->cursor_set = 0;
+		return;
+	}
 
-		handle = gbm_bo_get_handle(bo).s32;
+	/* the cached image may be unchanged since the cursor was hidden */
+	if (output->cursor_changed || !output->cursor_set) {
+		output->cursor_changed = 0;
+		handle = gbm_bo_get_handle(output->cursors[output->current_cursor].bo).s32;
 		if (drmModeSetCursor(c->drm.fd,
 				     output->crtc_id, handle, 64, 64)) {
 			weston_log("failed to set cursor: %m\n");
 			c->cursors_are_broken = 1;
 		}
+		output->cursor_set = 1;
 	}
 
-	x = (ev->geometry.x - output->base.x) * output->base.current_scale;
-	y = (ev->geometry.y - output->base.y) * output->base.current_scale;
 	if (output->cursor_plane.x != x || output->cursor_plane.y != y) {
 		if (drmModeMoveCursor(c->drm.fd, output->crtc_id, x, y)) {
 			weston_log("failed to move cursor: %m\n");
@@ -1080,31 +2211,231 @@ drm_output_set_cursor(struct drm_output *output)
 	}
 }
 
+static void
+drm_view_state_destroy(struct drm_view_state *vs)
+{
+	wl_list_remove(&vs->view_destroy_listener.link);
+	wl_list_remove(&vs->link);
+	free(vs);
+}
+
+static void
+drm_view_state_handle_view_destroy(struct wl_listener *listener, void *data)
+{
+	struct drm_view_state *vs =
+		container_of(listener, struct drm_view_state,
+			     view_destroy_listener);
+
+	drm_view_state_destroy(vs);
+}
+
+/*
+ * A view has a single state, kept by the output it was last shown on
+ * alone. It's found through the destroy listener of the view.
+ */
+static struct drm_view_state *
+drm_output_find_view_state(struct drm_output *output, struct weston_view *ev)
+{
+	struct wl_listener *listener;
+	struct drm_view_state *vs;
+
+	listener = wl_signal_get(&ev->destroy_signal,
+				 drm_view_state_handle_view_destroy);
+	if (!listener)
+		return NULL;
+
+	vs = container_of(listener, struct drm_view_state,
+			  view_destroy_listener);
+	if (vs->output != output)
+		return NULL;
+
+	return vs;
+}
+
+static struct drm_view_state *
+drm_output_get_view_state(struct drm_output *output, struct weston_view *ev)
+{
+	struct wl_listener *listener;
+	struct drm_view_state *vs;
+
+	listener = wl_signal_get(&ev->destroy_signal,
+				 drm_view_state_handle_view_destroy);
+	if (listener) {
+		vs = container_of(listener, struct drm_view_state,
+				  view_destroy_listener);
+		if (vs->output == output)
+			return vs;
+
+		/* the view moved here. start over. */
+		drm_view_state_destroy(vs);
+	}
+
+	vs = zalloc(sizeof *vs);
+	if (!vs)
+		return NULL;
+
+	vs->output = output;
+	vs->view = ev;
+	vs->view_destroy_listener.notify = drm_view_state_handle_view_destroy;
+	wl_signal_add(&ev->destroy_signal, &vs->view_destroy_listener);
+	wl_list_insert(&output->view_states, &vs->link);
+
+	return vs;
+}
+
+/* Accounts the damage the view brings to this repaint, if any. */
+static void
+drm_view_state_update(struct drm_view_state *vs, uint32_t now)
+{
+	pixman_region32_t *damage = &vs->view->surface->damage;
+	pixman_box32_t *box;
+	uint32_t area;
+
+	if (!pixman_region32_not_empty(damage))
+		return;
+
+	box = pixman_region32_extents(damage);
+	area = (box->x2 - box->x1) * (box->y2 - box->y1);
+
+	if (vs->updates == 0) {
+		vs->interval = DRM_VIEW_IDLE_MSECS;
+		vs->area = area;
+	} else {
+		vs->interval = (vs->interval * 3 + now - vs->last_update) / 4;
+		vs->area = (vs->area * 3 + area) / 4;
+	}
+
+	vs->updates++;
+	vs->last_update = now;
+}
+
+/*
+ * Pixels per second the renderer would composite for the view. Views
+ * already on an overlay are favoured so assignments stay put while the
+ * scene is stable.
+ */
+static uint64_t
+drm_view_state_score(struct drm_view_state *vs, uint32_t now)
+{
+	uint32_t idle = now - vs->last_update;
+	uint32_t interval = vs->interval;
+	uint64_t score;
+
+	if (vs->updates == 0 || idle > DRM_VIEW_IDLE_MSECS)
+		return 0;
+
+	if (interval < idle)
+		interval = idle;
+	if (interval == 0)
+		interval = 1;
+
+	score = (uint64_t) vs->area * 1000 / interval;
+	if (vs->on_overlay)
+		score += score / 2;
+
+	return score;
+}
+
+/*
+ * The best scoring view not visited by drm_assign_planes() yet, which
+ * isn't a candidate already.
+ */
+static struct drm_view_state *
+drm_output_best_view_state(struct drm_output *output)
+{
+	struct drm_view_state *vs, *best = NULL;
+
+	wl_list_for_each(vs, &output->view_states, link) {
+		if (vs->overlay_candidate || vs->tried || vs->score == 0)
+			continue;
+		if (!best || vs->score > best->score)
+			best = vs;
+	}
+
+	return best;
+}
+
+/*
+ * Updates the statistics of the views only shown on the output, and
+ * picks as many of them as there are overlays to be tried on overlays.
+ * Views whose buffers can't be shown on an overlay at all aren't ranked.
+ */
+static void
+drm_output_select_overlay_views(struct drm_output *output)
+{
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->base.compositor;
+	uint32_t now = output->base.frame_time;
+	struct drm_view_state *vs, *tmp, *best;
+	struct weston_view *ev;
+	struct drm_sprite *s;
+	int count = 0;
+
+	wl_list_for_each(vs, &output->view_states, link)
+		vs->seen = 0;
+
+	wl_list_for_each(ev, &c->base.view_list, link) {
+		if (ev->output_mask != (1u << output->base.id))
+			continue;
+
+		vs = drm_output_get_view_state(output, ev);
+		if (!vs)
+			continue;
+
+		drm_view_state_update(vs, now);
+		vs->score = drm_view_state_score(vs, now);
+		if (!drm_view_overlay_eligible(&output->base, ev))
+			vs->score = 0;
+		vs->overlay_candidate = 0;
+		vs->tried = 0;
+		vs->seen = 1;
+	}
+
+	wl_list_for_each_safe(vs, tmp, &output->view_states, link) {
+		if (!vs->seen)
+			drm_view_state_destroy(vs);
+	}
+
+	wl_list_for_each(s, &c->sprite_list, link) {
+		if (s->type == DRM_PLANE_TYPE_OVERLAY &&
+		    drm_sprite_crtc_supported(&output->base, s->possible_crtcs))
+			count++;
+	}
+
+	while (count-- && (best = drm_output_best_view_state(output)))
+		best->overlay_candidate = 1;
+}
+
 static void
 drm_assign_planes(struct weston_output *output)
 {
 	struct drm_compositor *c =
 		(struct drm_compositor *) output->compositor;
+	struct drm_output *drm_output = (struct drm_output *) output;
 	struct weston_view *ev, *next;
+	struct drm_view_state *vs, *best;
 	pixman_region32_t overlap, surface_overlap;
 	struct weston_plane *primary, *next_plane;
 
 	/*
 	 * Find a surface for each sprite in the output using some heuristics:
-	 * 1) size
-	 * 2) frequency of update
-	 * 3) opacity (though some hw might support alpha blending)
-	 * 4) clipping (this can be fixed with color keys)
+	 * 1) size and frequency of update, scored by
+	 *    drm_output_select_overlay_views()
+	 * 2) opacity (though some hw might support alpha blending)
+	 * 3) clipping (this can be fixed with color keys)
 	 *
 	 * The idea is to save on blitting since this should save power.
 	 * If we can get a large video surface on the sprite for example,
 	 * the main display surface may not need to update at all, and
 	 * the client buffer can be used directly for the sprite surface
-	 * as we do for flipping full screen surfaces.
+	 * as we do for flipping full screen surfaces. With atomic
+	 * modesetting, the kernel checks each assignment before it's made.
 	 */
 	pixman_region32_init(&overlap);
 	primary = &c->base.primary_plane;
 
+	drm_output_select_overlay_views(drm_output);
+
 	wl_list_for_each_safe(ev, next, &c->base.view_list, link) {
 		struct weston_surface *es = ev->surface;
 
@@ -1135,8 +2466,28 @@ drm_assign_planes(struct weston_output *output)
 			next_plane = drm_output_prepare_cursor_view(output, ev);
 		if (next_plane == NULL)
 			next_plane = drm_output_prepare_scanout_view(output, ev);
-		if (next_plane == NULL)
+
+		vs = drm_output_find_view_state(drm_output, ev);
+		if (next_plane == NULL && vs && vs->overlay_candidate)
 			next_plane = drm_output_prepare_overlay_view(output, ev);
+		if (vs) {
+			vs->tried = 1;
+			vs->on_overlay = next_plane && next_plane != primary &&
+				next_plane != &drm_output->cursor_plane &&
+				next_plane != &drm_output->fb_plane;
+
+			/*
+			 * A candidate that didn't make it, e.g. as it's
+			 * occluded, leaves its overlay to the best one below.
+			 */
+			if (vs->overlay_candidate && !vs->on_overlay) {
+				vs->overlay_candidate = 0;
+				best = drm_output_best_view_state(drm_output);
+				if (best)
+					best->overlay_candidate = 1;
+			}
+		}
+
 		if (next_plane == NULL)
 			next_plane = primary;
 		weston_view_move_to_plane(ev, next_plane);
@@ -1162,6 +2513,8 @@ drm_output_destroy(struct weston_output *output_base)
 	struct drm_compositor *c =
 		(struct drm_compositor *) output->base.compositor;
 	drmModeCrtcPtr origcrtc = output->original_crtc;
+	struct drm_view_state *vs, *tmp;
+	struct drm_sprite *s;
 
 	if (output->page_flip_pending) {
 		output->destroy_pending = 1;
@@ -1169,6 +2522,17 @@ drm_output_destroy(struct weston_output *output_base)
 		return;
 	}
 
+	/* Drop a frame waiting to be flipped. The renderer finishes its
+	 * composition when the output is finalized below. */
+	if (output->flip_deferred) {
+		output->flip_deferred = 0;
+		drm_output_release_fb(output, output->next);
+		output->next = NULL;
+	}
+
+	if (output->finish_idle)
+		wl_event_source_remove(output->finish_idle);
+
 	if (output->backlight)
 		backlight_destroy(output->backlight);
 
@@ -1183,6 +2547,20 @@ drm_output_destroy(struct weston_output *output_base)
 		       &output->connector_id, 1, &origcrtc->mode);
 	drmModeFreeCrtc(origcrtc);
 
+#ifdef HAVE_DRM_ATOMIC
+	if (output->mode_blob)
+		drmModeDestroyPropertyBlob(c->drm.fd, output->mode_blob);
+#endif
+
+	wl_list_for_each_safe(vs, tmp, &output->view_states, link)
+		drm_view_state_destroy(vs);
+
+	/* Let other outputs claim the planes */
+	wl_list_for_each(s, &c->sprite_list, link) {
+		if (s->output == output)
+			s->output = NULL;
+	}
+
 	c->crtc_allocator &= ~(1 << output->crtc_id);
 	c->connector_allocator &= ~(1 << output->connector_id);
 
@@ -1272,8 +2650,9 @@ drm_output_switch_mode(struct weston_output *output_base, struct weston_mode *mo
 
 	/* reset rendering stuff. */
 	drm_output_release_fb(output, output->current);
+	drm_output_release_fb(output, output->pending);
 	drm_output_release_fb(output, output->next);
-	output->current = output->next = NULL;
+	output->current = output->pending = output->next = NULL;
 
 	if (ec->use_pixman) {
 		drm_output_fini_pixman(output);
@@ -1300,6 +2679,14 @@ drm_output_switch_mode(struct weston_output *output_base, struct weston_mode *mo
 		}
 	}
 
+	/* The frame being composed or rendered ahead was dropped with the
+	 * old state. */
+	if (output->flip_deferred) {
+		output->flip_deferred = 0;
+		output->frame_owed = 0;
+		drm_output_finish_frame_now(output);
+	}
+
 	return 0;
 }
 
@@ -1351,6 +2738,20 @@ init_drm(struct drm_compositor *ec, struct udev_device *device)
 		ec->clock = CLOCK_MONOTONIC;
 	else
 		ec->clock = CLOCK_REALTIME;
+	ec->base.presentation_clock = ec->clock;
+
+#ifdef HAVE_DRM_ATOMIC
+	/* Atomic commits need the primary and cursor planes exposed too */
+	if (!getenv("WESTON_DISABLE_ATOMIC") &&
+	    drmSetClientCap(fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) == 0) {
+		if (drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1) == 0)
+			ec->atomic_modeset = 1;
+		else
+			drmSetClientCap(fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 0);
+	}
+#endif
+	weston_log("atomic modesetting %s\n",
+		   ec->atomic_modeset ? "enabled" : "disabled");
 
 	return 0;
 }
@@ -1623,16 +3024,17 @@ drm_output_init_egl(struct drm_output *output, struct drm_compositor *ec)
 
 	flags = GBM_BO_USE_CURSOR_64X64 | GBM_BO_USE_WRITE;
 
-	for (i = 0; i < 2; i++) {
-		if (output->cursor_bo[i])
-			continue;
-
-		output->cursor_bo[i] =
+	for (i = output->cursor_count; i < DRM_CURSOR_CACHE; i++) {
+		output->cursors[i].bo =
 			gbm_bo_create(ec->gbm, 64, 64, GBM_FORMAT_ARGB8888,
 				      flags);
+		if (!output->cursors[i].bo)
+			break;
+		output->cursor_count++;
 	}
 
-	if (output->cursor_bo[0] == NULL || output->cursor_bo[1] == NULL) {
+	/* one to show while the other is written */
+	if (output->cursor_count < 2) {
 		weston_log("cursor buffers unavailable, using gl cursors\n");
 		ec->cursors_are_broken = 1;
 	}
@@ -1649,7 +3051,8 @@ drm_output_init_pixman(struct drm_output *output, struct drm_compositor *c)
 
 	/* FIXME error checking */
 
-	for (i = 0; i < ARRAY_LENGTH(output->dumb); i++) {
+	output->dumb_count = c->dumb_count;
+	for (i = 0; i < output->dumb_count; i++) {
 		output->dumb[i] = drm_fb_create_dumb(c, w, h);
 		if (!output->dumb[i])
 			goto err;
@@ -1665,13 +3068,12 @@ drm_output_init_pixman(struct drm_output *output, struct drm_compositor *c)
 	if (pixman_renderer_output_create(&output->base) < 0)
 		goto err;
 
-	pixman_region32_init_rect(&output->previous_damage,
-				  output->base.x, output->base.y, output->base.width, output->base.height);
+	drm_output_init_dumb_damage(output);
 
 	return 0;
 
 err:
-	for (i = 0; i < ARRAY_LENGTH(output->dumb); i++) {
+	for (i = 0; i < output->dumb_count; i++) {
 		if (output->dumb[i])
 			drm_fb_destroy_dumb(output->dumb[i]);
 		if (output->image[i])
@@ -1690,9 +3092,9 @@ drm_output_fini_pixman(struct drm_output *output)
 	unsigned int i;
 
 	pixman_renderer_output_destroy(&output->base);
-	pixman_region32_fini(&output->previous_damage);
+	drm_output_fini_dumb_damage(output);
 
-	for (i = 0; i < ARRAY_LENGTH(output->dumb); i++) {
+	for (i = 0; i < output->dumb_count; i++) {
 		drm_fb_destroy_dumb(output->dumb[i]);
 		pixman_image_unref(output->image[i]);
 		output->dumb[i] = NULL;
@@ -1706,9 +3108,10 @@ drm_output_init_v4l2(struct drm_output *output, struct drm_compositor *c)
 	int w = output->base.current_mode->width;
 	int h = output->base.current_mode->height;
 	unsigned int i;
-	struct v4l2_bo_state bo_state[ARRAY_LENGTH(output->dumb)];
+	struct v4l2_bo_state bo_state[DRM_DUMB_MAX];
 
-	for (i = 0; i < ARRAY_LENGTH(output->dumb); i++) {
+	output->dumb_count = c->dumb_count;
+	for (i = 0; i < output->dumb_count; i++) {
 		output->dumb[i] = drm_fb_create_dumb(c, w, h);
 		if (!output->dumb[i])
 			goto err;
@@ -1717,16 +3120,18 @@ drm_output_init_v4l2(struct drm_output *output, struct drm_compositor *c)
 		bo_state[i].stride = output->dumb[i]->stride;
 	}
 
-	if (v4l2_renderer->output_create(&output->base, bo_state, ARRAY_LENGTH(output->dumb)) < 0)
+	if (v4l2_renderer->output_create(&output->base, bo_state, output->dumb_count) < 0)
 		goto err;
 
-	pixman_region32_init_rect(&output->previous_damage,
-				  output->base.x, output->base.y, output->base.width, output->base.height);
+	output->v4l2_frame_listener.notify = drm_output_v4l2_frame_notify;
+	wl_signal_add(&output->base.frame_signal, &output->v4l2_frame_listener);
+
+	output->current_image = 0;
 
 	return 0;
 
 err:
-	for (i = 0; i < ARRAY_LENGTH(output->dumb); i++) {
+	for (i = 0; i < output->dumb_count; i++) {
 		if (output->dumb[i])
 			drm_fb_destroy_dumb(output->dumb[i]);
 
@@ -1741,9 +3146,12 @@ drm_output_fini_v4l2(struct drm_output *output)
 {
 	unsigned int i;
 
+	wl_list_remove(&output->v4l2_frame_listener.link);
+	output->compose_pending = 0;
+
 	v4l2_renderer->output_destroy(&output->base);
 
-	for (i = 0; i < ARRAY_LENGTH(output->dumb); i++) {
+	for (i = 0; i < output->dumb_count; i++) {
 		drm_fb_destroy_dumb(output->dumb[i]);
 		output->dumb[i] = NULL;
 	}
@@ -2004,6 +3412,47 @@ get_gbm_format_from_section(struct weston_config_section *section,
 	return ret;
 }
 
+#ifdef HAVE_DRM_ATOMIC
+/*
+ * Looks up the properties atomic commits set on the CRTC and connector,
+ * and claims a primary and a cursor plane for the output.
+ */
+static int
+drm_output_init_atomic(struct drm_output *output, struct drm_compositor *c)
+{
+	struct drm_sprite *s;
+
+	if (drm_get_prop_ids(c->drm.fd, output->crtc_id, DRM_MODE_OBJECT_CRTC,
+			     crtc_prop_names, CRTC_PROP_COUNT,
+			     output->crtc_props, NULL) < 0 ||
+	    drm_get_prop_ids(c->drm.fd, output->connector_id,
+			     DRM_MODE_OBJECT_CONNECTOR,
+			     connector_prop_names, CONNECTOR_PROP_COUNT,
+			     output->connector_props, NULL) < 0)
+		return -1;
+
+	wl_list_for_each(s, &c->sprite_list, link) {
+		if (s->output ||
+		    !drm_sprite_crtc_supported(&output->base, s->possible_crtcs))
+			continue;
+
+		if (s->type == DRM_PLANE_TYPE_PRIMARY && !output->primary_sprite)
+			output->primary_sprite = s;
+		else if (s->type == DRM_PLANE_TYPE_CURSOR && !output->cursor_sprite)
+			output->cursor_sprite = s;
+		else
+			continue;
+
+		s->output = output;
+	}
+
+	if (!output->primary_sprite)
+		return -1;
+
+	return 0;
+}
+#endif
+
 static int
 create_output_for_connector(struct drm_compositor *ec,
 			    drmModeRes *resources,
@@ -2038,6 +3487,7 @@ create_output_for_connector(struct drm_compositor *ec,
 	output->base.model = "unknown";
 	output->base.serial_number = "unknown";
 	wl_list_init(&output->base.mode_list);
+	wl_list_init(&output->view_states);
 
 	if (connector->connector_type < ARRAY_LENGTH(connector_type_names))
 		type_name = connector_type_names[connector->connector_type];
@@ -2170,6 +3620,18 @@ create_output_for_connector(struct drm_compositor *ec,
 			   connector->mmWidth, connector->mmHeight,
 			   transform, scale);
 
+	weston_config_section_get_string(section, "repaint-window", &s, NULL);
+	weston_output_set_repaint_window(&output->base, s);
+	free(s);
+
+#ifdef HAVE_DRM_ATOMIC
+	if (ec->atomic_modeset && drm_output_init_atomic(output, ec) < 0) {
+		weston_log("no atomic state for %s, "
+			   "using legacy modesetting\n", output->base.name);
+		ec->atomic_modeset = 0;
+	}
+#endif
+
 	if (ec->use_pixman) {
 		if (drm_output_init_pixman(output, ec) < 0) {
 			weston_log("Failed to init output pixman state\n");
@@ -2185,6 +3647,14 @@ create_output_for_connector(struct drm_compositor *ec,
 		goto err_output;
 	}
 
+	if (ec->atomic_modeset && output->cursor_sprite &&
+	    output->cursor_count >= 2) {
+		for (i = 0; i < output->cursor_count; i++)
+			output->cursors[i].fb =
+				drm_fb_get_from_bo(output->cursors[i].bo, ec,
+						   GBM_FORMAT_ARGB8888);
+	}
+
 	output->backlight = backlight_init(drm_device,
 					   connector->connector_type);
 	if (output->backlight) {
@@ -2282,15 +3752,39 @@ create_sprites(struct drm_compositor *ec)
 		sprite->possible_crtcs = plane->possible_crtcs;
 		sprite->plane_id = plane->plane_id;
 		sprite->current = NULL;
+		sprite->pending = NULL;
 		sprite->next = NULL;
 		sprite->compositor = ec;
 		sprite->count_formats = plane->count_formats;
+		sprite->type = DRM_PLANE_TYPE_OVERLAY;
 		memcpy(sprite->formats, plane->formats,
 		       plane->count_formats * sizeof(plane->formats[0]));
 		drmModeFreePlane(plane);
-		weston_plane_init(&sprite->plane, &ec->base, 0, 0);
-		weston_compositor_stack_plane(&ec->base, &sprite->plane,
-					      &ec->base.primary_plane);
+
+#ifdef HAVE_DRM_ATOMIC
+		if (ec->atomic_modeset) {
+			uint64_t values[PLANE_PROP_COUNT];
+
+			if (drm_get_prop_ids(ec->drm.fd, sprite->plane_id,
+					     DRM_MODE_OBJECT_PLANE,
+					     plane_prop_names,
+					     PLANE_PROP_COUNT,
+					     sprite->props, values) < 0) {
+				weston_log("plane %u lacks atomic properties, "
+					   "skipping\n", sprite->plane_id);
+				free(sprite);
+				continue;
+			}
+			sprite->type = values[PLANE_TYPE];
+		}
+#endif
+
+		/* Primary and cursor planes are claimed by the outputs */
+		if (sprite->type == DRM_PLANE_TYPE_OVERLAY) {
+			weston_plane_init(&sprite->plane, &ec->base, 0, 0);
+			weston_compositor_stack_plane(&ec->base, &sprite->plane,
+						      &ec->base.primary_plane);
+		}
 
 		wl_list_insert(&ec->sprite_list, &sprite->link);
 	}
@@ -2308,11 +3802,17 @@ destroy_sprites(struct drm_compositor *compositor)
 			      struct drm_output, base.link);
 
 	wl_list_for_each_safe(sprite, next, &compositor->sprite_list, link) {
+		if (sprite->type != DRM_PLANE_TYPE_OVERLAY) {
+			free(sprite);
+			continue;
+		}
+
 		drmModeSetPlane(compositor->drm.fd,
 				sprite->plane_id,
 				output->crtc_id, 0, 0,
 				0, 0, 0, 0, 0, 0, 0, 0);
 		drm_output_release_fb(output, sprite->current);
+		drm_output_release_fb(output, sprite->pending);
 		drm_output_release_fb(output, sprite->next);
 		weston_plane_release(&sprite->plane);
 		free(sprite);
@@ -2506,6 +4006,8 @@ drm_destroy(struct weston_compositor *ec)
 
 	weston_compositor_shutdown(ec);
 
+	wl_array_release(&d->gem_handles);
+
 	if (d->gbm)
 		gbm_device_destroy(d->gbm);
 
@@ -2580,16 +4082,20 @@ session_notify(struct wl_listener *listener, void *data)
 		wl_list_for_each(output, &ec->base.output_list, base.link) {
 			output->base.repaint_needed = 0;
 			drmModeSetCursor(ec->drm.fd, output->crtc_id, 0, 0, 0);
+			output->cursor_set = 0;
 		}
 
 		output = container_of(ec->base.output_list.next,
 				      struct drm_output, base.link);
 
-		wl_list_for_each(sprite, &ec->sprite_list, link)
+		wl_list_for_each(sprite, &ec->sprite_list, link) {
+			if (sprite->type != DRM_PLANE_TYPE_OVERLAY)
+				continue;
 			drmModeSetPlane(ec->drm.fd,
 					sprite->plane_id,
 					output->crtc_id, 0, 0,
 					0, 0, 0, 0, 0, 0, 0, 0);
+		}
 	};
 }
 
@@ -2657,6 +4163,23 @@ find_primary_gpu(struct drm_compositor *ec, const char *seat)
 	return drm_device;
 }
 
+/*
+ * Use the given card rather than the primary one, e.g. a virtual one
+ * such as vkms to run the tests on.
+ */
+static struct udev_device*
+find_gpu(struct drm_compositor *ec, const char *name)
+{
+	struct udev_device *device;
+
+	device = udev_device_new_from_subsystem_sysname(ec->udev, "drm",
+							 name);
+	if (!device)
+		weston_log("drm device %s not found\n", name);
+
+	return device;
+}
+
 static void
 planes_binding(struct weston_seat *seat, uint32_t time, uint32_t key, void *data)
 {
@@ -2863,6 +4386,17 @@ drm_compositor_create(struct wl_display *display,
 	ec->use_pixman = param->use_pixman;
 	ec->use_v4l2 = param->use_v4l2;
 
+	/*
+	 * With more than two buffers, a frame can be rendered while the
+	 * previous one waits for its page flip.
+	 */
+	weston_config_section_get_int(section, "dumb-buffers",
+				      &ec->dumb_count, 2);
+	if (ec->dumb_count < 2)
+		ec->dumb_count = 2;
+	if (ec->dumb_count > DRM_DUMB_MAX)
+		ec->dumb_count = DRM_DUMB_MAX;
+
 	if (weston_compositor_init(&ec->base, display, argc, argv,
 				   config) < 0) {
 		weston_log("%s failed\n", __func__);
@@ -2888,7 +4422,10 @@ drm_compositor_create(struct wl_display *display,
 	ec->session_listener.notify = session_notify;
 	wl_signal_add(&ec->base.session_signal, &ec->session_listener);
 
-	drm_device = find_primary_gpu(ec, param->seat_id);
+	if (param->device)
+		drm_device = find_gpu(ec, param->device);
+	else
+		drm_device = find_primary_gpu(ec, param->seat_id);
 	if (drm_device == NULL) {
 		weston_log("no drm device found\n");
 		goto err_udev;
@@ -2928,6 +4465,7 @@ drm_compositor_create(struct wl_display *display,
 						  switch_vt_binding, ec);
 
 	wl_list_init(&ec->sprite_list);
+	wl_array_init(&ec->gem_handles);
 	create_sprites(ec);
 
 	if (udev_input_init(&ec->input,
@@ -3018,6 +4556,7 @@ backend_init(struct wl_display *display, int *argc, char *argv[],
 	const struct weston_option drm_options[] = {
 		{ WESTON_OPTION_INTEGER, "connector", 0, &param.connector },
 		{ WESTON_OPTION_STRING, "seat", 0, &param.seat_id },
+		{ WESTON_OPTION_STRING, "drm-device", 0, &param.device },
 		{ WESTON_OPTION_INTEGER, "tty", 0, &param.tty },
 		{ WESTON_OPTION_BOOLEAN, "current-mode", 0, &option_current_mode },
 		{ WESTON_OPTION_BOOLEAN, "use-pixman", 0, &param.use_pixman },
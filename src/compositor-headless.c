@@ -23,23 +23,63 @@
 
 #include "config.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <sys/time.h>
 
 #include "compositor.h"
 
+#ifdef ENABLE_V4L2
+#include <xf86drm.h>
+#include "v4l2-renderer.h"
+#endif
+
 struct headless_compositor {
 	struct weston_compositor base;
 	struct weston_seat fake_seat;
+
+	int use_v4l2;
+	struct {
+		int fd;
+		char *filename;
+	} drm;
+};
+
+struct headless_dumb {
+	uint32_t handle, stride, size;
+	int dmafd;
+	void *map;
 };
 
 struct headless_output {
 	struct weston_output base;
 	struct weston_mode mode;
 	struct wl_event_source *finish_frame_timer;
+
+	struct headless_dumb dumb[2];
+	int current_image;
+
+	/* the v4l2 renderer may compose after repaint_output() returns */
+	struct wl_listener v4l2_frame_listener;
+	int compose_pending;
+	int finish_deferred;
 };
 
+struct headless_parameters {
+	int width;
+	int height;
+	int use_v4l2;
+	const char *drm_device;
+};
+
+#ifdef ENABLE_V4L2
+static struct v4l2_renderer_interface *v4l2_renderer;
+#endif
+
 
 static void
 headless_output_start_repaint_loop(struct weston_output *output)
@@ -67,20 +107,241 @@ headless_output_repaint(struct weston_output *output_base,
 	struct headless_output *output = (struct headless_output *) output_base;
 	struct weston_compositor *ec = output->base.compositor;
 
+#ifdef ENABLE_V4L2
+	struct headless_compositor *c = (struct headless_compositor *) ec;
+
+	if (c->use_v4l2) {
+		/* the previous frame has been composed by now */
+		output->current_image ^= 1;
+		v4l2_renderer->set_output_buffer(&output->base,
+						 output->current_image);
+
+		/* cleared by headless_output_v4l2_frame_notify() */
+		output->compose_pending = 1;
+	}
+#endif
+
 	ec->renderer->repaint_output(&output->base, damage);
 
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
 
+	/* Finish the frame once the renderer is done with it */
+	if (output->compose_pending) {
+		output->finish_deferred = 1;
+		return 0;
+	}
+
+	wl_event_source_timer_update(output->finish_frame_timer, 16);
+
+	return 0;
+}
+
+#ifdef ENABLE_V4L2
+static void
+headless_output_v4l2_frame_notify(struct wl_listener *listener, void *data)
+{
+	struct headless_output *output =
+		container_of(listener, struct headless_output,
+			     v4l2_frame_listener);
+
+	output->compose_pending = 0;
+
+	/* Composed synchronously; headless_output_repaint() goes on. */
+	if (!output->finish_deferred)
+		return;
+
+	output->finish_deferred = 0;
+
 	wl_event_source_timer_update(output->finish_frame_timer, 16);
+}
+
+static void
+headless_dumb_destroy(struct headless_compositor *c, struct headless_dumb *dumb)
+{
+	struct drm_mode_destroy_dumb destroy_arg;
+
+	if (!dumb->map)
+		return;
+
+	if (dumb->dmafd >= 0)
+		close(dumb->dmafd);
+
+	munmap(dumb->map, dumb->size);
+
+	memset(&destroy_arg, 0, sizeof(destroy_arg));
+	destroy_arg.handle = dumb->handle;
+	drmIoctl(c->drm.fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy_arg);
+
+	memset(dumb, 0, sizeof(*dumb));
+}
+
+static int
+headless_dumb_create(struct headless_compositor *c, struct headless_dumb *dumb,
+		     int width, int height)
+{
+	struct drm_mode_create_dumb create_arg;
+	struct drm_mode_map_dumb map_arg;
+
+	memset(&create_arg, 0, sizeof create_arg);
+	create_arg.bpp = 32;
+	create_arg.width = width;
+	create_arg.height = height;
+
+	if (drmIoctl(c->drm.fd, DRM_IOCTL_MODE_CREATE_DUMB, &create_arg))
+		return -1;
+
+	dumb->handle = create_arg.handle;
+	dumb->stride = create_arg.pitch;
+	dumb->size = create_arg.size;
+	dumb->dmafd = -1;
+
+	memset(&map_arg, 0, sizeof map_arg);
+	map_arg.handle = dumb->handle;
+	if (drmIoctl(c->drm.fd, DRM_IOCTL_MODE_MAP_DUMB, &map_arg))
+		goto err;
+
+	dumb->map = mmap(0, dumb->size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED, c->drm.fd, map_arg.offset);
+	if (dumb->map == MAP_FAILED) {
+		dumb->map = NULL;
+		goto err;
+	}
+
+	if (drmPrimeHandleToFD(c->drm.fd, dumb->handle, DRM_CLOEXEC,
+			       &dumb->dmafd))
+		goto err;
+
+	return 0;
+
+err:
+	if (dumb->map) {
+		headless_dumb_destroy(c, dumb);
+	} else {
+		struct drm_mode_destroy_dumb destroy_arg;
+
+		memset(&destroy_arg, 0, sizeof(destroy_arg));
+		destroy_arg.handle = dumb->handle;
+		drmIoctl(c->drm.fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy_arg);
+	}
+	return -1;
+}
+
+static int
+headless_output_init_v4l2(struct headless_compositor *c,
+			  struct headless_output *output)
+{
+	struct v4l2_bo_state bo_state[ARRAY_LENGTH(output->dumb)];
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_LENGTH(output->dumb); i++) {
+		if (headless_dumb_create(c, &output->dumb[i],
+					 output->mode.width,
+					 output->mode.height) < 0)
+			goto err;
+		bo_state[i].dmafd = output->dumb[i].dmafd;
+		bo_state[i].map = output->dumb[i].map;
+		bo_state[i].stride = output->dumb[i].stride;
+	}
+
+	if (v4l2_renderer->output_create(&output->base, bo_state,
+					 ARRAY_LENGTH(output->dumb)) < 0)
+		goto err;
+
+	output->v4l2_frame_listener.notify = headless_output_v4l2_frame_notify;
+	wl_signal_add(&output->base.frame_signal,
+		      &output->v4l2_frame_listener);
+
+	return 0;
+
+err:
+	for (i = 0; i < ARRAY_LENGTH(output->dumb); i++)
+		headless_dumb_destroy(c, &output->dumb[i]);
+
+	return -1;
+}
+
+static void
+headless_output_fini_v4l2(struct headless_compositor *c,
+			  struct headless_output *output)
+{
+	unsigned int i;
+
+	wl_list_remove(&output->v4l2_frame_listener.link);
+	v4l2_renderer->output_destroy(&output->base);
+
+	for (i = 0; i < ARRAY_LENGTH(output->dumb); i++)
+		headless_dumb_destroy(c, &output->dumb[i]);
+}
+
+/* drm_device is a card name, as with the drm backend */
+static int
+headless_init_v4l2(struct headless_compositor *c, const char *drm_device)
+{
+	if (asprintf(&c->drm.filename, "/dev/dri/%s", drm_device) < 0) {
+		c->drm.filename = NULL;
+		return -1;
+	}
+
+	c->drm.fd = open(c->drm.filename, O_RDWR | O_CLOEXEC);
+	if (c->drm.fd < 0) {
+		weston_log("couldn't open %s for the v4l2 renderer\n",
+			   c->drm.filename);
+		free(c->drm.filename);
+		c->drm.filename = NULL;
+		return -1;
+	}
+
+	v4l2_renderer = weston_load_module("v4l2-renderer.so",
+					   "v4l2_renderer_interface");
+	if (!v4l2_renderer)
+		goto err;
+
+	if (v4l2_renderer->init(&c->base, c->drm.fd, c->drm.filename) < 0)
+		goto err;
 
 	return 0;
+
+err:
+	close(c->drm.fd);
+	c->drm.fd = -1;
+	free(c->drm.filename);
+	c->drm.filename = NULL;
+	return -1;
+}
+#else
+static int
+headless_output_init_v4l2(struct headless_compositor *c,
+			  struct headless_output *output)
+{
+	return -1;
+}
+
+static void
+headless_output_fini_v4l2(struct headless_compositor *c,
+			  struct headless_output *output)
+{
+}
+
+static int
+headless_init_v4l2(struct headless_compositor *c, const char *drm_device)
+{
+	weston_log("Compiled without v4l2 renderer support\n");
+	return -1;
 }
+#endif
 
 static void
 headless_output_destroy(struct weston_output *output_base)
 {
 	struct headless_output *output = (struct headless_output *) output_base;
+	struct headless_compositor *c =
+		(struct headless_compositor *) output->base.compositor;
+
+	/* the renderer finishes a composition in progress before the
+	 * buffers go */
+	if (c->use_v4l2)
+		headless_output_fini_v4l2(c, output);
 
 	wl_event_source_remove(output->finish_frame_timer);
 	free(output);
@@ -114,6 +375,13 @@ headless_compositor_create_output(struct headless_compositor *c,
 	output->base.make = "weston";
 	output->base.model = "headless";
 
+	if (c->use_v4l2 && headless_output_init_v4l2(c, output) < 0) {
+		weston_log("Failed to init output v4l2 state\n");
+		weston_output_destroy(&output->base);
+		free(output);
+		return -1;
+	}
+
 	loop = wl_display_get_event_loop(c->base.wl_display);
 	output->finish_frame_timer =
 		wl_event_loop_add_timer(loop, finish_frame_handler, output);
@@ -163,12 +431,17 @@ headless_destroy(struct weston_compositor *ec)
 	headless_input_destroy(c);
 	weston_compositor_shutdown(ec);
 
+	if (c->drm.fd >= 0)
+		close(c->drm.fd);
+	free(c->drm.filename);
+
 	free(ec);
 }
 
 static struct weston_compositor *
 headless_compositor_create(struct wl_display *display,
-			   int width, int height, const char *display_name,
+			   struct headless_parameters *param,
+			   const char *display_name,
 			   int *argc, char *argv[],
 			   struct weston_config *config)
 {
@@ -178,6 +451,9 @@ headless_compositor_create(struct wl_display *display,
 	if (c == NULL)
 		return NULL;
 
+	c->drm.fd = -1;
+	c->use_v4l2 = param->use_v4l2;
+
 	if (weston_compositor_init(&c->base, display, argc, argv, config) < 0)
 		goto err_free;
 
@@ -187,10 +463,14 @@ headless_compositor_create(struct wl_display *display,
 	c->base.destroy = headless_destroy;
 	c->base.restore = headless_restore;
 
-	if (headless_compositor_create_output(c, width, height) < 0)
+	if (c->use_v4l2) {
+		if (headless_init_v4l2(c, param->drm_device) < 0)
+			goto err_input;
+	} else if (noop_renderer_init(&c->base) < 0)
 		goto err_input;
 
-	if (noop_renderer_init(&c->base) < 0)
+	if (headless_compositor_create_output(c, param->width,
+					      param->height) < 0)
 		goto err_input;
 
 	return &c->base;
@@ -208,17 +488,23 @@ WL_EXPORT struct weston_compositor *
 backend_init(struct wl_display *display, int *argc, char *argv[],
 	     struct weston_config *config)
 {
-	int width = 1024, height = 640;
+	struct headless_parameters param = { 0, };
 	char *display_name = NULL;
 
 	const struct weston_option headless_options[] = {
-		{ WESTON_OPTION_INTEGER, "width", 0, &width },
-		{ WESTON_OPTION_INTEGER, "height", 0, &height },
+		{ WESTON_OPTION_INTEGER, "width", 0, &param.width },
+		{ WESTON_OPTION_INTEGER, "height", 0, &param.height },
+		{ WESTON_OPTION_BOOLEAN, "use-v4l2", 0, &param.use_v4l2 },
+		{ WESTON_OPTION_STRING, "drm-device", 0, &param.drm_device },
 	};
 
+	param.width = 1024;
+	param.height = 640;
+	param.drm_device = "card0";
+
 	parse_options(headless_options,
 		      ARRAY_LENGTH(headless_options), argc, argv);
 
-	return headless_compositor_create(display, width, height, display_name,
+	return headless_compositor_create(display, &param, display_name,
 					  argc, argv, config);
 }
@@ -24,6 +24,7 @@
 
 #include "config.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
@@ -60,6 +61,8 @@
 
 static struct wl_list child_process_list;
 static struct weston_compositor *segv_compositor;
+/* bumped by weston_layer_init(), which doesn't know the compositor */
+static uint32_t layer_serial;
 
 static int
 sigchld_handler(int signal_number, void *data)
@@ -1371,6 +1374,7 @@ weston_view_unmap(struct weston_view *view)
 	wl_list_remove(&view->link);
 	wl_list_init(&view->link);
 	view->output_mask = 0;
+	view->surface->compositor->view_list_dirty = 1;
 	weston_surface_assign_output(view->surface);
 
 	if (weston_surface_is_mapped(view->surface))
@@ -1416,6 +1420,10 @@ weston_view_destroy(struct weston_view *view)
 
 	assert(wl_list_empty(&view->geometry.child_list));
 
+	/* a new view may get the address of this one, which would look
+	 * like nothing changed */
+	view->surface->compositor->view_list_dirty = 1;
+
 	if (weston_view_is_mapped(view)) {
 		weston_view_unmap(view);
 		weston_compositor_build_view_list(view->surface->compositor);
@@ -1776,6 +1784,37 @@ view_list_add(struct weston_compositor *compositor,
 	}
 }
 
+/*
+ * Records the layers and the views in them, in stacking order. Shells
+ * restack these directly, so this is compared each repaint to find out
+ * whether the view list needs a rebuild.
+ */
+static int
+view_list_get_layers(struct weston_compositor *compositor,
+		     struct wl_array *array)
+{
+	struct weston_layer *layer;
+	struct weston_view *view;
+	void **p;
+
+	array->size = 0;
+	wl_list_for_each(layer, &compositor->layer_list, link) {
+		p = wl_array_add(array, sizeof *p);
+		if (!p)
+			return -1;
+		*p = layer;
+
+		wl_list_for_each(view, &layer->view_list, layer_link) {
+			p = wl_array_add(array, sizeof *p);
+			if (!p)
+				return -1;
+			*p = view;
+		}
+	}
+
+	return 0;
+}
+
 static void
 weston_compositor_build_view_list(struct weston_compositor *compositor)
 {
@@ -1796,6 +1835,37 @@ weston_compositor_build_view_list(struct weston_compositor *compositor)
 	wl_list_for_each(layer, &compositor->layer_list, link)
 		wl_list_for_each(view, &layer->view_list, layer_link)
 			surface_free_unused_subsurface_views(view->surface);
+
+	compositor->view_list_dirty =
+		view_list_get_layers(compositor,
+				     &compositor->view_list_layers) < 0;
+	compositor->view_list_layer_serial = layer_serial;
+}
+
+/*
+ * Rebuilds the view list if the layers, the subsurfaces or the mapped
+ * views changed since the last time, and updates the view transforms.
+ */
+WL_EXPORT void
+weston_compositor_update_view_list(struct weston_compositor *compositor)
+{
+	struct wl_array *layers = &compositor->view_list_layers;
+	struct wl_array *scratch = &compositor->view_list_scratch;
+	struct weston_view *view;
+
+	if (compositor->view_list_layer_serial != layer_serial ||
+	    view_list_get_layers(compositor, scratch) < 0 ||
+	    scratch->size != layers->size ||
+	    memcmp(scratch->data, layers->data, layers->size) != 0)
+		compositor->view_list_dirty = 1;
+
+	if (compositor->view_list_dirty) {
+		weston_compositor_build_view_list(compositor);
+		return;
+	}
+
+	wl_list_for_each(view, &compositor->view_list, link)
+		weston_view_update_transform(view);
 }
 
 static int
@@ -1813,7 +1883,7 @@ weston_output_repaint(struct weston_output *output, uint32_t msecs)
 		return 0;
 
 	/* Rebuild the surface list and update surface transforms up front. */
-	weston_compositor_build_view_list(ec);
+	weston_compositor_update_view_list(ec);
 
 	if (output->assign_planes && !output->disable_planes)
 		output->assign_planes(output);
@@ -1876,32 +1946,183 @@ weston_compositor_read_input(int fd, uint32_t mask, void *data)
 	return 1;
 }
 
+/* headroom over the measured repaint time in the adaptive repaint window */
+#define REPAINT_WINDOW_MARGIN_USECS 2000
+
+static uint32_t
+timespec_to_usec(const struct timespec *ts)
+{
+	return ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+}
+
+/* Returns how many msecs to wait before repainting after the vblank at
+ * msecs, or 0 to repaint now. */
+static int32_t
+weston_output_repaint_delay(struct weston_output *output, uint32_t msecs)
+{
+	struct timespec now;
+	uint32_t refresh_msecs, window;
+
+	if (!output->current_mode || output->current_mode->refresh <= 0)
+		return 0;
+
+	if (output->repaint_window_adaptive)
+		window = (output->repaint_usecs +
+			  REPAINT_WINDOW_MARGIN_USECS + 999) / 1000;
+	else
+		window = output->repaint_window;
+
+	refresh_msecs = 1000000 / output->current_mode->refresh;
+	if (window == 0 || window >= refresh_msecs)
+		return 0;
+
+	clock_gettime(output->compositor->presentation_clock, &now);
+
+	return (int32_t) (msecs + refresh_msecs - window -
+			  (now.tv_sec * 1000 + now.tv_nsec / 1000000));
+}
+
+/* Repaints the output. The time until the backend reports the frame
+ * composed is kept track of for the adaptive repaint window.
+ * Returns 0 if a frame is on its way. */
+static int
+weston_output_repaint_timed(struct weston_output *output, uint32_t msecs)
+{
+	int r;
+
+	clock_gettime(CLOCK_MONOTONIC, &output->repaint_start);
+	output->repaint_timing = 1;
+
+	r = weston_output_repaint(output, msecs);
+	if (r)
+		output->repaint_timing = 0;
+
+	return r;
+}
+
+/* Called by the backend once the frame of the last repaint is composed,
+ * which may be well after the repaint returned, e.g. when the renderer
+ * composes asynchronously. Time the frame then waits for the previous
+ * page flip is not part of the repaint. */
 WL_EXPORT void
-weston_output_finish_frame(struct weston_output *output, uint32_t msecs)
+weston_output_repaint_composed(struct weston_output *output)
+{
+	struct timespec end;
+	uint32_t usecs;
+
+	if (!output->repaint_timing)
+		return;
+	output->repaint_timing = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	/* rise at once with a slow frame, fall slowly after */
+	usecs = timespec_to_usec(&end) - timespec_to_usec(&output->repaint_start);
+	if (usecs > output->repaint_usecs)
+		output->repaint_usecs = usecs;
+	else
+		output->repaint_usecs = (output->repaint_usecs * 15 + usecs) / 16;
+}
+
+static void
+weston_output_repaint_idle(struct weston_output *output)
 {
 	struct weston_compositor *compositor = output->compositor;
 	struct wl_event_loop *loop =
 		wl_display_get_event_loop(compositor->wl_display);
-	int fd, r;
+	int fd;
+
+	output->repaint_scheduled = 0;
+	if (compositor->input_loop_source)
+		return;
+
+	fd = wl_event_loop_get_fd(compositor->input_loop);
+	compositor->input_loop_source =
+		wl_event_loop_add_fd(loop, fd, WL_EVENT_READABLE,
+				     weston_compositor_read_input, compositor);
+}
+
+static int
+output_repaint_timer_handler(void *data)
+{
+	struct weston_output *output = data;
+	struct weston_compositor *compositor = output->compositor;
+
+	/* input that came during the repaint window makes it in the frame */
+	wl_event_loop_dispatch(compositor->input_loop, 0);
+	weston_compositor_repick(compositor);
+
+	if (output->repaint_needed &&
+	    compositor->state != WESTON_COMPOSITOR_SLEEPING &&
+	    compositor->state != WESTON_COMPOSITOR_OFFSCREEN &&
+	    weston_output_repaint_timed(output, output->frame_time) == 0)
+		return 1;
+
+	weston_output_repaint_idle(output);
+
+	return 1;
+}
+
+WL_EXPORT void
+weston_output_finish_frame(struct weston_output *output, uint32_t msecs)
+{
+	struct weston_compositor *compositor = output->compositor;
+	int32_t delay;
+	int r;
 
 	output->frame_time = msecs;
 
 	if (output->repaint_needed &&
 	    compositor->state != WESTON_COMPOSITOR_SLEEPING &&
 	    compositor->state != WESTON_COMPOSITOR_OFFSCREEN) {
-		r = weston_output_repaint(output, msecs);
+		/* input is read when the repaint timer fires */
+		delay = weston_output_repaint_delay(output, msecs);
+		if (delay > 0) {
+			wl_event_source_timer_update(output->repaint_timer,
+						     delay);
+			return;
+		}
+
+		r = weston_output_repaint_timed(output, msecs);
 		if (!r)
 			return;
 	}
 
-	output->repaint_scheduled = 0;
-	if (compositor->input_loop_source)
+	weston_output_repaint_idle(output);
+}
+
+/*
+ * Sets how long before the predicted vblank repaints of the output
+ * start: a number of msecs, or "adaptive" to follow the time repaints
+ * take. NULL or 0 repaints right after the previous frame.
+ */
+WL_EXPORT void
+weston_output_set_repaint_window(struct weston_output *output,
+				 const char *window)
+{
+	char *end;
+	long msecs;
+
+	output->repaint_window = 0;
+	output->repaint_window_adaptive = 0;
+
+	if (!window)
 		return;
 
-	fd = wl_event_loop_get_fd(compositor->input_loop);
-	compositor->input_loop_source =
-		wl_event_loop_add_fd(loop, fd, WL_EVENT_READABLE,
-				     weston_compositor_read_input, compositor);
+	if (strcmp(window, "adaptive") == 0) {
+		output->repaint_window_adaptive = 1;
+		return;
+	}
+
+	errno = 0;
+	msecs = strtol(window, &end, 10);
+	if (errno || *end != '\0' || end == window || msecs < 0 || msecs > 1000) {
+		weston_log("Invalid repaint window \"%s\" for output %s\n",
+			   window, output->name);
+		return;
+	}
+
+	output->repaint_window = msecs;
 }
 
 static void
@@ -1918,6 +2139,7 @@ weston_layer_init(struct weston_layer *layer, struct wl_list *below)
 	wl_list_init(&layer->view_list);
 	if (below != NULL)
 		wl_list_insert(below, &layer->link);
+	layer_serial++;
 }
 
 WL_EXPORT void
@@ -2071,6 +2293,19 @@ static void
 weston_surface_commit_subsurface_order(struct weston_surface *surface)
 {
 	struct weston_subsurface *sub;
+	struct wl_list *link = surface->subsurface_list.next;
+
+	/* Most commits don't restack the subsurfaces */
+	wl_list_for_each(sub, &surface->subsurface_list_pending,
+			 parent_link_pending) {
+		if (link != &sub->parent_link)
+			break;
+		link = link->next;
+	}
+	if (link == &surface->subsurface_list)
+		return;
+
+	surface->compositor->view_list_dirty = 1;
 
 	wl_list_for_each_reverse(sub, &surface->subsurface_list_pending,
 				 parent_link_pending) {
@@ -2647,6 +2882,7 @@ subsurface_set_desync(struct wl_client *client, struct wl_resource *resource)
 static void
 weston_subsurface_unlink_parent(struct weston_subsurface *sub)
 {
+	sub->surface->compositor->view_list_dirty = 1;
 	wl_list_remove(&sub->parent_link);
 	wl_list_remove(&sub->parent_link_pending);
 	wl_list_remove(&sub->parent_destroy_listener.link);
@@ -2710,6 +2946,7 @@ weston_subsurface_link_parent(struct weston_subsurface *sub,
 	wl_signal_add(&parent->destroy_signal,
 		      &sub->parent_destroy_listener);
 
+	parent->compositor->view_list_dirty = 1;
 	wl_list_insert(&parent->subsurface_list, &sub->parent_link);
 	wl_list_insert(&parent->subsurface_list_pending,
 		       &sub->parent_link_pending);
@@ -2754,6 +2991,7 @@ weston_subsurface_destroy(struct weston_subsurface *sub)
 	} else {
 		/* the dummy weston_subsurface for the parent itself */
 		assert(sub->parent_destroy_listener.notify == NULL);
+		sub->surface->compositor->view_list_dirty = 1;
 		wl_list_remove(&sub->parent_link);
 		wl_list_remove(&sub->parent_link_pending);
 	}
@@ -2817,6 +3055,7 @@ weston_subsurface_create_for_parent(struct weston_surface *parent)
 
 	weston_subsurface_link_surface(sub, parent);
 	sub->parent = parent;
+	parent->compositor->view_list_dirty = 1;
 	wl_list_insert(&parent->subsurface_list, &sub->parent_link);
 	wl_list_insert(&parent->subsurface_list_pending,
 		       &sub->parent_link_pending);
@@ -3114,6 +3353,8 @@ weston_output_destroy(struct weston_output *output)
 	wl_signal_emit(&output->compositor->output_destroyed_signal, output);
 	wl_signal_emit(&output->destroy_signal, output);
 
+	wl_event_source_remove(output->repaint_timer);
+
 	free(output->name);
 	pixman_region32_fini(&output->region);
 	pixman_region32_fini(&output->previous_damage);
@@ -3313,6 +3554,10 @@ weston_output_init(struct weston_output *output, struct weston_compositor *c,
 	wl_list_init(&output->animation_list);
 	wl_list_init(&output->resource_list);
 
+	output->repaint_timer =
+		wl_event_loop_add_timer(wl_display_get_event_loop(c->wl_display),
+					output_repaint_timer_handler, output);
+
 	output->id = ffs(~output->compositor->output_id_pool) - 1;
 	output->compositor->output_id_pool |= 1 << output->id;
 
@@ -3670,6 +3915,9 @@ weston_compositor_init(struct weston_compositor *ec,
 
 	ec->output_id_pool = 0;
 
+	/* as in weston_compositor_get_time() */
+	ec->presentation_clock = CLOCK_REALTIME;
+
 	if (!wl_global_create(display, &wl_compositor_interface, 3,
 			      ec, compositor_bind))
 		return -1;
@@ -3683,6 +3931,9 @@ weston_compositor_init(struct weston_compositor *ec,
 		return -1;
 
 	wl_list_init(&ec->view_list);
+	wl_array_init(&ec->view_list_layers);
+	wl_array_init(&ec->view_list_scratch);
+	ec->view_list_dirty = 1;
 	wl_list_init(&ec->plane_list);
 	wl_list_init(&ec->layer_list);
 	wl_list_init(&ec->seat_list);
@@ -3756,6 +4007,9 @@ weston_compositor_shutdown(struct weston_compositor *ec)
 
 	weston_plane_release(&ec->primary_plane);
 
+	wl_array_release(&ec->view_list_layers);
+	wl_array_release(&ec->view_list_scratch);
+
 	wl_event_loop_destroy(ec->input_loop);
 
 	weston_config_destroy(ec->config);
@@ -4051,10 +4305,19 @@ usage(int error_code)
 		"Options for drm-backend.so:\n\n"
 		"  --connector=ID\tBring up only this connector\n"
 		"  --seat=SEAT\t\tThe seat that weston should run on\n"
+		"  --drm-device=CARD\tThe DRM device to use, e.g. card1\n"
 		"  --tty=TTY\t\tThe tty to use\n"
 		"  --use-pixman\t\tUse the pixman (CPU) renderer\n"
 		"  --current-mode\tPrefer current KMS mode over EDID preferred mode\n\n");
 
+	fprintf(stderr,
+		"Options for headless-backend.so:\n\n"
+		"  --width=WIDTH\t\tWidth of the output\n"
+		"  --height=HEIGHT\tHeight of the output\n"
+		"  --use-v4l2\t\tRender with the v4l2 renderer\n"
+		"  --drm-device=CARD\tThe DRM device the v4l2 renderer allocates\n"
+		"\t\t\tbuffers from, defaults to card0\n\n");
+
 	fprintf(stderr,
 		"Options for fbdev-backend.so:\n\n"
 		"  --tty=TTY\t\tThe tty to use\n"
@@ -28,6 +28,7 @@
 extern "C" {
 #endif
 
+#include <time.h>
 #include <pixman.h>
 #include <xkbcommon/xkbcommon.h>
 
@@ -201,6 +202,16 @@ struct weston_output {
 	int disable_planes;
 	int destroying;
 
+	/* Repaints start this many msecs before the predicted vblank, so
+	 * that input and commits arriving meanwhile make it into the
+	 * frame. With 0, repaints start right after the previous frame. */
+	int32_t repaint_window;
+	int repaint_window_adaptive;
+	uint32_t repaint_usecs;		/* from repaint to composed frame lately */
+	struct timespec repaint_start;
+	int repaint_timing;
+	struct wl_event_source *repaint_timer;
+
 	char *make, *model, *serial_number;
 	uint32_t subpixel;
 	uint32_t transform;
@@ -606,6 +617,11 @@ struct weston_compositor {
 	struct wl_list seat_list;
 	struct wl_list layer_list;
 	struct wl_list view_list;
+	/* view_list is only rebuilt when dirty or when the layers changed */
+	int view_list_dirty;
+	struct wl_array view_list_layers;	/* as of the last rebuild */
+	struct wl_array view_list_scratch;
+	uint32_t view_list_layer_serial;
 	struct wl_list plane_list;
 	struct wl_list key_binding_list;
 	struct wl_list modifier_binding_list;
@@ -637,6 +653,9 @@ struct weston_compositor {
 
 	uint32_t output_id_pool;
 
+	/* clock of the frame times given to weston_output_finish_frame() */
+	clockid_t presentation_clock;
+
 	struct xkb_rule_names xkb_names;
 	struct xkb_context *xkb_context;
 	struct weston_xkb_info *xkb_info;
@@ -1014,12 +1033,19 @@ weston_compositor_stack_plane(struct weston_compositor *ec,
 void
 weston_output_finish_frame(struct weston_output *output, uint32_t msecs);
 void
+weston_output_repaint_composed(struct weston_output *output);
+void
 weston_output_schedule_repaint(struct weston_output *output);
 void
+weston_output_set_repaint_window(struct weston_output *output,
+				 const char *window);
+void
 weston_output_damage(struct weston_output *output);
 void
 weston_compositor_schedule_repaint(struct weston_compositor *compositor);
 void
+weston_compositor_update_view_list(struct weston_compositor *compositor);
+void
 weston_compositor_fade(struct weston_compositor *compositor, float tint);
 void
 weston_compositor_damage_all(struct weston_compositor *compositor);
@@ -41,10 +41,173 @@
 #include "mediactl-priv.h"
 #include "tools.h"
 
+/* -----------------------------------------------------------------------------
+ * Graph index
+ */
+
+static unsigned int media_hash_name(const char *name, size_t length)
+{
+	unsigned int hash = 2166136261u;
+	size_t i;
+
+	/* FNV-1a */
+	for (i = 0; i < length; ++i)
+		hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+
+	return hash;
+}
+
+static unsigned int media_hash_id(__u32 id)
+{
+	return id * 2654435761u;
+}
+
+static unsigned int media_hash_link(const struct media_pad *source,
+				    const struct media_pad *sink)
+{
+	return media_hash_id(source->entity->info.id << 8 | source->index) ^
+	       media_hash_id(sink->entity->info.id << 8 | sink->index) * 31;
+}
+
+static unsigned int media_index_size(unsigned int count)
+{
+	unsigned int size = 8;
+
+	/* Keep the tables at most half full. */
+	while (size < count * 2)
+		size *= 2;
+
+	return size;
+}
+
+static void media_free_index(struct media_device *media)
+{
+	free(media->index.names);
+	free(media->index.ids);
+	free(media->index.links);
+	memset(&media->index, 0, sizeof media->index);
+}
+
+/* Entities are inserted in order, so that lookups find the first of
+ * entities sharing a name or an ID, as the linear scans do.
+ */
+static int media_index_entities(struct media_device *media)
+{
+	unsigned int size = media_index_size(media->entities_count);
+	unsigned int mask = size - 1;
+	unsigned int i, slot;
+
+	free(media->index.names);
+	free(media->index.ids);
+	media->index.names = calloc(size, sizeof *media->index.names);
+	media->index.ids = calloc(size, sizeof *media->index.ids);
+	media->index.size = size;
+	if (media->index.names == NULL || media->index.ids == NULL) {
+		free(media->index.names);
+		free(media->index.ids);
+		media->index.names = NULL;
+		media->index.ids = NULL;
+		media->index.size = 0;
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < media->entities_count; ++i) {
+		struct media_entity *entity = &media->entities[i];
+
+		slot = media_hash_name(entity->info.name,
+				       strlen(entity->info.name)) & mask;
+		while (media->index.names[slot])
+			slot = (slot + 1) & mask;
+		media->index.names[slot] = i + 1;
+
+		slot = media_hash_id(entity->info.id) & mask;
+		while (media->index.ids[slot])
+			slot = (slot + 1) & mask;
+		media->index.ids[slot] = i + 1;
+	}
+
+	return 0;
+}
+
+/* Links are indexed by their source entity only, as every link appears
+ * in the links of both the source and the sink entities.
+ */
+static int media_index_links(struct media_device *media)
+{
+	unsigned int count = 0, size, mask, slot;
+	unsigned int i, j;
+
+	for (i = 0; i < media->entities_count; ++i) {
+		struct media_entity *entity = &media->entities[i];
+
+		for (j = 0; j < entity->num_links; ++j) {
+			if (entity->links[j].source->entity == entity)
+				count++;
+		}
+	}
+
+	size = media_index_size(count);
+	mask = size - 1;
+
+	free(media->index.links);
+	media->index.links = calloc(size, sizeof *media->index.links);
+	media->index.links_size = media->index.links ? size : 0;
+	if (media->index.links == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < media->entities_count; ++i) {
+		struct media_entity *entity = &media->entities[i];
+
+		for (j = 0; j < entity->num_links; ++j) {
+			struct media_link *link = &entity->links[j];
+
+			if (link->source->entity != entity)
+				continue;
+
+			slot = media_hash_link(link->source, link->sink) & mask;
+			while (media->index.links[slot])
+				slot = (slot + 1) & mask;
+			media->index.links[slot] = link;
+		}
+	}
+
+	return 0;
+}
+
 /* -----------------------------------------------------------------------------
  * Graph access
  */
 
+struct media_link *media_get_link(struct media_pad *source,
+				  struct media_pad *sink)
+{
+	struct media_device *media = source->entity->media;
+	struct media_link *link;
+	unsigned int i, mask, slot;
+
+	if (media->index.links) {
+		mask = media->index.links_size - 1;
+		slot = media_hash_link(source, sink) & mask;
+
+		for (; (link = media->index.links[slot]) != NULL;
+		     slot = (slot + 1) & mask) {
+			if (link->source == source && link->sink == sink)
+				return link;
+		}
+
+		return NULL;
+	}
+
+	for (i = 0; i < source->entity->num_links; i++) {
+		link = &source->entity->links[i];
+
+		if (link->source == source && link->sink == sink)
+			return link;
+	}
+
+	return NULL;
+}
+
 struct media_pad *media_entity_remote_source(struct media_pad *pad)
 {
 	unsigned int i;
@@ -76,6 +239,22 @@ struct media_entity *media_get_entity_by_name(struct media_device *media,
 	if (length >= FIELD_SIZEOF(struct media_entity_desc, name))
 		return NULL;
 
+	if (media->index.names) {
+		unsigned int mask = media->index.size - 1;
+		unsigned int slot = media_hash_name(name, length) & mask;
+
+		for (; (i = media->index.names[slot]) != 0;
+		     slot = (slot + 1) & mask) {
+			struct media_entity *entity = &media->entities[i - 1];
+
+			if (strncmp(entity->info.name, name, length) == 0 &&
+			    entity->info.name[length] == '\0')
+				return entity;
+		}
+
+		return NULL;
+	}
+
 	for (i = 0; i < media->entities_count; ++i) {
 		struct media_entity *entity = &media->entities[i];
 
@@ -95,6 +274,19 @@ struct media_entity *media_get_entity_by_id(struct media_device *media,
 
 	id &= ~MEDIA_ENT_ID_FLAG_NEXT;
 
+	if (media->index.ids && !next) {
+		unsigned int mask = media->index.size - 1;
+		unsigned int slot = media_hash_id(id) & mask;
+
+		for (; (i = media->index.ids[slot]) != 0;
+		     slot = (slot + 1) & mask) {
+			if (media->entities[i - 1].info.id == id)
+				return &media->entities[i - 1];
+		}
+
+		return NULL;
+	}
+
 	for (i = 0; i < media->entities_count; ++i) {
 		struct media_entity *entity = &media->entities[i];
 
@@ -220,24 +412,14 @@ int media_setup_link(struct media_device *media,
 {
 	struct media_link *link;
 	struct media_link_desc ulink;
-	unsigned int i;
 	int ret;
 
 	ret = media_device_open(media);
 	if (ret < 0)
 		goto done;
 
-	for (i = 0; i < source->entity->num_links; i++) {
-		link = &source->entity->links[i];
-
-		if (link->source->entity == source->entity &&
-		    link->source->index == source->index &&
-		    link->sink->entity == sink->entity &&
-		    link->sink->index == sink->index)
-			break;
-	}
-
-	if (i == source->entity->num_links) {
+	link = media_get_link(source, sink);
+	if (link == NULL) {
 		media_dbg(media, "%s: Link not found\n", __func__);
 		ret = -ENOENT;
 		goto done;
@@ -600,6 +782,11 @@ int media_device_enumerate(struct media_device *media)
 	}
 
 	media_dbg(media, "Found %u entities\n", media->entities_count);
+
+	/* Index the entities now, so that the links are resolved with it. */
+	if (media_index_entities(media) < 0)
+		media_dbg(media, "%s: Unable to index entities\n", __func__);
+
 	media_dbg(media, "Enumerating pads and links\n");
 
 	ret = media_enum_links(media);
@@ -610,6 +797,9 @@ int media_device_enumerate(struct media_device *media)
 		goto done;
 	}
 
+	if (media_index_links(media) < 0)
+		media_dbg(media, "%s: Unable to index links\n", __func__);
+
 	ret = 0;
 
 done:
@@ -706,6 +896,7 @@ void media_device_unref(struct media_device *media)
 			close(entity->fd);
 	}
 
+	media_free_index(media);
 	free(media->entities);
 	free(media->devnode);
 	free(media);
@@ -765,6 +956,9 @@ int media_device_add_entity(struct media_device *media,
 			*defent = entity;
 	}
 
+	/* The entities have moved. Lookups scan them if this fails. */
+	media_index_entities(media);
+
 	return 0;
 }
 
@@ -839,7 +1033,6 @@ struct media_link *media_parse_link(struct media_device *media,
 	struct media_link *link;
 	struct media_pad *source;
 	struct media_pad *sink;
-	unsigned int i;
 	char *end;
 
 	source = media_parse_pad(media, p, &end);
@@ -864,12 +1057,9 @@ struct media_link *media_parse_link(struct media_device *media,
 
 	*endp = end;
 
-	for (i = 0; i < source->entity->num_links; i++) {
-		link = &source->entity->links[i];
-
-		if (link->source == source && link->sink == sink)
-			return link;
-	}
+	link = media_get_link(source, sink);
+	if (link != NULL)
+		return link;
 
 	media_dbg(media, "No link between \"%s\":%d and \"%s\":%d\n",
 			source->entity->info.name, source->index,
@@ -56,6 +56,19 @@ struct media_device {
 		struct media_entity *alsa;
 		struct media_entity *dvb;
 	} def;
+
+	/* Open addressing hash tables, built once the graph is enumerated.
+	 * The entity tables hold an index in the entities array plus one, 0
+	 * marking an empty slot. Lookups fall back to linear scans when the
+	 * tables are missing.
+	 */
+	struct {
+		unsigned int *names;
+		unsigned int *ids;
+		unsigned int size;
+		struct media_link **links;
+		unsigned int links_size;
+	} index;
 };
 
 #define media_dbg(media, ...) \
@@ -381,6 +381,19 @@ int media_reset_links(struct media_device *media);
 struct media_pad *media_parse_pad(struct media_device *media,
 				  const char *p, char **endp);
 
+/**
+ * @brief Find the link between two pads.
+ * @param source - source pad.
+ * @param sink - sink pad.
+ *
+ * Once the media device has been enumerated, the link is looked up in a
+ * hash table instead of scanning the links of the source entity.
+ *
+ * @return A pointer to the link if found, or NULL otherwise.
+ */
+struct media_link *media_get_link(struct media_pad *source,
+				  struct media_pad *sink);
+
 /**
  * @brief Parse string to a link on the media device.
  * @param media - media device.
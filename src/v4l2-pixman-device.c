@@ -0,0 +1,598 @@
+/*
+ * Copyright © 2014 Renesas Electronics Corp.
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A software reference implementation of the V4L2 renderer device
+ * interface. Composition is done with pixman on the CPU, but the
+ * limitations of the VSP1 are emulated (four inputs per pass, a single
+ * scaler, the output being fed back as the first input of the next
+ * pass), so that the V4L2 renderer behaves exactly as it does on the
+ * real hardware. This allows the composition path to be run, profiled
+ * and tested on machines without a VSP.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <linux/videodev2.h>
+#include "v4l2-renderer.h"
+#include "v4l2-renderer-device.h"
+
+#if 0
+#define DBG(...) weston_log(__VA_ARGS__)
+#define DBGC(...) weston_log_continue(__VA_ARGS__)
+#else
+#define DBG(...) do {} while (0)
+#define DBGC(...) do {} while (0)
+#endif
+
+struct pixman_surface_state {
+	struct v4l2_surface_state base;
+
+	pixman_format_code_t format;
+	pixman_format_code_t opaque_format;
+};
+
+struct pixman_renderer_output {
+	struct v4l2_renderer_output base;
+	struct pixman_surface_state surface_state;
+
+	void *map;
+	uint32_t stride;
+};
+
+#define PIXMAN_DEV_INPUT_MAX		4
+#define PIXMAN_DEV_SCALER_MAX		1
+#define PIXMAN_DEV_SCALER_MIN_PIXELS	4	// mimic UDS limitation
+
+typedef enum {
+	PIXMAN_DEV_STATE_IDLE,
+	PIXMAN_DEV_STATE_START,
+	PIXMAN_DEV_STATE_COMPOSING,
+} pixman_dev_state_t;
+
+struct pixman_input {
+	struct pixman_surface_state *input_surface_states;
+	int use_scaler;
+	struct v4l2_rect src;
+	struct v4l2_rect dst;
+	int opaque;
+};
+
+struct pixman_stats {
+	uint32_t frames;
+	uint32_t passes;
+	uint32_t inputs;
+	uint32_t scaled;
+	uint64_t nsec;
+};
+
+struct pixman_device {
+	struct v4l2_renderer_device base;
+
+	pixman_dev_state_t state;
+
+	struct pixman_renderer_output *output;
+
+	int input_count;
+	int input_max;
+	struct pixman_input inputs[PIXMAN_DEV_INPUT_MAX];
+
+	int scaler_count;
+	int scaler_max;
+
+	int stats_interval;
+	struct pixman_stats stats;
+	struct v4l2_device_stats totals;
+	struct timespec frame_start;
+};
+
+static struct v4l2_renderer_device*
+pixman_dev_init(struct media_device *media, struct weston_config *config,
+		struct wl_event_loop *loop)
+{
+	struct pixman_device *dev;
+	struct weston_config_section *section;
+
+	dev = calloc(1, sizeof(struct pixman_device));
+	if (!dev)
+		return NULL;
+
+	dev->base.media = media;
+	dev->base.device_name = "pixman";
+	dev->base.userptr = 1;
+	dev->state = PIXMAN_DEV_STATE_IDLE;
+	dev->scaler_max = PIXMAN_DEV_SCALER_MAX;
+
+	/* check configuration */
+	section = weston_config_get_section(config,
+					    "pixman-device", NULL, NULL);
+	weston_config_section_get_int(section, "max_inputs", &dev->input_max, PIXMAN_DEV_INPUT_MAX);
+	weston_config_section_get_int(section, "stats_interval", &dev->stats_interval, 0);
+
+	if (dev->input_max < 2)
+		dev->input_max = 2;
+	if (dev->input_max > PIXMAN_DEV_INPUT_MAX)
+		dev->input_max = PIXMAN_DEV_INPUT_MAX;
+
+	weston_log("Using the software reference device. Use %d inputs.\n", dev->input_max);
+
+	return (struct v4l2_renderer_device*)dev;
+}
+
+static struct v4l2_surface_state*
+pixman_dev_create_surface(struct v4l2_renderer_device *dev)
+{
+	return (struct v4l2_surface_state*)calloc(1, sizeof(struct pixman_surface_state));
+}
+
+static int
+pixman_dev_attach_buffer(struct v4l2_surface_state *surface_state)
+{
+	struct pixman_surface_state *vs = (struct pixman_surface_state*)surface_state;
+
+	if (vs->base.width > 8190 || vs->base.height > 8190)
+		return -1;
+
+	/* multi-planar formats can't be handled by pixman */
+	if (vs->base.num_planes != 1)
+		return -1;
+
+	switch(vs->base.pixel_format) {
+	case V4L2_PIX_FMT_XRGB32:
+	case V4L2_PIX_FMT_ARGB32:
+		vs->format = PIXMAN_b8g8r8a8;
+		vs->opaque_format = PIXMAN_b8g8r8x8;
+		break;
+
+	case V4L2_PIX_FMT_XBGR32:
+	case V4L2_PIX_FMT_ABGR32:
+		vs->format = PIXMAN_a8r8g8b8;
+		vs->opaque_format = PIXMAN_x8r8g8b8;
+		break;
+
+	case V4L2_PIX_FMT_RGB24:
+		vs->format = vs->opaque_format = PIXMAN_b8g8r8;
+		break;
+
+	case V4L2_PIX_FMT_BGR24:
+		vs->format = vs->opaque_format = PIXMAN_r8g8b8;
+		break;
+
+	case V4L2_PIX_FMT_RGB565:
+		vs->format = vs->opaque_format = PIXMAN_r5g6b5;
+		break;
+
+	case V4L2_PIX_FMT_RGB332:
+		vs->format = vs->opaque_format = PIXMAN_r3g3b2;
+		break;
+
+	case V4L2_PIX_FMT_YUYV:
+		vs->format = vs->opaque_format = PIXMAN_yuy2;
+		break;
+
+	default:
+		return -1;
+	}
+
+	/* X variants are never blended with per-pixel alpha */
+	if (vs->base.pixel_format == V4L2_PIX_FMT_XRGB32 ||
+	    vs->base.pixel_format == V4L2_PIX_FMT_XBGR32)
+		vs->format = vs->opaque_format;
+
+	return 0;
+}
+
+static struct v4l2_renderer_output*
+pixman_dev_create_output(struct v4l2_renderer_device *dev, int width, int height)
+{
+	struct pixman_renderer_output *outdev;
+
+	outdev = calloc(1, sizeof(struct pixman_renderer_output));
+	if (!outdev)
+		return NULL;
+
+	outdev->base.width = width;
+	outdev->base.height = height;
+
+	/* we use this later to let output to be input for composition */
+	outdev->surface_state.base.width = width;
+	outdev->surface_state.base.height = height;
+	outdev->surface_state.base.num_planes = 1;
+	outdev->surface_state.base.pixel_format = V4L2_PIX_FMT_ABGR32;
+	outdev->surface_state.base.src_rect.width = width;
+	outdev->surface_state.base.src_rect.height = height;
+	outdev->surface_state.base.dst_rect.width = width;
+	outdev->surface_state.base.dst_rect.height = height;
+	outdev->surface_state.format = PIXMAN_a8r8g8b8;
+	outdev->surface_state.opaque_format = PIXMAN_x8r8g8b8;
+
+	return (struct v4l2_renderer_output*)outdev;
+}
+
+static void
+pixman_dev_set_output_buffer(struct v4l2_renderer_output *out, struct v4l2_bo_state *bo)
+{
+	struct pixman_renderer_output *output = (struct pixman_renderer_output*)out;
+
+	DBG("set output dmafd to %d\n", bo->dmafd);
+	output->map = bo->map;
+	output->stride = bo->stride;
+	output->surface_state.base.planes[0].dmafd = bo->dmafd;
+	output->surface_state.base.planes[0].stride = bo->stride;
+}
+
+static void
+pixman_dev_comp_begin(struct v4l2_renderer_device *dev, struct v4l2_renderer_output *out,
+		      int preserve)
+{
+	struct pixman_device *pdev = (struct pixman_device*)dev;
+
+	DBG("start pixman composition.\n");
+
+	// the first view composed pulls in the current output as input 0.
+	pdev->state = (preserve) ? PIXMAN_DEV_STATE_COMPOSING : PIXMAN_DEV_STATE_START;
+	pdev->output = (struct pixman_renderer_output*)out;
+
+	clock_gettime(CLOCK_MONOTONIC, &pdev->frame_start);
+}
+
+static int
+pixman_dev_compose_input(pixman_image_t *dest, struct pixman_input *input)
+{
+	struct pixman_surface_state *vs = input->input_surface_states;
+	struct v4l2_rect *src = &input->src;
+	struct v4l2_rect *dst = &input->dst;
+	pixman_image_t *image, *mask = NULL;
+	pixman_transform_t transform;
+	pixman_op_t op = PIXMAN_OP_OVER;
+	struct wl_shm_buffer *shm_buffer = NULL;
+	size_t size;
+	void *map;
+
+	size = vs->base.planes[0].stride * vs->base.height;
+	if (vs->base.planes[0].userptr) {
+		map = vs->base.planes[0].userptr;
+		// the client may shrink the pool under us
+		if (vs->base.buffer_ref.buffer)
+			shm_buffer = vs->base.buffer_ref.buffer->shm_buffer;
+	} else {
+		map = mmap(NULL, size, PROT_READ, MAP_SHARED, vs->base.planes[0].dmafd, 0);
+		if (map == MAP_FAILED) {
+			weston_log("mmap failed for dmafd=%d (%s).\n",
+				   vs->base.planes[0].dmafd, strerror(errno));
+			return -1;
+		}
+	}
+
+	image = pixman_image_create_bits(input->opaque ? vs->opaque_format : vs->format,
+					 vs->base.width, vs->base.height,
+					 map, vs->base.planes[0].stride);
+	if (!image) {
+		if (!vs->base.planes[0].userptr)
+			munmap(map, size);
+		return -1;
+	}
+
+	if (input->use_scaler) {
+		pixman_transform_init_identity(&transform);
+		pixman_transform_scale(&transform, NULL,
+				       pixman_double_to_fixed((double)src->width / dst->width),
+				       pixman_double_to_fixed((double)src->height / dst->height));
+		pixman_transform_translate(&transform, NULL,
+					   pixman_int_to_fixed(src->left),
+					   pixman_int_to_fixed(src->top));
+		pixman_image_set_transform(image, &transform);
+		pixman_image_set_filter(image, PIXMAN_FILTER_BILINEAR, NULL, 0);
+	}
+
+	if (vs->base.alpha < 1.0) {
+		pixman_color_t color = { 0, 0, 0, 0xffff * vs->base.alpha };
+		mask = pixman_image_create_solid_fill(&color);
+	} else if (input->opaque) {
+		op = PIXMAN_OP_SRC;
+	}
+
+	if (shm_buffer)
+		wl_shm_buffer_begin_access(shm_buffer);
+	pixman_image_composite32(op,
+				 image, /* src */
+				 mask, /* mask */
+				 dest, /* dest */
+				 input->use_scaler ? 0 : src->left, /* src_x */
+				 input->use_scaler ? 0 : src->top, /* src_y */
+				 0, 0, /* mask_x, mask_y */
+				 dst->left, dst->top, /* dest_x, dest_y */
+				 dst->width, dst->height);
+	if (shm_buffer)
+		wl_shm_buffer_end_access(shm_buffer);
+
+	if (mask)
+		pixman_image_unref(mask);
+	pixman_image_unref(image);
+	if (!vs->base.planes[0].userptr)
+		munmap(map, size);
+
+	return 0;
+}
+
+static int
+pixman_dev_comp_flush(struct pixman_device *pdev)
+{
+	struct pixman_renderer_output *output = pdev->output;
+	pixman_image_t *dest;
+	int i, ret = 0;
+
+	DBG("flush pixman composition.\n");
+
+	dest = pixman_image_create_bits(PIXMAN_a8r8g8b8,
+					output->base.width, output->base.height,
+					output->map, output->stride);
+	if (!dest) {
+		pdev->input_count = 0;
+		return -1;
+	}
+
+	// the first pass in a frame starts from the background color.
+	if (pdev->inputs[0].input_surface_states != &output->surface_state) {
+		pixman_color_t black = { 0, 0, 0, 0xffff };
+		pixman_box32_t box = { 0, 0, output->base.width, output->base.height };
+
+		pixman_image_fill_boxes(PIXMAN_OP_SRC, dest, &black, 1, &box);
+	}
+
+	for (i = 0; i < pdev->input_count; i++) {
+		struct pixman_input *input = &pdev->inputs[i];
+
+		// the output fed back as an input is already in place.
+		if (input->input_surface_states == &output->surface_state)
+			continue;
+
+		if (pixman_dev_compose_input(dest, input) < 0)
+			ret = -1;
+
+		if (input->use_scaler) {
+			pdev->stats.scaled++;
+			pdev->totals.scaled++;
+		}
+		input->use_scaler = 0;
+	}
+
+	pixman_image_unref(dest);
+
+	pdev->stats.passes++;
+	pdev->stats.inputs += pdev->input_count;
+	pdev->totals.passes++;
+	pdev->totals.inputs += pdev->input_count;
+
+	pdev->scaler_count = 0;
+	pdev->input_count = 0;
+	return ret;
+}
+
+static void
+pixman_dev_update_stats(struct pixman_device *pdev)
+{
+	struct pixman_stats *stats = &pdev->stats;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	stats->nsec += (uint64_t)(now.tv_sec - pdev->frame_start.tv_sec) * 1000000000ULL +
+		now.tv_nsec - pdev->frame_start.tv_nsec;
+	stats->frames++;
+
+	if (pdev->stats_interval <= 0 || stats->frames < (uint32_t)pdev->stats_interval)
+		return;
+
+	weston_log("pixman device: %u frames, %.2f passes/frame, "
+		   "%.2f inputs/pass, %.2f scaled/frame, %.3f ms/frame\n",
+		   stats->frames,
+		   (double)stats->passes / stats->frames,
+		   stats->passes ? (double)stats->inputs / stats->passes : 0.0,
+		   (double)stats->scaled / stats->frames,
+		   (double)stats->nsec / stats->frames / 1000000.0);
+
+	memset(stats, 0, sizeof(*stats));
+}
+
+static void
+pixman_dev_comp_finish(struct v4l2_renderer_device *dev)
+{
+	struct pixman_device *pdev = (struct pixman_device*)dev;
+
+	if (pdev->input_count > 0)
+		pixman_dev_comp_flush(pdev);
+
+	pixman_dev_update_stats(pdev);
+
+	pdev->state = PIXMAN_DEV_STATE_IDLE;
+	DBG("complete pixman composition.\n");
+	pdev->output = NULL;
+}
+
+// the same limits as the VSP
+static int
+pixman_dev_check_rect(struct v4l2_rect *src, struct v4l2_rect *dst)
+{
+	if (src->width > 8190 || src->height > 8190)
+		return 0;
+
+	if (dst->width != src->width || dst->height != src->height) {
+		if (src->width < PIXMAN_DEV_SCALER_MIN_PIXELS || src->height < PIXMAN_DEV_SCALER_MIN_PIXELS)
+			return 0;
+	}
+
+	return 1;
+}
+
+static int
+pixman_dev_do_draw_view(struct pixman_device *pdev, struct pixman_surface_state *vs,
+			struct v4l2_rect *src, struct v4l2_rect *dst, int opaque)
+{
+	int should_use_scaler = 0;
+	struct pixman_input *input;
+
+	if (src->width < 1 || src->height < 1) {
+		DBG("ignoring the size of zeros < (%dx%d)\n", src->width, src->height);
+		return 0;
+	}
+
+	if (!pixman_dev_check_rect(src, dst)) {
+		weston_log("ignoring a rectangle the device can't handle (%dx%d -> %dx%d).\n",
+			   src->width, src->height, dst->width, dst->height);
+		return 0;
+	}
+
+	if (dst->width != src->width || dst->height != src->height)
+		should_use_scaler = 1;
+
+	if (src->left < 0) {
+		src->width += src->left;
+		src->left = 0;
+	}
+
+	if (src->top < 0) {
+		src->height += src->top;
+		src->top = 0;
+	}
+
+	switch(pdev->state) {
+	case PIXMAN_DEV_STATE_START:
+		DBG("PIXMAN_DEV_STATE_START -> COMPSOING\n");
+		pdev->state = PIXMAN_DEV_STATE_COMPOSING;
+		break;
+
+	case PIXMAN_DEV_STATE_COMPOSING:
+		if (pdev->input_count == 0) {
+			DBG("PIXMAN_DEV_STATE_COMPOSING -> START (compose with output)\n");
+			pdev->state = PIXMAN_DEV_STATE_START;
+			if (pixman_dev_do_draw_view(pdev, &pdev->output->surface_state,
+						    &pdev->output->surface_state.base.src_rect,
+						    &pdev->output->surface_state.base.dst_rect, 0) < 0)
+				return -1;
+		}
+		break;
+
+	default:
+		weston_log("unknown state... %d\n", pdev->state);
+		return -1;
+	}
+
+	input = &pdev->inputs[pdev->input_count];
+
+	/* check if we need to use a scaler */
+	if (should_use_scaler) {
+		// if all scalers are oocupied, flush and then retry.
+		if (pdev->scaler_count == pdev->scaler_max) {
+			pixman_dev_comp_flush(pdev);
+			return pixman_dev_do_draw_view(pdev, vs, src, dst, opaque);
+		}
+
+		pdev->scaler_count++;
+	}
+
+	input->input_surface_states = vs;
+	input->use_scaler = should_use_scaler;
+	input->src = *src;
+	input->dst = *dst;
+	input->opaque = opaque;
+
+	// check if we should flush now
+	pdev->input_count++;
+	if (pdev->input_count == pdev->input_max)
+		pixman_dev_comp_flush(pdev);
+
+	return 0;
+}
+
+static int
+pixman_dev_comp_draw_view(struct v4l2_renderer_device *dev, struct v4l2_surface_state *surface_state)
+{
+	struct pixman_device *pdev = (struct pixman_device*)dev;
+	struct pixman_surface_state *vs = (struct pixman_surface_state*)surface_state;
+
+	struct v4l2_view_rect *rect;
+	int i;
+
+	for (i = 0; i < surface_state->num_rects; i++) {
+		rect = &surface_state->rects[i];
+		if (pixman_dev_do_draw_view(pdev, vs, &rect->src, &rect->dst, rect->opaque) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int
+pixman_dev_can_compose(struct v4l2_renderer_device *dev, struct v4l2_surface_state *surface_state)
+{
+	int i;
+
+	for (i = 0; i < surface_state->num_rects; i++) {
+		if (!pixman_dev_check_rect(&surface_state->rects[i].src, &surface_state->rects[i].dst))
+			return 0;
+	}
+
+	return 1;
+}
+
+static void
+pixman_dev_get_stats(struct v4l2_renderer_device *dev, struct v4l2_device_stats *stats)
+{
+	struct pixman_device *pdev = (struct pixman_device*)dev;
+
+	// composition runs on the CPU; there are no ioctls nor waits
+	*stats = pdev->totals;
+}
+
+static uint32_t
+pixman_dev_get_capabilities(void)
+{
+	return 0;
+}
+
+WL_EXPORT struct v4l2_device_interface v4l2_device_interface = {
+	.init = pixman_dev_init,
+
+	.create_output = pixman_dev_create_output,
+	.set_output_buffer = pixman_dev_set_output_buffer,
+
+	.create_surface = pixman_dev_create_surface,
+	.attach_buffer = pixman_dev_attach_buffer,
+
+	.begin_compose = pixman_dev_comp_begin,
+	.finish_compose = pixman_dev_comp_finish,
+	.draw_view = pixman_dev_comp_draw_view,
+	.can_compose = pixman_dev_can_compose,
+
+	.get_stats = pixman_dev_get_stats,
+
+	.get_capabilities = pixman_dev_get_capabilities,
+};
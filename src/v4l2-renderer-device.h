@@ -30,6 +30,16 @@
 struct v4l2_renderer_device {
 	struct media_device *media;
 	const char *device_name;
+	int userptr;		// planes may be read from user memory
+
+	/*
+	 * Set by the renderer. Buffers the device may keep intermediate
+	 * results in. create_buffer() returns a handle for destroy_buffer(),
+	 * or NULL.
+	 */
+	void *(*create_buffer)(struct v4l2_renderer_device *dev, unsigned int size, int *dmafd);
+	void (*destroy_buffer)(struct v4l2_renderer_device *dev, void *buffer);
+	void *renderer;
 };
 
 struct v4l2_renderer_output {
@@ -39,7 +49,18 @@ struct v4l2_renderer_output {
 
 struct v4l2_renderer_plane {
 	int dmafd;
+	void *userptr;		// if set, the plane is in user memory, not in dmafd
 	unsigned int stride;
+	unsigned int offset;	// of the plane in dmafd, which planes may share
+};
+
+#define V4L2_VIEW_RECT_MAX	4
+
+// a part of a view, and whether it's composed without blending
+struct v4l2_view_rect {
+	struct v4l2_rect src;
+	struct v4l2_rect dst;
+	int opaque;
 };
 
 struct v4l2_surface_state {
@@ -49,9 +70,15 @@ struct v4l2_surface_state {
 	struct v4l2_renderer *renderer;
 
 	struct kms_bo *bo;
-	void *addr;
+	void *addr;		// laid out like the SHM buffer
 	int bpp;
-	int bo_stride;
+	unsigned int bo_size;	// may be larger than the buffer
+
+	// surface damage not uploaded into the bo yet
+	pixman_region32_t damage;
+	int needs_full_upload;
+
+	unsigned int content_serial;	// bumped whenever the contents change
 
 	int num_planes;
 	struct v4l2_renderer_plane planes[VIDEO_MAX_PLANES];
@@ -61,11 +88,13 @@ struct v4l2_surface_state {
 	int height;
 	unsigned int pixel_format;
 
+	// bounding boxes of the view
 	struct v4l2_rect src_rect;
 	struct v4l2_rect dst_rect;
 
-	struct v4l2_rect opaque_src_rect;
-	struct v4l2_rect opaque_dst_rect;
+	// the visible part of the view, to be composed
+	int num_rects;
+	struct v4l2_view_rect rects[V4L2_VIEW_RECT_MAX];
 
 	struct wl_listener buffer_destroy_listener;
 	struct wl_listener surface_destroy_listener;
@@ -73,18 +102,76 @@ struct v4l2_surface_state {
 	struct wl_listener kms_buffer_destroy_listener;
 };
 
+// work done by a device since it was initialized
+struct v4l2_device_stats {
+	uint64_t passes;
+	uint64_t inputs;
+	uint64_t scaled;		// inputs going through a scaler
+	uint64_t ioctls;
+	uint64_t wait_nsec;		// time blocked waiting for the device
+};
+
+typedef void (*v4l2_compose_done_t)(void *data);
+
 struct v4l2_device_interface {
-	struct v4l2_renderer_device *(*init)(struct media_device *media, struct weston_config *config);
+	struct v4l2_renderer_device *(*init)(struct media_device *media, struct weston_config *config,
+					     struct wl_event_loop *loop);
+	// optional. frees a device; the renderer calls free() otherwise.
+	void (*destroy)(struct v4l2_renderer_device *dev);
 
 	struct v4l2_renderer_output *(*create_output)(struct v4l2_renderer_device *dev, int width, int height);
 	void (*set_output_buffer)(struct v4l2_renderer_output *out, struct v4l2_bo_state *bo);
 
 	struct v4l2_surface_state *(*create_surface)(struct v4l2_renderer_device *dev);
+	// optional. frees a surface state; the renderer calls free() otherwise.
+	void (*destroy_surface)(struct v4l2_renderer_device *dev, struct v4l2_surface_state *vs);
 	int (*attach_buffer)(struct v4l2_surface_state *vs);
-
-	void (*begin_compose)(struct v4l2_renderer_device *dev, struct v4l2_renderer_output *out);
+	/*
+	 * Optional. Returns 0 if buffers of the format can't be attached.
+	 * The renderer advertises multi-planar SHM formats only if the
+	 * device accepts them.
+	 */
+	int (*check_format)(unsigned int pixel_format, int num_planes);
+
+	/*
+	 * If preserve is set, views are composed on top of the current
+	 * contents of the output buffer instead of a cleared one.
+	 */
+	void (*begin_compose)(struct v4l2_renderer_device *dev, struct v4l2_renderer_output *out,
+			      int preserve);
 	void (*finish_compose)(struct v4l2_renderer_device *dev);
+	/*
+	 * Optional. Returns 0 if the composition is still in progress and
+	 * done() will be called from the event loop once it completes, or
+	 * -1 if the composition has already completed.
+	 */
+	int (*finish_compose_async)(struct v4l2_renderer_device *dev,
+				    v4l2_compose_done_t done, void *data);
+	/*
+	 * Optional, along with finish_compose_async(). Blocks until the
+	 * compositions in progress have completed and their done() has
+	 * been called.
+	 */
+	void (*wait_compose)(struct v4l2_renderer_device *dev);
 	int (*draw_view)(struct v4l2_renderer_device *dev, struct v4l2_surface_state *vs);
+	/*
+	 * Optional. Returns 0 if the device can't compose the rectangles of
+	 * the view set in vs, e.g. because of size limits. The renderer
+	 * then renders the view with pixman and passes the result instead.
+	 */
+	int (*can_compose)(struct v4l2_renderer_device *dev, struct v4l2_surface_state *vs);
+
+	/*
+	 * Optional. Copies a rectangle of the current output buffer into
+	 * pixels, converted to pixel_format. Returns -1 if the device can't,
+	 * in which case the renderer reads the buffer with the CPU.
+	 */
+	int (*read_pixels)(struct v4l2_renderer_device *dev, struct v4l2_renderer_output *out,
+			   unsigned int pixel_format, void *pixels, uint32_t stride,
+			   struct v4l2_rect *rect);
+
+	// optional. the renderer takes the differences between completed compositions.
+	void (*get_stats)(struct v4l2_renderer_device *dev, struct v4l2_device_stats *stats);
 
 	uint32_t (*get_capabilities)(void);
 };
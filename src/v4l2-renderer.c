@@ -30,11 +30,15 @@
 #include "config.h"
 
 #include <errno.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 
@@ -44,6 +48,7 @@
 #include "v4l2-renderer-device.h"
 
 #include <xf86drm.h>
+#include <drm_fourcc.h>
 #include <libkms/libkms.h>
 
 #include <wayland-kms.h>
@@ -67,13 +72,114 @@
 #endif
 #endif
 
+struct v4l2_bo_damage {
+	int valid;			// the buffer has been rendered once
+	pixman_region32_t region;	// damage since the buffer was rendered
+};
+
+#define V4L2_BO_ROW_BYTES	4096	// bos are allocated in rows of a page
+
+struct v4l2_pooled_bo {
+	struct wl_list link;
+	struct kms_bo *bo;
+	void *addr;
+	int dmafd;
+	unsigned int size;
+};
+
+// a bo the device may be reading, and how many compositions read it
+struct v4l2_busy_bo {
+	struct kms_bo *bo;
+	int count;
+};
+
+#define V4L2_STATIC_VIEWS_MAX	8
+
+// what a view at the bottom of the stack looked like in the last frame
+struct v4l2_view_sig {
+	struct weston_view *view;
+	struct weston_surface *surface;
+	unsigned int content_serial;
+	pixman_box32_t bbox;
+	struct weston_matrix matrix;
+	float alpha;
+	unsigned int stable;		// frames it has been unchanged for
+};
+
+/*
+ * The views at the bottom of the stack composed into a buffer of the
+ * size of the output, to be composed as a single opaque input.
+ */
+struct v4l2_static_cache {
+	struct v4l2_pooled_bo bo;
+	struct v4l2_renderer_output *out;
+	struct v4l2_surface_state *vs;
+	int count;			// views in the cache; 0 if invalid
+
+	// the pass composing the cache runs along with the frames
+	int pending;			// a pass is composing the cache
+	int building;			// views it composes; 0 once they change
+	struct wl_array busy_bos;	// bos read by the pass
+
+	struct v4l2_view_sig sigs[V4L2_STATIC_VIEWS_MAX];
+	int sig_count;
+};
+
+#define V4L2_STATS_FRAMES	64
+
+// what rendering a frame of an output took
+struct v4l2_frame_stats {
+	uint32_t msecs;			// when the repaint started
+	uint32_t compose_usecs;		// from then until the composition completed
+	unsigned int views;		// inputs handed to the device
+	uint64_t copied_bytes;		// SHM bytes uploaded since the previous frame
+	struct v4l2_device_stats device;	// work done by the device meanwhile
+};
+
 struct v4l2_output_state {
 	struct v4l2_renderer_output *output;
+	struct weston_output *output_base;
+	struct v4l2_device_instance *instance;	// device composing the output
 	uint32_t stride;
 	void *map;
 	struct v4l2_bo_state *bo;
+	struct v4l2_bo_damage *bo_damage;
 	int bo_count;
 	int bo_index;
+
+	struct wl_array fallbacks;	// views rendered with pixman in the last frame
+	struct wl_array busy_bos;	// bos read by the composition in flight
+
+	struct v4l2_static_cache static_cache;
+
+	// the last V4L2_STATS_FRAMES frames, in a ring indexed by stats_count
+	struct v4l2_frame_stats stats[V4L2_STATS_FRAMES];
+	unsigned int stats_count;
+	struct v4l2_frame_stats frame;	// the frame being rendered
+	struct timespec frame_start;
+	uint64_t copied_base;
+
+	int compose_pending;
+	int destroy_pending;
+};
+
+#define V4L2_DEVICE_MAX		4
+
+// a view the device can't compose, rendered with pixman
+struct v4l2_fallback {
+	struct v4l2_pooled_bo bo;
+	struct v4l2_surface_state *vs;
+};
+
+// a media device and the device module instance driving it
+struct v4l2_device_instance {
+	char *path;
+	struct media_device *media;
+	struct v4l2_renderer_device *device;
+	int output_count;
+
+	// device counters when the last composition completed
+	struct v4l2_device_stats stats;
 };
 
 struct v4l2_renderer {
@@ -82,15 +188,31 @@ struct v4l2_renderer {
 	struct kms_driver *kms;
 	struct wl_kms *wl_kms;
 
-	struct media_device *media;
 	char *device_name;
 	int drm_fd;
 
-	struct v4l2_renderer_device *device;
+	// outputs are bound to one of the instances. the first one is the default.
+	struct v4l2_device_instance instances[V4L2_DEVICE_MAX];
+	int instance_count;
 
 	int repaint_debug;
 	struct weston_binding *debug_binding;
 
+	int shm_zero_copy;
+	int static_cache_frames;	// 0 disables the static view cache
+
+	struct weston_binding *stats_binding;
+	int stats_interval;		// frames between summaries in the log; 0 for none
+	uint64_t copied_bytes;		// SHM bytes uploaded since the start
+
+	// idle bos for SHM surfaces, the most recently released first
+	struct wl_list bo_pool;
+	int bo_pool_count;
+	int bo_pool_max;
+
+	// bos read by the compositions in flight. not to be reused nor written.
+	struct wl_array busy_bos;
+
 	struct wl_signal destroy_signal;
 };
 
@@ -120,6 +242,20 @@ get_renderer(struct weston_compositor *ec)
 	return (struct v4l2_renderer *)ec->renderer;
 }
 
+static int
+v4l2_renderer_has_userptr(struct v4l2_renderer *renderer)
+{
+	int i;
+
+	// a surface may be shown on any of the devices
+	for (i = 0; i < renderer->instance_count; i++) {
+		if (!renderer->instances[i].device->userptr)
+			return 0;
+	}
+
+	return 1;
+}
+
 static int
 v4l2_renderer_read_pixels(struct weston_output *output,
 			 pixman_format_code_t format, void *pixels,
@@ -128,30 +264,93 @@ v4l2_renderer_read_pixels(struct weston_output *output,
 {
 	struct v4l2_output_state *vo = get_output_state(output);
 	struct v4l2_bo_state *bo = &vo->bo[vo->bo_index];
-	uint32_t v, len = width * 4;
+	pixman_image_t *src_image, *dst_image;
+	unsigned int pixel_format;
+	struct v4l2_rect rect;
+	uint32_t v, len, bpp;
 	void *src, *dst;
 
 	switch(format) {
 	case PIXMAN_a8r8g8b8:
+		pixel_format = V4L2_PIX_FMT_ABGR32;
+		bpp = 4;
+		break;
+	case PIXMAN_x8r8g8b8:
+		pixel_format = V4L2_PIX_FMT_XBGR32;
+		bpp = 4;
+		break;
+	case PIXMAN_b8g8r8a8:
+		pixel_format = V4L2_PIX_FMT_ARGB32;
+		bpp = 4;
+		break;
+	case PIXMAN_b8g8r8x8:
+		pixel_format = V4L2_PIX_FMT_XRGB32;
+		bpp = 4;
+		break;
+	case PIXMAN_r8g8b8:
+		pixel_format = V4L2_PIX_FMT_BGR24;
+		bpp = 3;
+		break;
+	case PIXMAN_r5g6b5:
+		pixel_format = V4L2_PIX_FMT_RGB565;
+		bpp = 2;
 		break;
 	default:
 		return -1;
 	}
 
+	if (x + width > (uint32_t)output->current_mode->width ||
+	    y + height > (uint32_t)output->current_mode->height)
+		return -1;
+
+	len = width * bpp;
+
+	if (device_interface->read_pixels) {
+		rect.left = x;
+		rect.top = y;
+		rect.width = width;
+		rect.height = height;
+		if (device_interface->read_pixels(vo->instance->device, vo->output,
+						  pixel_format, pixels, len, &rect) == 0)
+			return 0;
+	}
+
+	if (format != PIXMAN_a8r8g8b8) {
+		// let pixman convert the pixels
+		src_image = pixman_image_create_bits(PIXMAN_a8r8g8b8,
+						     output->current_mode->width,
+						     output->current_mode->height,
+						     bo->map, bo->stride);
+		dst_image = pixman_image_create_bits(format, width, height,
+						     pixels, len);
+		if (!src_image || !dst_image) {
+			if (src_image)
+				pixman_image_unref(src_image);
+			if (dst_image)
+				pixman_image_unref(dst_image);
+			return -1;
+		}
+
+		pixman_image_composite32(PIXMAN_OP_SRC, src_image, NULL, dst_image,
+					 x, y, 0, 0, 0, 0, width, height);
+
+		pixman_image_unref(src_image);
+		pixman_image_unref(dst_image);
+		return 0;
+	}
+
 	if (x == 0 && y == 0 &&
 	    width == (uint32_t)output->current_mode->width &&
 	    height == (uint32_t)output->current_mode->height &&
 	    bo->stride == len) {
 		DBG("%s: copy entire buffer at once\n", __func__);
-		// TODO: we may want to optimize this using underlying
-		// V4L2 MC hardware if possible.
 		memcpy(pixels, bo->map, bo->stride * height);
 		return 0;
 	}
 
 	src = bo->map + x * 4 + y * bo->stride;
 	dst = pixels;
-	for (v = y; v < height; v++) {
+	for (v = 0; v < height; v++) {
 		memcpy(dst, src, len);
 		src += bo->stride;
 		dst += len;
@@ -246,6 +445,45 @@ transform_region(pixman_transform_t *transform, pixman_region32_t *src_region,
 				  abs(F2I(pixman_fixed_ceil(q2.vector[1] - q1.vector[1]))));
 }
 
+/*
+ * The inverse of the magnification done by weston_output_update_matrix(),
+ * in the global coordinate.
+ */
+static void
+transform_apply_zoom(pixman_transform_t *transform, struct weston_output *output)
+{
+	double magnification = 1 / (1 - output->zoom.spring_z.current);
+	double cx = output->x + output->width / 2.0;
+	double cy = output->y + output->height / 2.0;
+
+	pixman_transform_translate(transform, NULL, D2F(-cx), D2F(-cy));
+	pixman_transform_scale(transform, NULL,
+			       D2F(1 / magnification), D2F(1 / magnification));
+	pixman_transform_translate(transform, NULL,
+				   D2F(cx + output->zoom.trans_x * output->width / 2.0),
+				   D2F(cy + output->zoom.trans_y * output->height / 2.0));
+}
+
+static void
+region_apply_zoom(struct weston_output *output, pixman_region32_t *src, pixman_region32_t *dst)
+{
+	double magnification = 1 / (1 - output->zoom.spring_z.current);
+	double cx = output->x + output->width / 2.0;
+	double cy = output->y + output->height / 2.0;
+	double ox = cx + output->zoom.trans_x * output->width / 2.0;
+	double oy = cy + output->zoom.trans_y * output->height / 2.0;
+	pixman_box32_t *box = pixman_region32_extents(src);
+	int x1, y1, x2, y2;
+
+	x1 = floor((box->x1 - ox) * magnification + cx);
+	y1 = floor((box->y1 - oy) * magnification + cy);
+	x2 = ceil((box->x2 - ox) * magnification + cx);
+	y2 = ceil((box->y2 - oy) * magnification + cy);
+
+	pixman_region32_fini(dst);
+	pixman_region32_init_rect(dst, x1, y1, x2 - x1, y2 - y1);
+}
+
 static void
 calculate_transform_matrix(struct weston_view *ev, struct weston_output *output,
 			   pixman_transform_t *transform)
@@ -301,6 +539,9 @@ calculate_transform_matrix(struct weston_view *ev, struct weston_output *output,
 				   pixman_double_to_fixed(output->x),
 				   pixman_double_to_fixed(output->y));
 
+	if (output->zoom.active)
+		transform_apply_zoom(transform, output);
+
 	if (ev->transform.enabled) {
 		/* Pixman supports only 2D transform matrix, but Weston uses 3D,
 		 * so we're omitting Z coordinate here
@@ -385,21 +626,398 @@ set_v4l2_rect(pixman_region32_t *region, struct v4l2_rect *rect)
 	rect->height = bbox->y2 - bbox->y1;
 }
 
+// the device can only scale and move a rectangle
+static int
+transform_is_axis_aligned(pixman_transform_t *transform)
+{
+	return transform->matrix[0][1] == 0 && transform->matrix[1][0] == 0 &&
+		transform->matrix[0][0] > 0 && transform->matrix[1][1] > 0 &&
+		transform->matrix[2][0] == 0 && transform->matrix[2][1] == 0;
+}
+
+static pixman_format_code_t
+v4l2_renderer_pixman_format(unsigned int pixel_format)
+{
+	switch(pixel_format) {
+	case V4L2_PIX_FMT_ABGR32:
+		return PIXMAN_a8r8g8b8;
+	case V4L2_PIX_FMT_XBGR32:
+		return PIXMAN_x8r8g8b8;
+	case V4L2_PIX_FMT_ARGB32:
+		return PIXMAN_b8g8r8a8;
+	case V4L2_PIX_FMT_XRGB32:
+		return PIXMAN_b8g8r8x8;
+	case V4L2_PIX_FMT_RGB24:
+		return PIXMAN_b8g8r8;
+	case V4L2_PIX_FMT_BGR24:
+		return PIXMAN_r8g8b8;
+	case V4L2_PIX_FMT_RGB565:
+		return PIXMAN_r5g6b5;
+	case V4L2_PIX_FMT_RGB332:
+		return PIXMAN_r3g3b2;
+	case V4L2_PIX_FMT_YUYV:
+		return PIXMAN_yuy2;
+	default:
+		return 0;
+	}
+}
+
+static int
+v4l2_renderer_get_bo(struct v4l2_renderer *renderer, unsigned int size, struct v4l2_pooled_bo *pbo);
 static void
-draw_view(struct weston_view *ev, struct weston_output *output)
+v4l2_renderer_put_bo(struct v4l2_renderer *renderer, struct kms_bo *bo, void *addr, int dmafd,
+		     unsigned int size);
+
+static int
+v4l2_renderer_bo_is_busy(struct v4l2_renderer *renderer, struct kms_bo *bo)
 {
-	struct v4l2_renderer *renderer = (struct v4l2_renderer*)output->compositor->renderer;
+	struct v4l2_busy_bo *busy;
+
+	wl_array_for_each(busy, &renderer->busy_bos) {
+		if (busy->bo == bo)
+			return 1;
+	}
+
+	return 0;
+}
+
+// the bo is read by the composition of the output being prepared
+static void
+v4l2_renderer_mark_bo_busy(struct v4l2_output_state *vo, struct kms_bo *bo)
+{
+	struct v4l2_renderer *renderer = vo->instance->device->renderer;
+	struct v4l2_busy_bo *busy;
+	struct kms_bo **marked;
+
+	wl_array_for_each(marked, &vo->busy_bos) {
+		if (*marked == bo)
+			return;
+	}
+
+	if (!(marked = wl_array_add(&vo->busy_bos, sizeof *marked)))
+		return;
+	*marked = bo;
+
+	wl_array_for_each(busy, &renderer->busy_bos) {
+		if (busy->bo == bo) {
+			busy->count++;
+			return;
+		}
+	}
+
+	if (!(busy = wl_array_add(&renderer->busy_bos, sizeof *busy))) {
+		vo->busy_bos.size -= sizeof *marked;
+		return;
+	}
+	busy->bo = bo;
+	busy->count = 1;
+}
+
+// drop the marks of a composition once the device is done with its bos
+static void
+v4l2_renderer_release_marks(struct v4l2_renderer *renderer, struct wl_array *marks)
+{
+	struct v4l2_busy_bo *busy, *last;
+	struct kms_bo **marked;
+
+	wl_array_for_each(marked, marks) {
+		wl_array_for_each(busy, &renderer->busy_bos) {
+			if (busy->bo != *marked)
+				continue;
+
+			if (--busy->count == 0) {
+				last = (struct v4l2_busy_bo *)((char *)renderer->busy_bos.data +
+							       renderer->busy_bos.size) - 1;
+				*busy = *last;
+				renderer->busy_bos.size -= sizeof *busy;
+			}
+			break;
+		}
+	}
+	marks->size = 0;
+}
+
+// the composition of the output completed
+static void
+v4l2_renderer_release_busy_bos(struct v4l2_output_state *vo)
+{
+	v4l2_renderer_release_marks(vo->instance->device->renderer, &vo->busy_bos);
+}
+
+static void
+v4l2_renderer_release_fallbacks(struct v4l2_output_state *vo)
+{
+	struct v4l2_renderer *renderer = vo->instance->device->renderer;
+	struct v4l2_fallback *fb;
+
+	wl_array_for_each(fb, &vo->fallbacks) {
+		v4l2_renderer_put_bo(renderer, fb->bo.bo, fb->bo.addr, fb->bo.dmafd, fb->bo.size);
+		if (device_interface->destroy_surface)
+			device_interface->destroy_surface(vo->instance->device, fb->vs);
+		else
+			free(fb->vs);
+	}
+	vo->fallbacks.size = 0;
+}
+
+/*
+ * Render a view the device can't compose with pixman, into a scratch
+ * buffer of the size of its destination. The buffer is then composed by
+ * the device in place of the surface, like any other view. The buffer
+ * is kept until the next frame of the output, as the device may still
+ * read it until the composition completes.
+ */
+static struct v4l2_surface_state *
+draw_view_fallback(struct weston_view *ev, struct weston_output *output,
+		   pixman_transform_t *transform, struct v4l2_rect *dst)
+{
+	struct v4l2_output_state *vo = get_output_state(output);
+	struct v4l2_surface_state *vs = get_surface_state(ev->surface);
+	struct v4l2_fallback *fb;
+	pixman_image_t *src_image, *dst_image, *mask = NULL;
+	pixman_format_code_t format;
+	pixman_filter_t filter;
+	struct wl_shm_buffer *shm_buffer = NULL;
+	uint32_t stride = dst->width * 4;
+	size_t size = 0;
+	void *data;
+
+	format = v4l2_renderer_pixman_format(vs->pixel_format);
+	if (!format || vs->num_planes != 1) {
+		weston_log("can't render a view in format 0x%08x with pixman.\n", vs->pixel_format);
+		return NULL;
+	}
+
+	if (dst->width < 1 || dst->height < 1)
+		return NULL;
+
+	if (!(fb = wl_array_add(&vo->fallbacks, sizeof *fb)))
+		return NULL;
+
+	if (v4l2_renderer_get_bo(vo->instance->device->renderer, stride * dst->height, &fb->bo) < 0)
+		goto error;
+
+	if (!(fb->vs = device_interface->create_surface(vo->instance->device))) {
+		v4l2_renderer_put_bo(vo->instance->device->renderer, fb->bo.bo, fb->bo.addr,
+				     fb->bo.dmafd, fb->bo.size);
+		goto error;
+	}
+
+	// read the pixels where the device would
+	if (vs->planes[0].userptr) {
+		data = vs->planes[0].userptr;
+		// the client may shrink the pool under us
+		if (vs->buffer_ref.buffer)
+			shm_buffer = vs->buffer_ref.buffer->shm_buffer;
+	} else if (vs->addr) {
+		data = vs->addr;
+	} else {
+		size = vs->planes[0].stride * vs->height;
+		data = mmap(NULL, size, PROT_READ, MAP_SHARED, vs->planes[0].dmafd, 0);
+		if (data == MAP_FAILED) {
+			weston_log("mmap failed for dmafd=%d (%s).\n",
+				   vs->planes[0].dmafd, strerror(errno));
+			goto error_surface;
+		}
+	}
+
+	src_image = pixman_image_create_bits(format, vs->width, vs->height,
+					     data, vs->planes[0].stride);
+	dst_image = pixman_image_create_bits(PIXMAN_a8r8g8b8, dst->width, dst->height,
+					     fb->bo.addr, stride);
+	if (!src_image || !dst_image) {
+		if (src_image)
+			pixman_image_unref(src_image);
+		if (dst_image)
+			pixman_image_unref(dst_image);
+		if (size)
+			munmap(data, size);
+		goto error_surface;
+	}
+
+	filter = PIXMAN_FILTER_BILINEAR;
+	if (transform->matrix[0][0] == pixman_fixed_1 && transform->matrix[1][1] == pixman_fixed_1 &&
+	    transform->matrix[0][1] == 0 && transform->matrix[1][0] == 0)
+		filter = PIXMAN_FILTER_NEAREST;
+
+	pixman_image_set_transform(src_image, transform);
+	pixman_image_set_filter(src_image, filter, NULL, 0);
+
+	if (ev->alpha < 1.0) {
+		pixman_color_t color = { 0, 0, 0, 0xffff * ev->alpha };
+		mask = pixman_image_create_solid_fill(&color);
+	}
+
+	// pixels outside of the surface become transparent
+	if (shm_buffer)
+		wl_shm_buffer_begin_access(shm_buffer);
+	pixman_image_composite32(PIXMAN_OP_SRC, src_image, mask, dst_image,
+				 dst->left, dst->top, 0, 0, 0, 0,
+				 dst->width, dst->height);
+	if (shm_buffer)
+		wl_shm_buffer_end_access(shm_buffer);
+
+	if (mask)
+		pixman_image_unref(mask);
+	pixman_image_unref(src_image);
+	pixman_image_unref(dst_image);
+	if (size)
+		munmap(data, size);
+
+	fb->vs->width = dst->width;
+	fb->vs->height = dst->height;
+	fb->vs->pixel_format = V4L2_PIX_FMT_ABGR32;
+	fb->vs->num_planes = 1;
+	fb->vs->planes[0].dmafd = fb->bo.dmafd;
+	fb->vs->planes[0].stride = stride;
+	fb->vs->alpha = 1.0;
+	fb->vs->src_rect.width = dst->width;
+	fb->vs->src_rect.height = dst->height;
+	fb->vs->dst_rect = *dst;
+	fb->vs->rects[0].src = fb->vs->src_rect;
+	fb->vs->rects[0].dst = *dst;
+	fb->vs->num_rects = 1;
+
+	if (device_interface->attach_buffer(fb->vs) < 0) {
+		weston_log("the device can't take the pixman output.\n");
+		goto error_surface;
+	}
+
+	return fb->vs;
+
+error_surface:
+	v4l2_renderer_put_bo(vo->instance->device->renderer, fb->bo.bo, fb->bo.addr,
+			     fb->bo.dmafd, fb->bo.size);
+	if (device_interface->destroy_surface)
+		device_interface->destroy_surface(vo->instance->device, fb->vs);
+	else
+		free(fb->vs);
+error:
+	vo->fallbacks.size -= sizeof *fb;
+	return NULL;
+}
+
+static int
+add_view_rects(struct v4l2_surface_state *vs, pixman_transform_t *transform,
+	       pixman_region32_t *region, int opaque)
+{
+	struct v4l2_view_rect *rect;
+	pixman_region32_t box, src;
+	pixman_box32_t *boxes;
+	int i, n;
+
+	boxes = pixman_region32_rectangles(region, &n);
+	if (vs->num_rects + n > V4L2_VIEW_RECT_MAX)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		rect = &vs->rects[vs->num_rects++];
+
+		pixman_region32_init_rect(&box, boxes[i].x1, boxes[i].y1,
+					  boxes[i].x2 - boxes[i].x1,
+					  boxes[i].y2 - boxes[i].y1);
+		transform_region(transform, &box, &src);
+		set_v4l2_rect(&box, &rect->dst);
+		set_v4l2_rect(&src, &rect->src);
+		rect->opaque = opaque;
+
+		DBG("rect %d: %dx%d@(%d,%d) -> %dx%d@(%d,%d)%s\n", vs->num_rects - 1,
+		    rect->src.width, rect->src.height, rect->src.left, rect->src.top,
+		    rect->dst.width, rect->dst.height, rect->dst.left, rect->dst.top,
+		    opaque ? " [opaque]" : "");
+
+		pixman_region32_fini(&box);
+		pixman_region32_fini(&src);
+	}
+
+	return 0;
+}
+
+/*
+ * Split the visible part of a view into the rectangles of the opaque and
+ * the blended regions. Returns -1 if it takes more than
+ * V4L2_VIEW_RECT_MAX rectangles.
+ */
+static int
+set_view_rects(struct v4l2_surface_state *vs, pixman_transform_t *transform,
+	       pixman_region32_t *opaque, pixman_region32_t *blended)
+{
+	vs->num_rects = 0;
+
+	if (add_view_rects(vs, transform, opaque, 1) < 0 ||
+	    add_view_rects(vs, transform, blended, 0) < 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Blend the bounding box of the view, then draw the opaque part on top of
+ * it if it's a single rectangle.
+ */
+static void
+set_view_bbox_rects(struct v4l2_surface_state *vs, pixman_transform_t *transform,
+		    pixman_region32_t *opaque)
+{
+	struct v4l2_view_rect *rect = &vs->rects[0];
+	pixman_region32_t src;
+
+	rect->src = vs->src_rect;
+	rect->dst = vs->dst_rect;
+	rect->opaque = 0;
+	vs->num_rects = 1;
+
+	if (pixman_region32_n_rects(opaque) != 1)
+		return;
+
+	rect = &vs->rects[1];
+	set_v4l2_rect(opaque, &rect->dst);
+	transform_region(transform, opaque, &src);
+	set_v4l2_rect(&src, &rect->src);
+	pixman_region32_fini(&src);
+	rect->opaque = 1;
+
+	// nothing to blend if the whole view is opaque
+	if (rect->dst.left == vs->dst_rect.left && rect->dst.top == vs->dst_rect.top &&
+	    rect->dst.width == vs->dst_rect.width && rect->dst.height == vs->dst_rect.height)
+		vs->rects[0] = *rect;
+	else
+		vs->num_rects = 2;
+}
+
+static void
+v4l2_renderer_upload_damage(struct v4l2_surface_state *vs);
+static int
+v4l2_renderer_drop_userptr(struct v4l2_surface_state *vs);
+
+/*
+ * Unless use_clip is set, the parts of the view hidden by the views
+ * above it are composed as well.
+ */
+static void
+draw_view(struct weston_view *ev, struct weston_output *output, pixman_region32_t *repaint_area,
+	  int use_clip)
+{
+	struct v4l2_output_state *vo = get_output_state(output);
 	struct v4l2_surface_state *vs = get_surface_state(ev->surface);
+	struct v4l2_surface_state *fallback;
 	pixman_region32_t dst_region, src_region;
-	pixman_region32_t region, opaque_src_region, opaque_dst_region;
+	pixman_region32_t region, opaque_dst_region, blend_dst_region;
 	pixman_transform_t transform;
 
 	/* a surface in the repaint area? */
 	pixman_region32_init(&region);
-	pixman_region32_intersect(&region,
-				  &ev->transform.boundingbox,
-				  &output->region);
-	pixman_region32_subtract(&region, &region, &ev->clip);
+	if (output->zoom.active) {
+		// the clip is in the unmagnified coordinate. overdraw instead.
+		region_apply_zoom(output, &ev->transform.boundingbox, &region);
+		pixman_region32_intersect(&region, &region, repaint_area);
+	} else {
+		pixman_region32_intersect(&region,
+					  &ev->transform.boundingbox,
+					  repaint_area);
+		if (use_clip)
+			pixman_region32_subtract(&region, &region, &ev->clip);
+	}
 	if (!pixman_region32_not_empty(&region)) {
 		DBG("%s: skipping a view: not visible: view=(%d,%d)-(%d,%d), repaint=(%d,%d)-(%d,%d)\n",
 		    __func__,
@@ -410,171 +1028,1105 @@ draw_view(struct weston_view *ev, struct weston_output *output)
 		goto out;
 	}
 
-	/* you may sometime get not-yet-attached views */
-	if (vs->planes[0].dmafd == 0)
-		goto out;
-
 	/*
-	 * Check if the surface is still valid. OpenGL/ES apps may destroy
-	 * buffers before they destroy a surface. This check works in the
-	 * serialized world only.
+	 * You may sometime get not-yet-attached views. Also check if the
+	 * surface is still valid. OpenGL/ES apps may destroy buffers before
+	 * they destroy a surface. This check works in the serialized world
+	 * only. Views read from user memory have no dmabuf.
 	 */
-	if (fcntl(vs->planes[0].dmafd, F_GETFD) < 0)
+	if (v4l2_renderer_drop_userptr(vs) < 0)
 		goto out;
 
-	if (output->zoom.active) {
-		weston_log("v4l2 renderer does not support zoom\n");
+	if (!vs->planes[0].userptr &&
+	    (vs->planes[0].dmafd <= 0 ||
+	     fcntl(vs->planes[0].dmafd, F_GETFD) < 0))
 		goto out;
-	}
+
+	// flush_damage() skipped the upload if the surface was hidden then
+	v4l2_renderer_upload_damage(vs);
 
 	/* we have to compute a transform matrix */
 	calculate_transform_matrix(ev, output, &transform);
 
-	pixman_region32_init(&opaque_src_region);
+	/* find out the final destination in the output coordinate */
+	pixman_region32_init(&dst_region);
+	pixman_region32_copy(&dst_region, &region);
+	region_global_to_output(output, &dst_region);
+
 	pixman_region32_init(&opaque_dst_region);
+	pixman_region32_init(&blend_dst_region);
 
 	if (pixman_region32_not_empty(&ev->surface->opaque)) {
-		pixman_region32_t output_region;
+		pixman_region32_t clipped;
 		pixman_transform_t inverse;
+		pixman_box32_t *boxes;
+		int i, n;
 
 		pixman_transform_invert(&inverse, &transform);
-		transform_region(&inverse, &ev->surface->opaque, &opaque_dst_region);
-
-		pixman_region32_init_rect(&output_region, 0, 0, output->width, output->height);
+		boxes = pixman_region32_rectangles(&ev->surface->opaque, &n);
+		for (i = 0; i < n; i++) {
+			pixman_region32_t box;
+
+			pixman_region32_init_rect(&box, boxes[i].x1, boxes[i].y1,
+						  boxes[i].x2 - boxes[i].x1,
+						  boxes[i].y2 - boxes[i].y1);
+			transform_region(&inverse, &box, &clipped);
+			pixman_region32_union(&opaque_dst_region, &opaque_dst_region, &clipped);
+			pixman_region32_fini(&clipped);
+			pixman_region32_fini(&box);
+		}
 
-		pixman_region32_intersect(&opaque_dst_region, &opaque_dst_region, &output_region);
-		transform_region(&transform, &opaque_dst_region, &opaque_src_region);
+		/* never draw outside of what's to be repainted */
+		pixman_region32_intersect(&opaque_dst_region, &opaque_dst_region, &dst_region);
 	}
-
-	/* find out the final destination in the output coordinate */
-	pixman_region32_init(&dst_region);
-	pixman_region32_copy(&dst_region, &region);
-	region_global_to_output(output, &dst_region);
+	pixman_region32_subtract(&blend_dst_region, &dst_region, &opaque_dst_region);
 
 	transform_region(&transform, &dst_region, &src_region);
 	set_v4l2_rect(&dst_region, &vs->dst_rect);
 	set_v4l2_rect(&src_region, &vs->src_rect);
 
-	/* setup opaque region */
-	set_v4l2_rect(&opaque_dst_region, &vs->opaque_dst_rect);
-	set_v4l2_rect(&opaque_src_region, &vs->opaque_src_rect);
-
 	vs->alpha = ev->alpha;
 
 	DBG("monitor: %dx%d@(%d,%d)\n", output->width, output->height, output->x, output->y);
 	DBG("composing from %dx%d@(%d,%d) to %dx%d@(%d,%d)\n",
 	    vs->src_rect.width, vs->src_rect.height, vs->src_rect.left, vs->src_rect.top,
 	    vs->dst_rect.width, vs->dst_rect.height, vs->dst_rect.left, vs->dst_rect.top);
-	DBG("composing from %dx%d@(%d,%d) to %dx%d@(%d,%d) [opaque region]\n",
-	    vs->opaque_src_rect.width, vs->opaque_src_rect.height, vs->opaque_src_rect.left, vs->opaque_src_rect.top,
-	    vs->opaque_dst_rect.width, vs->opaque_dst_rect.height, vs->opaque_dst_rect.left, vs->opaque_dst_rect.top);
 
-	device_interface->draw_view(renderer->device, vs);
+	/*
+	 * Compose the visible part only, and the opaque part of it without
+	 * blending. If that takes too many rectangles, or the rectangles are
+	 * too small for the device, compose the bounding box instead.
+	 */
+	if (set_view_rects(vs, &transform, &opaque_dst_region, &blend_dst_region) < 0 ||
+	    (device_interface->can_compose &&
+	     !device_interface->can_compose(vo->instance->device, vs)))
+		set_view_bbox_rects(vs, &transform, &opaque_dst_region);
+
+	if (!transform_is_axis_aligned(&transform) ||
+	    (device_interface->can_compose &&
+	     !device_interface->can_compose(vo->instance->device, vs))) {
+		DBG("%s: render a view with pixman\n", __func__);
+		fallback = draw_view_fallback(ev, output, &transform, &vs->dst_rect);
+		if (fallback)
+			device_interface->draw_view(vo->instance->device, fallback);
+	} else {
+		device_interface->draw_view(vo->instance->device, vs);
+		if (vs->bo)
+			v4l2_renderer_mark_bo_busy(vo, vs->bo);
+	}
 
 	pixman_region32_fini(&dst_region);
 	pixman_region32_fini(&src_region);
-	pixman_region32_fini(&opaque_src_region);
 	pixman_region32_fini(&opaque_dst_region);
+	pixman_region32_fini(&blend_dst_region);
 out:
 	pixman_region32_fini(&region);
 }
 
 static void
-repaint_surfaces(struct weston_output *output, pixman_region32_t *damage)
+v4l2_renderer_output_state_destroy(struct v4l2_output_state *vo);
+static void
+v4l2_renderer_end_frame_stats(struct v4l2_output_state *vo);
+
+static void
+v4l2_renderer_compose_done(void *data)
 {
-	struct weston_compositor *compositor = output->compositor;
-	struct v4l2_output_state *vo = get_output_state(output);
-	struct v4l2_renderer *renderer = (struct v4l2_renderer*)compositor->renderer;
-	struct weston_view *view;
+	struct v4l2_output_state *vo = data;
 
-	device_interface->begin_compose(renderer->device, vo->output);
+	DBG("%s\n", __func__);
 
-	wl_list_for_each_reverse(view, &compositor->view_list, link) {
-		if (view->plane == &compositor->primary_plane)
-			draw_view(view, output);
+	vo->compose_pending = 0;
+	v4l2_renderer_release_busy_bos(vo);
+
+	if (vo->destroy_pending) {
+		// don't credit the work to the next output composed
+		if (device_interface->get_stats)
+			device_interface->get_stats(vo->instance->device, &vo->instance->stats);
+		if (!vo->static_cache.pending)
+			v4l2_renderer_output_state_destroy(vo);
+		return;
 	}
 
-	device_interface->finish_compose(renderer->device);
+	v4l2_renderer_end_frame_stats(vo);
+
+	// the output buffer is ready. the caller may flip now.
+	wl_signal_emit(&vo->output_base->frame_signal, vo->output_base);
 }
 
-static void
+/*
+ * Find the lowest view that needs to be composed to repaint the area. If
+ * the area is fully covered by opaque views, anything below them doesn't
+ * show up, and the rest of the output can be kept as it is.
+ */
+static struct weston_view *
+find_covering_view(struct weston_compositor *compositor, pixman_region32_t *area)
+{
+	struct weston_view *view, *cover = NULL;
+	pixman_region32_t opaque, uncovered;
+
+	pixman_region32_init(&opaque);
+	pixman_region32_init(&uncovered);
+
+	wl_list_for_each(view, &compositor->view_list, link) {
+		if (view->plane != &compositor->primary_plane)
+			continue;
+
+		pixman_region32_union(&opaque, &opaque, &view->transform.opaque);
+		pixman_region32_subtract(&uncovered, area, &opaque);
+		if (!pixman_region32_not_empty(&uncovered)) {
+			cover = view;
+			break;
+		}
+	}
+
+	pixman_region32_fini(&opaque);
+	pixman_region32_fini(&uncovered);
+
+	return cover;
+}
+
+static void
+v4l2_renderer_view_sig(struct weston_view *view, struct v4l2_view_sig *sig)
+{
+	struct v4l2_surface_state *vs = get_surface_state(view->surface);
+
+	memset(sig, 0, sizeof *sig);
+	sig->view = view;
+	sig->surface = view->surface;
+	sig->content_serial = vs ? vs->content_serial : 0;
+	sig->bbox = *pixman_region32_extents(&view->transform.boundingbox);
+	sig->matrix = view->transform.matrix;
+	sig->alpha = view->alpha;
+}
+
+static void
+v4l2_renderer_release_static_cache(struct v4l2_output_state *vo)
+{
+	struct v4l2_static_cache *cache = &vo->static_cache;
+	struct v4l2_renderer *renderer = vo->instance->device->renderer;
+
+	if (cache->vs) {
+		if (device_interface->destroy_surface)
+			device_interface->destroy_surface(vo->instance->device, cache->vs);
+		else
+			free(cache->vs);
+		cache->vs = NULL;
+	}
+
+	if (cache->out) {
+		free(cache->out);
+		cache->out = NULL;
+	}
+
+	if (cache->bo.bo) {
+		v4l2_renderer_put_bo(renderer, cache->bo.bo, cache->bo.addr, cache->bo.dmafd,
+				     cache->bo.size);
+		cache->bo.bo = NULL;
+	}
+
+	v4l2_renderer_release_marks(renderer, &cache->busy_bos);
+	wl_array_release(&cache->busy_bos);
+	wl_array_init(&cache->busy_bos);
+	cache->count = 0;
+	cache->building = 0;
+}
+
+static int
+v4l2_renderer_init_static_cache(struct weston_output *output, struct v4l2_output_state *vo)
+{
+	struct v4l2_static_cache *cache = &vo->static_cache;
+	struct v4l2_renderer_device *dev = vo->instance->device;
+	int width = output->current_mode->width;
+	int height = output->current_mode->height;
+	struct v4l2_bo_state bo_state;
+
+	if (v4l2_renderer_get_bo(dev->renderer, width * 4 * height, &cache->bo) < 0) {
+		cache->bo.bo = NULL;
+		return -1;
+	}
+
+	if (!(cache->out = device_interface->create_output(dev, width, height)))
+		goto error;
+
+	bo_state.dmafd = cache->bo.dmafd;
+	bo_state.map = cache->bo.addr;
+	bo_state.stride = width * 4;
+	device_interface->set_output_buffer(cache->out, &bo_state);
+
+	if (!(cache->vs = device_interface->create_surface(dev)))
+		goto error;
+
+	cache->vs->width = width;
+	cache->vs->height = height;
+	cache->vs->pixel_format = V4L2_PIX_FMT_ABGR32;
+	cache->vs->num_planes = 1;
+	cache->vs->planes[0].dmafd = cache->bo.dmafd;
+	cache->vs->planes[0].stride = width * 4;
+	cache->vs->alpha = 1.0;
+
+	if (device_interface->attach_buffer(cache->vs) < 0)
+		goto error;
+
+	return 0;
+
+error:
+	weston_log("can't set up the static view cache for %s.\n", output->name);
+	v4l2_renderer_release_static_cache(vo);
+	return -1;
+}
+
+// the pass composing the static cache retired. the cache is used from the next frame.
+static void
+v4l2_renderer_static_cache_done(void *data)
+{
+	struct v4l2_output_state *vo = data;
+	struct v4l2_static_cache *cache = &vo->static_cache;
+
+	cache->pending = 0;
+	v4l2_renderer_release_marks(vo->instance->device->renderer, &cache->busy_bos);
+
+	if (vo->destroy_pending) {
+		if (!vo->compose_pending)
+			v4l2_renderer_output_state_destroy(vo);
+		return;
+	}
+
+	if (cache->building) {
+		cache->vs->content_serial++;
+		cache->count = cache->building;
+		cache->building = 0;
+	}
+}
+
+/*
+ * Find the views at the bottom of the stack that haven't changed for
+ * static-cache-frames frames, and compose them into the static cache if
+ * they aren't in it yet. Returns the number of views the cache stands
+ * for, or 0 if the cache is not to be used.
+ */
+static int
+v4l2_renderer_update_static_cache(struct weston_output *output, struct v4l2_output_state *vo)
+{
+	struct weston_compositor *compositor = output->compositor;
+	struct v4l2_renderer *renderer = vo->instance->device->renderer;
+	struct v4l2_static_cache *cache = &vo->static_cache;
+	struct weston_view *view;
+	struct v4l2_view_sig sig;
+	struct wl_array marks;
+	int n = 0, run = 0;
+
+	if (renderer->static_cache_frames <= 0)
+		return 0;
+
+	wl_list_for_each_reverse(view, &compositor->view_list, link) {
+		if (view->plane != &compositor->primary_plane)
+			continue;
+		if (n == V4L2_STATIC_VIEWS_MAX)
+			break;
+
+		v4l2_renderer_view_sig(view, &sig);
+		if (n < cache->sig_count &&
+		    !memcmp(&sig, &cache->sigs[n], offsetof(struct v4l2_view_sig, stable)))
+			sig.stable = cache->sigs[n].stable + 1;
+
+		// the cached contents are stale once a view in it changes
+		if (n < cache->count && sig.stable == 0)
+			cache->count = 0;
+		if (n < cache->building && sig.stable == 0)
+			cache->building = 0;
+
+		if (run == n && get_surface_state(view->surface) &&
+		    sig.stable >= (unsigned int)renderer->static_cache_frames)
+			run++;
+
+		cache->sigs[n++] = sig;
+	}
+
+	if (n < cache->count)
+		cache->count = 0;
+	if (n < cache->building)
+		cache->building = 0;
+	cache->sig_count = n;
+
+	// a cache of a single view saves nothing
+	if (output->zoom.active || run < 2) {
+		cache->count = 0;
+		cache->building = 0;
+		return 0;
+	}
+
+	// the cache is being written. it's used once the pass retires.
+	if (cache->pending)
+		return 0;
+
+	if (run <= cache->count)
+		return cache->count;
+
+	if (!cache->vs && v4l2_renderer_init_static_cache(output, vo) < 0)
+		return 0;
+
+	DBG("%s: compose %d static views into the cache\n", __func__, run);
+
+	// the bos read by the pass stay busy until it retires, not the frame
+	marks = vo->busy_bos;
+	vo->busy_bos = cache->busy_bos;
+
+	device_interface->begin_compose(vo->instance->device, cache->out, 0);
+	n = 0;
+	wl_list_for_each_reverse(view, &compositor->view_list, link) {
+		if (view->plane != &compositor->primary_plane)
+			continue;
+		if (n++ == run)
+			break;
+
+		draw_view(view, output, &output->region, 0);
+	}
+
+	cache->busy_bos = vo->busy_bos;
+	vo->busy_bos = marks;
+
+	cache->count = 0;
+	cache->building = run;
+	cache->pending = 1;
+
+	/*
+	 * Waiting for the pass would wait for the passes of other outputs
+	 * queued before it too, and run their done callbacks in the middle
+	 * of this repaint. Queue it like any other pass instead.
+	 */
+	if (!device_interface->finish_compose_async ||
+	    device_interface->finish_compose_async(vo->instance->device,
+						   v4l2_renderer_static_cache_done,
+						   vo) < 0) {
+		if (!device_interface->finish_compose_async)
+			device_interface->finish_compose(vo->instance->device);
+		v4l2_renderer_static_cache_done(vo);
+	}
+
+	return cache->count;
+}
+
+static void
+draw_static_cache(struct weston_output *output, struct v4l2_output_state *vo,
+		  pixman_region32_t *area)
+{
+	struct v4l2_surface_state *vs = vo->static_cache.vs;
+	pixman_region32_t region;
+
+	pixman_region32_init(&region);
+	pixman_region32_copy(&region, area);
+	region_global_to_output(output, &region);
+
+	set_v4l2_rect(&region, &vs->dst_rect);
+	vs->src_rect = vs->dst_rect;
+	vs->rects[0].src = vs->src_rect;
+	vs->rects[0].dst = vs->dst_rect;
+	vs->rects[0].opaque = 1;
+	vs->num_rects = 1;
+
+	pixman_region32_fini(&region);
+
+	device_interface->draw_view(vo->instance->device, vs);
+	v4l2_renderer_mark_bo_busy(vo, vo->static_cache.bo.bo);
+}
+
+/*
+ * Returns 0 if the composition is still running on the device. In that
+ * case, the frame_signal is emitted once it completes.
+ */
+static int
+repaint_surfaces(struct weston_output *output, pixman_region32_t *damage)
+{
+	struct weston_compositor *compositor = output->compositor;
+	struct v4l2_output_state *vo = get_output_state(output);
+	struct weston_view *view, *cover = NULL;
+	pixman_region32_t area;
+	pixman_box32_t *box;
+	int ret, cached, n = 0;
+
+	/*
+	 * Each view is composed as a rectangle, so compose within the
+	 * extents of the damage. Only if opaque views cover it, the rest
+	 * of the buffer can be preserved. Otherwise we start over from
+	 * a cleared buffer.
+	 */
+	box = pixman_region32_extents(damage);
+	pixman_region32_init_rect(&area, box->x1, box->y1,
+				  box->x2 - box->x1, box->y2 - box->y1);
+	pixman_region32_intersect(&area, &area, &output->region);
+
+	// the scratch buffers of the last frame have been composed by now
+	if (!vo->static_cache.pending)
+		v4l2_renderer_release_fallbacks(vo);
+
+	cached = v4l2_renderer_update_static_cache(output, vo);
+
+	// damage and opaque regions are not magnified. repaint everything.
+	if (!output->zoom.active && pixman_region32_not_empty(&area) &&
+	    !pixman_region32_equal(&area, &output->region))
+		cover = find_covering_view(compositor, &area);
+
+	if (!cover)
+		pixman_region32_copy(&area, &output->region);
+
+	DBG("%s: compose (%d,%d)-(%d,%d)%s\n", __func__,
+	    area.extents.x1, area.extents.y1, area.extents.x2, area.extents.y2,
+	    cover ? " on top of the current contents" : "");
+
+	device_interface->begin_compose(vo->instance->device, vo->output, cover != NULL);
+
+	wl_list_for_each_reverse(view, &compositor->view_list, link) {
+		if (view->plane != &compositor->primary_plane)
+			continue;
+
+		/*
+		 * the cache stands for the views at the bottom. it's not
+		 * needed if they're all below the covering view.
+		 */
+		if (n < cached) {
+			if (view == cover)
+				cover = NULL;
+			if (++n == cached && !cover) {
+				draw_static_cache(output, vo, &area);
+				vo->frame.views++;
+			}
+			continue;
+		}
+
+		/* views below the covering one are hidden */
+		if (cover) {
+			if (view != cover)
+				continue;
+			cover = NULL;
+		}
+
+		draw_view(view, output, &area, 1);
+		vo->frame.views++;
+	}
+
+	pixman_region32_fini(&area);
+
+	if (device_interface->finish_compose_async) {
+		ret = device_interface->finish_compose_async(vo->instance->device,
+							     v4l2_renderer_compose_done,
+							     vo);
+		return ret;
+	}
+
+	device_interface->finish_compose(vo->instance->device);
+	return -1;
+}
+
+/*
+ * The repaint region of a buffer is the damage of this frame plus the
+ * damage of the frames rendered into the other buffers since this one
+ * was rendered.
+ */
+static void
+v4l2_renderer_accumulate_damage(struct v4l2_output_state *vo, struct weston_output *output,
+				pixman_region32_t *output_damage, pixman_region32_t *repaint)
+{
+	struct v4l2_bo_damage *bd = &vo->bo_damage[vo->bo_index];
+	int i;
+
+	if (bd->valid)
+		pixman_region32_union(repaint, output_damage, &bd->region);
+	else
+		pixman_region32_copy(repaint, &output->region);
+
+	for (i = 0; i < vo->bo_count; i++) {
+		if (i != vo->bo_index)
+			pixman_region32_union(&vo->bo_damage[i].region,
+					      &vo->bo_damage[i].region, output_damage);
+	}
+
+	pixman_region32_clear(&bd->region);
+	bd->valid = 1;
+}
+
+static void
+v4l2_renderer_log_stats(struct v4l2_output_state *vo, unsigned int frames)
+{
+	struct v4l2_frame_stats *f, sum, max;
+	unsigned int i;
+
+	if (frames > vo->stats_count)
+		frames = vo->stats_count;
+	if (frames > V4L2_STATS_FRAMES)
+		frames = V4L2_STATS_FRAMES;
+	if (!frames)
+		return;
+
+	memset(&sum, 0, sizeof sum);
+	memset(&max, 0, sizeof max);
+	for (i = vo->stats_count - frames; i != vo->stats_count; i++) {
+		f = &vo->stats[i % V4L2_STATS_FRAMES];
+		sum.compose_usecs += f->compose_usecs;
+		sum.views += f->views;
+		sum.copied_bytes += f->copied_bytes;
+		sum.device.passes += f->device.passes;
+		sum.device.inputs += f->device.inputs;
+		sum.device.scaled += f->device.scaled;
+		sum.device.ioctls += f->device.ioctls;
+		sum.device.wait_nsec += f->device.wait_nsec;
+		if (f->compose_usecs > max.compose_usecs)
+			max.compose_usecs = f->compose_usecs;
+		if (f->device.passes > max.device.passes)
+			max.device.passes = f->device.passes;
+	}
+
+	weston_log("v4l2-renderer: output %s: %u frames, compose %u/%u us avg/max, "
+		   "%u views, %llu/%llu passes avg/max, %llu inputs, %llu scaled, "
+		   "%llu ioctls, %llu us waiting, %llu bytes copied per frame\n",
+		   vo->output_base->name, frames,
+		   sum.compose_usecs / frames, max.compose_usecs,
+		   sum.views / frames,
+		   (unsigned long long)(sum.device.passes / frames),
+		   (unsigned long long)max.device.passes,
+		   (unsigned long long)(sum.device.inputs / frames),
+		   (unsigned long long)(sum.device.scaled / frames),
+		   (unsigned long long)(sum.device.ioctls / frames),
+		   (unsigned long long)(sum.device.wait_nsec / frames / 1000),
+		   (unsigned long long)(sum.copied_bytes / frames));
+}
+
+static void
+v4l2_renderer_dump_stats(struct v4l2_output_state *vo)
+{
+	struct v4l2_frame_stats *f;
+	unsigned int i;
+
+	weston_log("v4l2-renderer: output %s: the last frames\n", vo->output_base->name);
+	weston_log_continue(STAMP_SPACE "msecs     compose_us views passes inputs scaled ioctls wait_us copied\n");
+
+	i = vo->stats_count > V4L2_STATS_FRAMES ? vo->stats_count - V4L2_STATS_FRAMES : 0;
+	for (; i != vo->stats_count; i++) {
+		f = &vo->stats[i % V4L2_STATS_FRAMES];
+		weston_log_continue(STAMP_SPACE "%-9u %10u %5u %6llu %6llu %6llu %6llu %7llu %llu\n",
+				    f->msecs, f->compose_usecs, f->views,
+				    (unsigned long long)f->device.passes,
+				    (unsigned long long)f->device.inputs,
+				    (unsigned long long)f->device.scaled,
+				    (unsigned long long)f->device.ioctls,
+				    (unsigned long long)(f->device.wait_nsec / 1000),
+				    (unsigned long long)f->copied_bytes);
+	}
+
+	v4l2_renderer_log_stats(vo, V4L2_STATS_FRAMES);
+}
+
+static void
+v4l2_renderer_begin_frame_stats(struct v4l2_output_state *vo, struct v4l2_renderer *renderer)
+{
+	struct v4l2_frame_stats *f = &vo->frame;
+
+	memset(f, 0, sizeof *f);
+	clock_gettime(CLOCK_MONOTONIC, &vo->frame_start);
+	f->msecs = vo->frame_start.tv_sec * 1000 + vo->frame_start.tv_nsec / 1000000;
+
+	// uploads happen in flush_damage, before the repaint
+	f->copied_bytes = renderer->copied_bytes - vo->copied_base;
+	vo->copied_base = renderer->copied_bytes;
+}
+
+static void
+v4l2_renderer_end_frame_stats(struct v4l2_output_state *vo)
+{
+	struct v4l2_renderer *renderer = get_renderer(vo->output_base->compositor);
+	struct v4l2_frame_stats *f = &vo->frame;
+	struct v4l2_device_instance *instance = vo->instance;
+	struct v4l2_device_stats now;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	f->compose_usecs = (ts.tv_sec - vo->frame_start.tv_sec) * 1000000 +
+		(ts.tv_nsec - vo->frame_start.tv_nsec) / 1000;
+
+	/*
+	 * Outputs sharing an instance may have compositions queued at the
+	 * same time. The device runs them in order and reports each one
+	 * done before starting the next, so the work since the previous
+	 * completion on the instance is this composition's.
+	 */
+	if (device_interface->get_stats) {
+		device_interface->get_stats(instance->device, &now);
+		f->device.passes = now.passes - instance->stats.passes;
+		f->device.inputs = now.inputs - instance->stats.inputs;
+		f->device.scaled = now.scaled - instance->stats.scaled;
+		f->device.ioctls = now.ioctls - instance->stats.ioctls;
+		f->device.wait_nsec = now.wait_nsec - instance->stats.wait_nsec;
+		instance->stats = now;
+	}
+
+	vo->stats[vo->stats_count++ % V4L2_STATS_FRAMES] = *f;
+
+	if (renderer->stats_interval > 0 &&
+	    vo->stats_count % renderer->stats_interval == 0)
+		v4l2_renderer_log_stats(vo, renderer->stats_interval);
+}
+
+static void
 v4l2_renderer_repaint_output(struct weston_output *output,
 			    pixman_region32_t *output_damage)
 {
-	//struct v4l2_output_state *vo = get_output_state(output);
+	struct v4l2_output_state *vo = get_output_state(output);
+	pixman_region32_t repaint;
 	DBG("%s\n", __func__);
 
-	// render all views
-	repaint_surfaces(output, output_damage);
+	v4l2_renderer_begin_frame_stats(vo, get_renderer(output->compositor));
+
+	pixman_region32_init(&repaint);
+	v4l2_renderer_accumulate_damage(vo, output, output_damage, &repaint);
+
+	// render views in the damaged area
+	if (repaint_surfaces(output, &repaint) == 0)
+		vo->compose_pending = 1;
+
+	pixman_region32_fini(&repaint);
 
 	// remember the damaged area
 	pixman_region32_copy(&output->previous_damage, output_damage);
 
-	// emits signal
-	wl_signal_emit(&output->frame_signal, output);
+	/*
+	 * The frame_signal is emitted when the composition completes, so
+	 * that listeners get the up-to-date contents. Actual flip should
+	 * be done by caller on the frame_signal.
+	 */
+	if (!vo->compose_pending) {
+		v4l2_renderer_release_busy_bos(vo);
+		v4l2_renderer_end_frame_stats(vo);
+		wl_signal_emit(&output->frame_signal, output);
+	}
+}
 
-	/* Actual flip should be done by caller */
+/*
+ * The planes after the first one of multi-planar formats are subsampled
+ * by hsub and vsub, with cpp bytes per sample.
+ */
+static void
+v4l2_renderer_plane_layout(struct v4l2_surface_state *vs, int plane,
+			   int *hsub, int *vsub, int *cpp)
+{
+	*hsub = *vsub = 1;
+	*cpp = vs->bpp;
+
+	if (plane == 0)
+		return;
+
+	switch (vs->pixel_format) {
+	case V4L2_PIX_FMT_NV12M:
+		*hsub = *vsub = 2;
+		*cpp = 2;
+		break;
+	case V4L2_PIX_FMT_NV16M:
+		*hsub = 2;
+		*cpp = 2;
+		break;
+	case V4L2_PIX_FMT_YUV420M:
+		*hsub = *vsub = 2;
+		*cpp = 1;
+		break;
+	}
 }
 
 static inline void
-v4l2_renderer_copy_buffer(struct v4l2_surface_state *vs, struct weston_buffer *buffer)
+v4l2_renderer_copy_rect(struct v4l2_surface_state *vs, void *data, pixman_box32_t *r)
 {
 	void *src, *dst;
-	int y, stride, bo_stride;
+	int i, y, y1, y2, len, stride, hsub, vsub, cpp;
+
+	// the bo is laid out like the SHM buffer
+	for (i = 0; i < vs->num_planes; i++) {
+		v4l2_renderer_plane_layout(vs, i, &hsub, &vsub, &cpp);
+		stride = vs->planes[i].stride;
+
+		y1 = r->y1 / vsub;
+		y2 = (r->y2 + vsub - 1) / vsub;
+		len = ((r->x2 + hsub - 1) / hsub - r->x1 / hsub) * cpp;
+
+		src = data + vs->planes[i].offset + y1 * stride + r->x1 / hsub * cpp;
+		dst = vs->addr + vs->planes[i].offset + y1 * stride + r->x1 / hsub * cpp;
+
+		for (y = y1; y < y2; y++) {
+			memcpy(dst, src, len);
+			dst += stride;
+			src += stride;
+		}
 
-	src = wl_shm_buffer_get_data(buffer->shm_buffer);
-	dst = vs->addr;
+		vs->renderer->copied_bytes += (uint64_t)len * (y2 - y1);
+	}
+}
 
-	stride = vs->planes[0].stride;
-	bo_stride = vs->bo_stride;
+static inline void
+v4l2_renderer_copy_buffer(struct v4l2_surface_state *vs, struct weston_buffer *buffer)
+{
+	struct weston_surface *surface = vs->surface;
+	pixman_box32_t *rects, full, r;
+	void *data;
+	int i, n;
+
+	data = wl_shm_buffer_get_data(buffer->shm_buffer);
 
 	wl_shm_buffer_begin_access(buffer->shm_buffer);
-	for (y = 0; y < buffer->height; y++) {
-		memcpy(dst, src, buffer->width * vs->bpp);
-		dst += bo_stride;
-		src += stride;
+
+	if (vs->needs_full_upload) {
+		full.x1 = full.y1 = 0;
+		full.x2 = buffer->width;
+		full.y2 = buffer->height;
+		v4l2_renderer_copy_rect(vs, data, &full);
+		goto done;
 	}
+
+	rects = pixman_region32_rectangles(&vs->damage, &n);
+	for (i = 0; i < n; i++) {
+		r = weston_surface_to_buffer_rect(surface, rects[i]);
+
+		// clip to the buffer in case the damage was out of bounds
+		if (r.x1 < 0)
+			r.x1 = 0;
+		if (r.y1 < 0)
+			r.y1 = 0;
+		r.x2 = MIN(r.x2, buffer->width);
+		r.y2 = MIN(r.y2, buffer->height);
+		if (r.x1 >= r.x2 || r.y1 >= r.y2)
+			continue;
+
+		v4l2_renderer_copy_rect(vs, data, &r);
+	}
+
+done:
 	wl_shm_buffer_end_access(buffer->shm_buffer);
+}
 
+/*
+ * Returns 1 if any part of the surface is going to be composed on the
+ * primary plane. The view clip is up to date at this point, as
+ * flush_damage is called after the damage has been accumulated.
+ */
+static int
+v4l2_renderer_surface_is_visible(struct weston_surface *surface)
+{
+	struct weston_view *view;
+	pixman_region32_t visible;
+	int ret = 0;
+
+	pixman_region32_init(&visible);
+	wl_list_for_each(view, &surface->views, surface_link) {
+		if (view->plane != &surface->compositor->primary_plane)
+			continue;
+
+		pixman_region32_subtract(&visible, &view->transform.boundingbox,
+					 &view->clip);
+		if (pixman_region32_not_empty(&visible)) {
+			ret = 1;
+			break;
+		}
+	}
+	pixman_region32_fini(&visible);
+
+	return ret;
 }
 
+static int
+v4l2_renderer_alloc_shm_bo(struct v4l2_surface_state *vs, struct weston_buffer *buffer,
+			   unsigned int pixel_format, int bpp, int num_planes);
+
+/*
+ * A composition in flight may still read the bo, e.g. one of another
+ * output. Move on to another bo rather than writing into it; the old one
+ * goes back to the pool, which keeps it until the device is done.
+ */
+static int
+v4l2_renderer_swap_shm_bo(struct v4l2_surface_state *vs)
+{
+	struct v4l2_pooled_bo pbo;
+	int i;
+
+	if (v4l2_renderer_get_bo(vs->renderer, vs->bo_size, &pbo) < 0)
+		return -1;
+
+	v4l2_renderer_put_bo(vs->renderer, vs->bo, vs->addr, vs->planes[0].dmafd, vs->bo_size);
+
+	vs->bo = pbo.bo;
+	vs->addr = pbo.addr;
+	vs->bo_size = pbo.size;
+	for (i = 0; i < vs->num_planes; i++)
+		vs->planes[i].dmafd = pbo.dmafd;
+
+	// the damage alone doesn't make the contents of a new bo
+	vs->needs_full_upload = 1;
+
+	return 0;
+}
+
+// copies the damage not uploaded yet from the buffer into the bo
 static void
-v4l2_renderer_flush_damage(struct weston_surface *surface)
+v4l2_renderer_upload_damage(struct v4l2_surface_state *vs)
 {
-	struct v4l2_surface_state *vs = get_surface_state(surface);
 	struct weston_buffer *buffer = vs->buffer_ref.buffer;
 
+	if (!buffer || !vs->addr)
+		return;
+
+	if (!pixman_region32_not_empty(&vs->damage) && !vs->needs_full_upload)
+		return;
+
+	if (v4l2_renderer_bo_is_busy(vs->renderer, vs->bo) &&
+	    v4l2_renderer_swap_shm_bo(vs) < 0)
+		weston_log("no spare bo. overwriting a bo the device may be reading.\n");
+
 	DBG("%s: flushing damage..\n", __func__);
 
 	v4l2_renderer_copy_buffer(vs, buffer);
 
+	pixman_region32_clear(&vs->damage);
+	vs->needs_full_upload = 0;
+}
+
+/*
+ * Copy a surface read from user memory into a bo once the device gave up
+ * on user pointers. Surfaces that don't commit again are moved over when
+ * they are drawn, with the buffer the renderer still references.
+ */
+static int
+v4l2_renderer_drop_userptr(struct v4l2_surface_state *vs)
+{
+	struct weston_buffer *buffer = vs->buffer_ref.buffer;
+	int i;
+
+	if (!vs->planes[0].userptr || v4l2_renderer_has_userptr(vs->renderer))
+		return 0;
+
+	if (!buffer || !buffer->shm_buffer) {
+		for (i = 0; i < vs->num_planes; i++)
+			vs->planes[i].userptr = NULL;
+		return -1;
+	}
+
+	// the contents are copied by the next upload
+	return v4l2_renderer_alloc_shm_bo(vs, buffer, vs->pixel_format, vs->bpp,
+					  vs->num_planes);
+}
+
+static void
+v4l2_renderer_flush_damage(struct weston_surface *surface)
+{
+	struct v4l2_surface_state *vs = get_surface_state(surface);
+	struct weston_buffer *buffer = vs->buffer_ref.buffer;
+	void *data;
+	int i;
+
+	if (pixman_region32_not_empty(&surface->damage))
+		vs->content_serial++;
+
+	if (buffer && vs->planes[0].userptr) {
+		/*
+		 * Nothing to upload; the device reads the client's memory.
+		 * Refresh the pointer as the pool may have been remapped.
+		 */
+		if (v4l2_renderer_has_userptr(vs->renderer)) {
+			data = wl_shm_buffer_get_data(buffer->shm_buffer);
+			for (i = 0; i < vs->num_planes; i++)
+				vs->planes[i].userptr = data + vs->planes[i].offset;
+			return;
+		}
+
+		if (v4l2_renderer_drop_userptr(vs) < 0)
+			return;
+	}
+
+	pixman_region32_union(&vs->damage, &vs->damage, &surface->damage);
+
 	/*
-	 * TODO: We may consider use of surface->damage to
-	 * optimize updates.
+	 * Don't upload if the bo isn't going to be composed this time.
+	 * The damage is kept, and so is our reference to the buffer, and
+	 * draw_view() uploads it if the surface becomes visible later.
 	 */
+	if (!v4l2_renderer_surface_is_visible(surface))
+		return;
+
+	v4l2_renderer_upload_damage(vs);
+}
+
+/*
+ * Sizes are rounded up to classes a quarter of a power of two apart, so
+ * that a bo can be reused for a buffer of a slightly different size,
+ * e.g. while a window is being resized.
+ */
+static unsigned int
+v4l2_bo_size_class(unsigned int size)
+{
+	unsigned int step = V4L2_BO_ROW_BYTES;
+
+	while (step * 8 < size)
+		step *= 2;
+
+	return (size + step - 1) / step * step;
 }
 
 static void
-v4l2_release_kms_bo(struct v4l2_surface_state *vs)
+v4l2_destroy_bo(struct kms_bo *bo, int dmafd)
 {
-	int i;
+	if (dmafd >= 0)
+		close(dmafd);
 
-	if (!vs)
+	if (kms_bo_unmap(bo))
+		weston_log("kms_bo_unmap failed.\n");
+
+	kms_bo_destroy(&bo);
+}
+
+static int
+v4l2_create_bo(struct v4l2_renderer *renderer, unsigned int size, struct v4l2_pooled_bo *pbo)
+{
+	unsigned attr[] = {
+		KMS_BO_TYPE, KMS_BO_TYPE_SCANOUT_X8R8G8B8,
+		KMS_WIDTH, V4L2_BO_ROW_BYTES / 4,
+		KMS_HEIGHT, size / V4L2_BO_ROW_BYTES,
+		KMS_TERMINATE_PROP_LIST
+	};
+	unsigned handle;
+
+	pbo->bo = NULL;
+	pbo->dmafd = -1;
+	pbo->size = size;
+
+	if (kms_bo_create(renderer->kms, attr, &pbo->bo)) {
+		weston_log("kms_bo_create failed.\n");
+		return -1;
+	}
+
+	if (kms_bo_map(pbo->bo, &pbo->addr)) {
+		weston_log("kms_bo_map failed.\n");
+		kms_bo_destroy(&pbo->bo);
+		return -1;
+	}
+
+	if (kms_bo_get_prop(pbo->bo, KMS_HANDLE, &handle)) {
+		weston_log("kms_bo_get_prop failed.\n");
+		goto error;
+	}
+
+	if (drmPrimeHandleToFD(renderer->drm_fd, handle, DRM_CLOEXEC, &pbo->dmafd)) {
+		weston_log("drmPrimeHandleToFD failed.\n");
+		goto error;
+	}
+
+	return 0;
+
+error:
+	v4l2_destroy_bo(pbo->bo, -1);
+	pbo->bo = NULL;
+	return -1;
+}
+
+/*
+ * Get a bo of at least the given size, from the pool if possible. Bos
+ * which have been idle the longest are reused first. Bos a composition
+ * in flight still reads are skipped.
+ */
+static int
+v4l2_renderer_get_bo(struct v4l2_renderer *renderer, unsigned int size, struct v4l2_pooled_bo *pbo)
+{
+	struct v4l2_pooled_bo *entry;
+
+	size = v4l2_bo_size_class(size);
+
+	wl_list_for_each_reverse(entry, &renderer->bo_pool, link) {
+		if (entry->size != size || v4l2_renderer_bo_is_busy(renderer, entry->bo))
+			continue;
+
+		DBG("%s: reusing a bo of %u bytes (dmafd=%d).\n", __func__, size, entry->dmafd);
+		*pbo = *entry;
+		wl_list_remove(&entry->link);
+		renderer->bo_pool_count--;
+		free(entry);
+		return 0;
+	}
+
+	return v4l2_create_bo(renderer, size, pbo);
+}
+
+static void
+v4l2_renderer_put_bo(struct v4l2_renderer *renderer, struct kms_bo *bo, void *addr, int dmafd,
+		     unsigned int size)
+{
+	struct v4l2_pooled_bo *entry;
+
+	if (renderer->bo_pool_max <= 0 || !(entry = calloc(1, sizeof *entry))) {
+		v4l2_destroy_bo(bo, dmafd);
 		return;
+	}
 
-	if (vs->bo) {
-		for (i = 0; i < vs->num_planes; i++) {
-			if (vs->planes[i].dmafd >= 0) {
-				close(vs->planes[i].dmafd);
-				vs->planes[i].dmafd = -1;
-			}
-		}
+	entry->bo = bo;
+	entry->addr = addr;
+	entry->dmafd = dmafd;
+	entry->size = size;
+	wl_list_insert(&renderer->bo_pool, &entry->link);
+	renderer->bo_pool_count++;
+
+	// evict the least recently released ones
+	while (renderer->bo_pool_count > renderer->bo_pool_max) {
+		entry = container_of(renderer->bo_pool.prev, struct v4l2_pooled_bo, link);
+		wl_list_remove(&entry->link);
+		renderer->bo_pool_count--;
+		v4l2_destroy_bo(entry->bo, entry->dmafd);
+		free(entry);
+	}
+}
+
+static void
+v4l2_renderer_flush_bo_pool(struct v4l2_renderer *renderer)
+{
+	struct v4l2_pooled_bo *entry, *tmp;
+
+	wl_list_for_each_safe(entry, tmp, &renderer->bo_pool, link) {
+		v4l2_destroy_bo(entry->bo, entry->dmafd);
+		free(entry);
+	}
+	wl_list_init(&renderer->bo_pool);
+	renderer->bo_pool_count = 0;
+}
+
+static void *
+v4l2_renderer_create_buffer(struct v4l2_renderer_device *dev, unsigned int size, int *dmafd)
+{
+	struct v4l2_pooled_bo *pbo;
 
-		if (kms_bo_unmap(vs->bo))
-			weston_log("kms_bo_unmap failed.\n");
+	if (!(pbo = calloc(1, sizeof *pbo)))
+		return NULL;
+
+	if (v4l2_renderer_get_bo(dev->renderer, size, pbo)) {
+		free(pbo);
+		return NULL;
+	}
+
+	*dmafd = pbo->dmafd;
+	return pbo;
+}
+
+static void
+v4l2_renderer_destroy_buffer(struct v4l2_renderer_device *dev, void *buffer)
+{
+	struct v4l2_pooled_bo *pbo = buffer;
+
+	v4l2_renderer_put_bo(dev->renderer, pbo->bo, pbo->addr, pbo->dmafd, pbo->size);
+	free(pbo);
+}
 
-		kms_bo_destroy(&vs->bo);
+static void
+v4l2_release_kms_bo(struct v4l2_surface_state *vs)
+{
+	if (!vs)
+		return;
+
+	if (vs->bo) {
+		v4l2_renderer_put_bo(vs->renderer, vs->bo, vs->addr, vs->planes[0].dmafd,
+				     vs->bo_size);
+		vs->planes[0].dmafd = -1;
+		vs->bo = NULL;
 		vs->addr = NULL;
+		vs->bo_size = 0;
 	}
 }
 
@@ -582,29 +2134,152 @@ static void
 buffer_state_handle_buffer_destroy(struct wl_listener *listener, void *data)
 {
 	struct v4l2_surface_state *vs;
+	int i;
 
 	vs = container_of(listener, struct v4l2_surface_state,
 			  buffer_destroy_listener);
 
 	v4l2_release_kms_bo(vs);
+	for (i = 0; i < vs->num_planes; i++)
+		vs->planes[i].userptr = NULL;
 
 	vs->buffer_destroy_listener.notify = NULL;
 }
 
+/*
+ * The planes of an SHM buffer follow each other in the pool. The planes
+ * after the first one have its stride scaled down by their subsampling.
+ * Returns the size of the buffer.
+ */
+static unsigned int
+v4l2_renderer_set_shm_planes(struct v4l2_surface_state *vs, unsigned int stride, int height)
+{
+	unsigned int offset = 0;
+	int i, hsub, vsub, cpp;
+
+	for (i = 0; i < vs->num_planes; i++) {
+		v4l2_renderer_plane_layout(vs, i, &hsub, &vsub, &cpp);
+		vs->planes[i].stride = stride / hsub * cpp / vs->bpp;
+		vs->planes[i].offset = offset;
+		offset += vs->planes[i].stride * ((height + vsub - 1) / vsub);
+	}
+
+	return offset;
+}
+
+/*
+ * Let the device read the pixels straight from the client's memory. The
+ * buffer is referenced until the next attach, so it isn't released to
+ * the client while the device may read it.
+ */
+static int
+v4l2_renderer_import_shm(struct v4l2_surface_state *vs, struct weston_buffer *buffer,
+			 unsigned int pixel_format, int bpp, int num_planes)
+{
+	void *data;
+	int i;
+
+	// a bo is no longer needed
+	v4l2_release_kms_bo(vs);
+
+	vs->width = buffer->width;
+	vs->height = buffer->height;
+	vs->pixel_format = pixel_format;
+	vs->num_planes = num_planes;
+	vs->bpp = bpp;
+	v4l2_renderer_set_shm_planes(vs, wl_shm_buffer_get_stride(buffer->shm_buffer),
+				     buffer->height);
+
+	data = wl_shm_buffer_get_data(buffer->shm_buffer);
+	for (i = 0; i < num_planes; i++) {
+		vs->planes[i].dmafd = -1;
+		vs->planes[i].userptr = data + vs->planes[i].offset;
+	}
+
+	pixman_region32_clear(&vs->damage);
+
+	if (device_interface->attach_buffer(vs) == -1) {
+		for (i = 0; i < num_planes; i++)
+			vs->planes[i].userptr = NULL;
+		return -1;
+	}
+
+	DBG("%s: %dx%d buffer imported.\n", __func__, buffer->width, buffer->height);
+
+	return 0;
+}
+
+/*
+ * Allocate a bo to copy the pixels into. Used when the device can't read
+ * the client's memory.
+ */
+static int
+v4l2_renderer_alloc_shm_bo(struct v4l2_surface_state *vs, struct weston_buffer *buffer,
+			   unsigned int pixel_format, int bpp, int num_planes)
+{
+	struct v4l2_pooled_bo pbo;
+	unsigned int stride, size;
+	int i;
+
+	stride = wl_shm_buffer_get_stride(buffer->shm_buffer);
+	for (i = 0; i < vs->num_planes; i++)
+		vs->planes[i].userptr = NULL;
+
+	if (vs->bo &&
+	    vs->width == buffer->width &&
+	    vs->height == buffer->height &&
+	    vs->planes[0].stride == stride && vs->bpp == bpp &&
+	    vs->pixel_format == pixel_format) {
+	    // no need to recreate buffer
+	    return 0;
+	}
+
+	// create a reference to the shm_buffer.
+	vs->width = buffer->width;
+	vs->height = buffer->height;
+	vs->pixel_format = pixel_format;
+	vs->num_planes = num_planes;
+	vs->bpp = bpp;
+	size = v4l2_renderer_set_shm_planes(vs, stride, buffer->height);
+
+	// keep the bo if the new buffer falls into the same size class
+	if (vs->bo && vs->bo_size != v4l2_bo_size_class(size))
+		v4l2_release_kms_bo(vs);
+
+	if (device_interface->attach_buffer(vs) == -1) {
+		v4l2_release_kms_bo(vs);
+		return -1;
+	}
+
+	if (!vs->bo) {
+		vs->planes[0].dmafd = -1;
+		if (v4l2_renderer_get_bo(vs->renderer, size, &pbo))
+			return -1;
+
+		vs->bo = pbo.bo;
+		vs->addr = pbo.addr;
+		vs->bo_size = pbo.size;
+		vs->planes[0].dmafd = pbo.dmafd;
+	}
+
+	// the planes share the bo
+	for (i = 0; i < num_planes; i++)
+		vs->planes[i].dmafd = vs->planes[0].dmafd;
+
+	// the contents are uploaded in flush_damage
+	vs->needs_full_upload = 1;
+
+	DBG("%s: %dx%d buffer attached (dmafd=%d).\n", __func__, buffer->width, buffer->height, vs->planes[0].dmafd);
+
+	return 0;
+}
+
 static int
 v4l2_renderer_attach_shm(struct v4l2_surface_state *vs, struct weston_buffer *buffer,
 			 struct wl_shm_buffer *shm_buffer)
 {
 	unsigned int pixel_format;
-	int bpp;
-	int fd = vs->renderer->drm_fd;
-	unsigned attr[] = {
-		KMS_BO_TYPE, KMS_BO_TYPE_SCANOUT_X8R8G8B8,
-		KMS_WIDTH, 0,
-		KMS_HEIGHT, 0,
-		KMS_TERMINATE_PROP_LIST
-	};
-	unsigned handle, stride, bo_stride;
+	int bpp, num_planes = 1;
 
 	switch (wl_shm_buffer_get_format(shm_buffer)) {
 	case WL_SHM_FORMAT_XRGB8888:
@@ -627,6 +2302,24 @@ v4l2_renderer_attach_shm(struct v4l2_surface_state *vs, struct weston_buffer *bu
 		bpp = 2;
 		break;
 
+	case WL_SHM_FORMAT_NV12:
+		pixel_format = V4L2_PIX_FMT_NV12M;
+		bpp = 1;
+		num_planes = 2;
+		break;
+
+	case WL_SHM_FORMAT_NV16:
+		pixel_format = V4L2_PIX_FMT_NV16M;
+		bpp = 1;
+		num_planes = 2;
+		break;
+
+	case WL_SHM_FORMAT_YUV420:
+		pixel_format = V4L2_PIX_FMT_YUV420M;
+		bpp = 1;
+		num_planes = 3;
+		break;
+
 	default:
 		weston_log("Unsupported SHM buffer format\n");
 		return -1;
@@ -635,68 +2328,11 @@ v4l2_renderer_attach_shm(struct v4l2_surface_state *vs, struct weston_buffer *bu
 	buffer->shm_buffer = shm_buffer;
 	buffer->width = wl_shm_buffer_get_width(shm_buffer);
 	buffer->height = wl_shm_buffer_get_height(shm_buffer);
-	stride = wl_shm_buffer_get_stride(shm_buffer);
-
-	if (vs->width == buffer->width &&
-	    vs->height == buffer->height &&
-	    vs->planes[0].stride == stride && vs->bpp == bpp) {
-	    // no need to recreate buffer
-	    return 0;
-	}
-
-	// release if there's allocated buffer
-	v4l2_release_kms_bo(vs);
-
-	// create a reference to the shm_buffer.
-	vs->width = buffer->width;
-	vs->height = buffer->height;
-	vs->pixel_format = pixel_format;
-	vs->num_planes = 1;
-	vs->planes[0].stride = stride;
-	vs->planes[0].dmafd = -1;
-	vs->bpp = bpp;
-
-	if (device_interface->attach_buffer(vs) == -1)
-		return -1;
-
-	// create gbm_bo
-	attr[3] = (buffer->width + 1) * bpp / 4;
-	attr[5] = buffer->height;
-
-	if (kms_bo_create(vs->renderer->kms, attr, &vs->bo)) {
-		weston_log("kms_bo_create failed.\n");
-		goto error;
-	}
-
-	if (kms_bo_map(vs->bo, &vs->addr)) {
-		weston_log("kms_bo_map failed.\n");
-		goto error;
-	}
-
-	if (kms_bo_get_prop(vs->bo, KMS_PITCH, &bo_stride)) {
-		weston_log("kms_bo_get_prop failed.\n");
-		goto error;
-	}
-	vs->bo_stride = stride;
-
-	if (kms_bo_get_prop(vs->bo, KMS_HANDLE, &handle)) {
-		weston_log("kms_bo_get_prop failed.\n");
-		goto error;
-	}
-	if (drmPrimeHandleToFD(fd, handle, DRM_CLOEXEC, &vs->planes[0].dmafd)) {
-	    weston_log("drmPrimeHandleToFD failed.\n");
-	    goto error;
-	}
-
-	v4l2_renderer_copy_buffer(vs, buffer);
-
-	DBG("%s: %dx%d buffer attached (dmafd=%d).\n", __func__, buffer->width, buffer->height, vs->planes[0].dmafd);
 
-	return 0;
+	if (vs->renderer->shm_zero_copy && v4l2_renderer_has_userptr(vs->renderer))
+		return v4l2_renderer_import_shm(vs, buffer, pixel_format, bpp, num_planes);
 
-error:
-	v4l2_release_kms_bo(vs);
-	return -1;
+	return v4l2_renderer_alloc_shm_bo(vs, buffer, pixel_format, bpp, num_planes);
 }
 
 static void
@@ -807,6 +2443,9 @@ v4l2_renderer_attach_dmabuf(struct v4l2_surface_state *vs, struct weston_buffer
 		return -1;
 	}
 
+	// a bo used for an SHM buffer before isn't needed any more
+	v4l2_release_kms_bo(vs);
+
 	vs->width = buffer->width = kbuf->width;
 	vs->height = buffer->height = kbuf->height;
 	vs->pixel_format = pixel_format;
@@ -815,6 +2454,8 @@ v4l2_renderer_attach_dmabuf(struct v4l2_surface_state *vs, struct weston_buffer
 	for (i = 0; i < kbuf->num_planes; i++) {
 		vs->planes[i].stride = kbuf->planes[i].stride;
 		vs->planes[i].dmafd = kbuf->planes[i].fd;
+		vs->planes[i].offset = 0;
+		vs->planes[i].userptr = NULL;
 	}
 
 	if (device_interface->attach_buffer(vs) == -1)
@@ -845,6 +2486,7 @@ v4l2_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 	// release it first if not the same. if the buffer is the new one,
 	// increment the refrence counter. all done in weston_buffer_reference().
 	weston_buffer_reference(&vs->buffer_ref, buffer);
+	vs->content_serial++;
 
 	// clear the destroy listener if set.
 	if (vs->buffer_destroy_listener.notify) {
@@ -894,8 +2536,14 @@ v4l2_renderer_surface_state_destroy(struct v4l2_surface_state *vs)
 
 	// TODO: Release any resources associated to the surface here.
 
+	v4l2_release_kms_bo(vs);
+	pixman_region32_fini(&vs->damage);
 	weston_buffer_reference(&vs->buffer_ref, NULL);
-	free(vs);
+
+	if (device_interface->destroy_surface)
+		device_interface->destroy_surface(vs->renderer->instances[0].device, vs);
+	else
+		free(vs);
 }
 
 static void
@@ -926,7 +2574,7 @@ v4l2_renderer_create_surface(struct weston_surface *surface)
 	struct v4l2_surface_state *vs;
 	struct v4l2_renderer *vr = get_renderer(surface->compositor);
 
-	vs = device_interface->create_surface(vr->device);
+	vs = device_interface->create_surface(vr->instances[0].device);
 	if (!vs)
 		return -1;
 
@@ -934,6 +2582,7 @@ v4l2_renderer_create_surface(struct weston_surface *surface)
 
 	vs->surface = surface;
 	vs->renderer = vr;
+	pixman_region32_init(&vs->damage);
 
 	vs->surface_destroy_listener.notify =
 		surface_state_handle_surface_destroy;
@@ -967,7 +2616,10 @@ v4l2_renderer_destroy(struct weston_compositor *ec)
 	DBG("%s\n", __func__);
 
 	wl_signal_emit(&vr->destroy_signal, vr);
+	v4l2_renderer_flush_bo_pool(vr);
+	wl_array_release(&vr->busy_bos);
 	weston_binding_destroy(vr->debug_binding);
+	weston_binding_destroy(vr->stats_binding);
 	free(vr);
 
 	ec->renderer = NULL;
@@ -992,14 +2644,18 @@ debug_binding(struct weston_seat *seat, uint32_t time, uint32_t key,
 {
 	struct weston_compositor *ec = data;
 	struct v4l2_renderer *vr = (struct v4l2_renderer *) ec->renderer;
+	int i;
 
 	vr->repaint_debug ^= 1;
 
 	if (vr->repaint_debug) {
 		// TODO: enable repaint debug
 
-                media_debug_set_handler(vr->media,
-					(void (*)(void *, ...))debug_media_ctl, NULL);
+		for (i = 0; i < vr->instance_count; i++) {
+			if (vr->instances[i].media)
+				media_debug_set_handler(vr->instances[i].media,
+							(void (*)(void *, ...))debug_media_ctl, NULL);
+		}
 
 	} else {
 		// TODO: disable repaint debug
@@ -1008,6 +2664,19 @@ debug_binding(struct weston_seat *seat, uint32_t time, uint32_t key,
 	}
 }
 
+static void
+stats_binding(struct weston_seat *seat, uint32_t time, uint32_t key,
+	      void *data)
+{
+	struct weston_compositor *ec = data;
+	struct weston_output *output;
+
+	wl_list_for_each(output, &ec->output_list, link) {
+		if (output->renderer_state)
+			v4l2_renderer_dump_stats(get_output_state(output));
+	}
+}
+
 static void
 v4l2_load_device_module(const char *device_name)
 {
@@ -1040,44 +2709,28 @@ v4l2_get_cname(const char *bus_info)
 	return device_name;
 }
 
-static int
-v4l2_renderer_init(struct weston_compositor *ec, int drm_fd, char *drm_fn)
+static struct media_device *
+v4l2_renderer_open_media(const char *device)
 {
-	struct v4l2_renderer *renderer;
-	char *device;
-	const char *device_name = NULL;
+	struct media_device *media;
 	const struct media_device_info *info;
-	struct weston_config_section *section;
-
-	if (!drm_fn)
-		return -1;
-
-	renderer = calloc(1, sizeof *renderer);
-	if (renderer == NULL)
-		return -1;
-
-	renderer->wl_kms = wayland_kms_init(ec->wl_display, NULL, drm_fn, drm_fd);
-
-	/* Get V4L2 media controller device to use */
-	section = weston_config_get_section(ec->config,
-					    "media-ctl", NULL, NULL);
-	weston_config_section_get_string(section, "device", &device, "/dev/media0");
 
 	/* Initialize V4L2 media controller */
-	renderer->media = media_device_new(device);
-	if (!renderer->media) {
+	media = media_device_new(device);
+	if (!media) {
 		weston_log("Can't create a media controller.");
-		goto error;
+		return NULL;
 	}
 
 	/* Enumerate entities, pads and links */
-	if (media_device_enumerate(renderer->media)) {
+	if (media_device_enumerate(media)) {
 		weston_log("Can't enumerate %s.", device);
-		goto error;
+		media_device_unref(media);
+		return NULL;
 	}
 
 	/* Device info */
-	info = media_get_info(renderer->media);
+	info = media_get_info(media);
 	weston_log("Media controller API version %u.%u.%u\n",
 		   (info->media_version >> 16) & 0xff,
 		   (info->media_version >>  8) & 0xff,
@@ -1097,16 +2750,144 @@ v4l2_renderer_init(struct weston_compositor *ec, int drm_fd, char *drm_fn)
 			    (info->driver_version >>  8) & 0xff,
 			    (info->driver_version)       & 0xff);
 
-	device_name = v4l2_get_cname(info->bus_info);
+	return media;
+}
+
+/*
+ * Open the media devices listed in [media-ctl] device, separated by
+ * commas. Each of them gets an instance of the device module.
+ */
+static int
+v4l2_renderer_open_instances(struct v4l2_renderer *renderer, char *devices)
+{
+	struct v4l2_device_instance *instance;
+	char *path, *saveptr = NULL;
+
+	for (path = strtok_r(devices, ", ", &saveptr); path;
+	     path = strtok_r(NULL, ", ", &saveptr)) {
+		if (renderer->instance_count == V4L2_DEVICE_MAX) {
+			weston_log("too many media devices. ignoring %s.\n", path);
+			continue;
+		}
+
+		instance = &renderer->instances[renderer->instance_count];
+		instance->media = v4l2_renderer_open_media(path);
+		if (!instance->media)
+			return -1;
+		instance->path = strdup(path);
+		renderer->instance_count++;
+	}
+
+	return 0;
+}
+
+/*
+ * The device module is loaded only once, so all the media devices have
+ * to be handled by the same one.
+ */
+static char *
+v4l2_renderer_get_device_name(struct v4l2_renderer *renderer)
+{
+	char *device_name, *name;
+	int i;
+
+	device_name = v4l2_get_cname(media_get_info(renderer->instances[0].media)->bus_info);
+	for (i = 1; device_name && i < renderer->instance_count; i++) {
+		name = v4l2_get_cname(media_get_info(renderer->instances[i].media)->bus_info);
+		if (!name || strcmp(name, device_name)) {
+			weston_log("%s isn't a %s device.\n",
+				   renderer->instances[i].path, device_name);
+			free(name);
+			free(device_name);
+			return NULL;
+		}
+		free(name);
+	}
+
+	return device_name;
+}
+
+static int
+v4l2_renderer_init(struct weston_compositor *ec, int drm_fd, char *drm_fn)
+{
+	struct v4l2_renderer *renderer;
+	char *device, *device_module;
+	char *device_name = NULL;
+	struct weston_config_section *section;
+	int i;
+
+	if (!drm_fn)
+		return -1;
+
+	renderer = calloc(1, sizeof *renderer);
+	if (renderer == NULL)
+		return -1;
+
+	renderer->wl_kms = wayland_kms_init(ec->wl_display, NULL, drm_fn, drm_fd);
+
+	/*
+	 * A device module may be forced, e.g. to use the software
+	 * reference device where there's no media controller.
+	 */
+	section = weston_config_get_section(ec->config,
+					    "v4l2-renderer", NULL, NULL);
+	weston_config_section_get_string(section, "device-module",
+					 &device_module, NULL);
+	weston_config_section_get_bool(section, "shm-zero-copy",
+				       &renderer->shm_zero_copy, 0);
+	weston_config_section_get_int(section, "bo-pool-size",
+				      &renderer->bo_pool_max, 16);
+	weston_config_section_get_int(section, "static-cache-frames",
+				      &renderer->static_cache_frames, 30);
+	weston_config_section_get_int(section, "stats-interval",
+				      &renderer->stats_interval, 0);
+	wl_list_init(&renderer->bo_pool);
+	wl_array_init(&renderer->busy_bos);
+
+	/* Get V4L2 media controller device to use */
+	section = weston_config_get_section(ec->config,
+					    "media-ctl", NULL, NULL);
+	weston_config_section_get_string(section, "device", &device,
+					 device_module ? NULL : "/dev/media0");
+
+	if (device) {
+		if (v4l2_renderer_open_instances(renderer, device))
+			goto error;
+	} else {
+		// a device module that doesn't need a media controller
+		renderer->instance_count = 1;
+	}
+
+	if (renderer->instance_count == 0) {
+		weston_log("no media device to use.\n");
+		goto error;
+	}
+
+	if (device_module)
+		device_name = strdup(device_module);
+	else
+		device_name = v4l2_renderer_get_device_name(renderer);
 	v4l2_load_device_module(device_name);
 	if (!device_interface)
 		goto error;
 
-	renderer->device = device_interface->init(renderer->media, ec->config);
-	if (!renderer->device)
-		goto error;
+	for (i = 0; i < renderer->instance_count; i++) {
+		struct v4l2_device_instance *instance = &renderer->instances[i];
 
-	weston_log("V4L2 media controller device initialized.\n");
+		instance->device = device_interface->init(instance->media, ec->config,
+							  wl_display_get_event_loop(ec->wl_display));
+		if (!instance->device)
+			goto error;
+
+		instance->device->create_buffer = v4l2_renderer_create_buffer;
+		instance->device->destroy_buffer = v4l2_renderer_destroy_buffer;
+		instance->device->renderer = renderer;
+
+		if (device_interface->get_stats)
+			device_interface->get_stats(instance->device, &instance->stats);
+	}
+
+	weston_log("%d V4L2 media controller device(s) initialized.\n", renderer->instance_count);
 
 	kms_create(drm_fd, &renderer->kms);
 
@@ -1129,21 +2910,46 @@ v4l2_renderer_init(struct weston_compositor *ec, int drm_fd, char *drm_fn)
 	renderer->debug_binding =
 		weston_compositor_add_debug_binding(ec, KEY_R,
 						    debug_binding, ec);
+	renderer->stats_binding =
+		weston_compositor_add_debug_binding(ec, KEY_S,
+						    stats_binding, ec);
 
 	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_RGB565);
 	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_XRGB8888);
 	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_ARGB8888);
 	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_YUYV);
 
+	// let the device convert and scale planar YUV if it can
+	if (device_interface->check_format) {
+		if (device_interface->check_format(V4L2_PIX_FMT_NV12M, 2))
+			wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_NV12);
+		if (device_interface->check_format(V4L2_PIX_FMT_NV16M, 2))
+			wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_NV16);
+		if (device_interface->check_format(V4L2_PIX_FMT_YUV420M, 3))
+			wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_YUV420);
+	}
+
 	wl_signal_init(&renderer->destroy_signal);
 
-	free((void *)device_name);
+	free(device_name);
+	free(device_module);
 	free(device);
 	return 0;
 
 error:
-	if (device_name)
-		free((void *)device_name);
+	for (i = 0; i < renderer->instance_count; i++) {
+		if (renderer->instances[i].device) {
+			if (device_interface->destroy)
+				device_interface->destroy(renderer->instances[i].device);
+			else
+				free(renderer->instances[i].device);
+		}
+		if (renderer->instances[i].media)
+			media_device_unref(renderer->instances[i].media);
+		free(renderer->instances[i].path);
+	}
+	free(device_name);
+	free(device_module);
 	free(device);
 	free(renderer);
 	weston_log("V4L2 renderer initialization failed.\n");
@@ -1160,18 +2966,62 @@ v4l2_renderer_output_set_buffer(struct weston_output *output, int bo_index)
 	return;
 }
 
+/*
+ * Pick the device to compose an output on. It can be set with the
+ * v4l2-device key of the [output] section; otherwise outputs are spread
+ * over the devices so that they're composed in parallel.
+ */
+static struct v4l2_device_instance *
+v4l2_renderer_bind_output(struct v4l2_renderer *renderer, struct weston_output *output)
+{
+	struct weston_config_section *section;
+	struct v4l2_device_instance *instance = NULL;
+	char *path;
+	int i;
+
+	section = weston_config_get_section(output->compositor->config,
+					    "output", "name", output->name);
+	weston_config_section_get_string(section, "v4l2-device", &path, NULL);
+
+	for (i = 0; path && i < renderer->instance_count; i++) {
+		if (renderer->instances[i].path &&
+		    !strcmp(renderer->instances[i].path, path))
+			instance = &renderer->instances[i];
+	}
+
+	if (path && !instance)
+		weston_log("%s isn't opened. choose a device for %s.\n", path, output->name);
+	free(path);
+
+	if (!instance) {
+		instance = &renderer->instances[0];
+		for (i = 1; i < renderer->instance_count; i++) {
+			if (renderer->instances[i].output_count < instance->output_count)
+				instance = &renderer->instances[i];
+		}
+	}
+
+	weston_log("%s is composed on %s.\n", output->name,
+		   instance->path ? instance->path : instance->device->device_name);
+
+	return instance;
+}
+
 static int
 v4l2_renderer_output_create(struct weston_output *output, struct v4l2_bo_state *bo_states, int count)
 {
 	struct v4l2_renderer *renderer = (struct v4l2_renderer*)output->compositor->renderer;
 	struct v4l2_output_state *vo;
 	struct v4l2_renderer_output *outdev;
+	struct v4l2_device_instance *instance;
 	int i;
 
 	if (!renderer)
 		return -1;
 
-	outdev = device_interface->create_output(renderer->device,
+	instance = v4l2_renderer_bind_output(renderer, output);
+
+	outdev = device_interface->create_output(instance->device,
 						 output->current_mode->width,
 						 output->current_mode->height);
 	if (!outdev)
@@ -1183,6 +3033,12 @@ v4l2_renderer_output_create(struct weston_output *output, struct v4l2_bo_state *
 	}
 
 	vo->output = outdev;
+	vo->output_base = output;
+	vo->instance = instance;
+	instance->output_count++;
+	wl_array_init(&vo->fallbacks);
+	wl_array_init(&vo->busy_bos);
+	wl_array_init(&vo->static_cache.busy_bos);
 
 	output->renderer_state = vo;
 
@@ -1192,27 +3048,152 @@ v4l2_renderer_output_create(struct weston_output *output, struct v4l2_bo_state *
 		return -1;
 	}
 
-	for (i = 0; i < count; i++)
+	if (!(vo->bo_damage = calloc(1, sizeof(struct v4l2_bo_damage) * count))) {
+		free(vo->bo);
+		free(vo);
+		free(outdev);
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
 		vo->bo[i] = bo_states[i];
+		pixman_region32_init(&vo->bo_damage[i].region);
+	}
 	vo->bo_count = count;
 
 	return 0;
 }
 
 static void
-v4l2_renderer_output_destroy(struct weston_output *output)
+v4l2_renderer_output_state_destroy(struct v4l2_output_state *vo)
 {
-	struct v4l2_output_state *vo = get_output_state(output);
+	int i;
+
+	if (vo->instance) {
+		v4l2_renderer_release_busy_bos(vo);
+		wl_array_release(&vo->busy_bos);
+		v4l2_renderer_release_fallbacks(vo);
+		wl_array_release(&vo->fallbacks);
+		v4l2_renderer_release_static_cache(vo);
+	}
+
+	if (vo->bo_damage) {
+		for (i = 0; i < vo->bo_count; i++)
+			pixman_region32_fini(&vo->bo_damage[i].region);
+		free(vo->bo_damage);
+	}
 	if (vo->bo)
 		free(vo->bo);
 	if (vo->output)
 		free(vo->output);
+	if (vo->instance)
+		vo->instance->output_count--;
 	free(vo);
 }
 
+static void
+v4l2_renderer_output_destroy(struct weston_output *output)
+{
+	struct v4l2_output_state *vo = get_output_state(output);
+
+	output->renderer_state = NULL;
+
+	// the device still refers to the state. free it once it's done.
+	if (vo->compose_pending || vo->static_cache.pending) {
+		vo->destroy_pending = 1;
+
+		// the caller frees the output buffers next. wait for the
+		// device, whose done callbacks then free the state.
+		if (device_interface->wait_compose)
+			device_interface->wait_compose(vo->instance->device);
+		return;
+	}
+
+	v4l2_renderer_output_state_destroy(vo);
+}
+
+static int
+v4l2_renderer_get_dmabuf(struct weston_buffer *buffer, struct v4l2_dmabuf_desc *desc)
+{
+	struct wl_kms_buffer *kbuf;
+	int i;
+
+	if (!buffer || wl_shm_buffer_get(buffer->resource))
+		return -1;
+
+	kbuf = wayland_kms_buffer_get(buffer->resource);
+	if (!kbuf || kbuf->num_planes > V4L2_DMABUF_MAX_PLANES)
+		return -1;
+
+	switch (kbuf->format) {
+	case WL_KMS_FORMAT_XRGB8888:
+		desc->format = DRM_FORMAT_XRGB8888;
+		break;
+	case WL_KMS_FORMAT_ARGB8888:
+		desc->format = DRM_FORMAT_ARGB8888;
+		break;
+	case WL_KMS_FORMAT_XBGR8888:
+		desc->format = DRM_FORMAT_XBGR8888;
+		break;
+	case WL_KMS_FORMAT_ABGR8888:
+		desc->format = DRM_FORMAT_ABGR8888;
+		break;
+	case WL_KMS_FORMAT_RGB888:
+		desc->format = DRM_FORMAT_RGB888;
+		break;
+	case WL_KMS_FORMAT_BGR888:
+		desc->format = DRM_FORMAT_BGR888;
+		break;
+	case WL_KMS_FORMAT_RGB565:
+		desc->format = DRM_FORMAT_RGB565;
+		break;
+	case WL_KMS_FORMAT_RGB332:
+		desc->format = DRM_FORMAT_RGB332;
+		break;
+	case WL_KMS_FORMAT_YUYV:
+		desc->format = DRM_FORMAT_YUYV;
+		break;
+	case WL_KMS_FORMAT_YVYU:
+		desc->format = DRM_FORMAT_YVYU;
+		break;
+	case WL_KMS_FORMAT_UYVY:
+		desc->format = DRM_FORMAT_UYVY;
+		break;
+	case WL_KMS_FORMAT_NV12:
+		desc->format = DRM_FORMAT_NV12;
+		break;
+	case WL_KMS_FORMAT_NV16:
+		desc->format = DRM_FORMAT_NV16;
+		break;
+	case WL_KMS_FORMAT_NV21:
+		desc->format = DRM_FORMAT_NV21;
+		break;
+	case WL_KMS_FORMAT_NV61:
+		desc->format = DRM_FORMAT_NV61;
+		break;
+	case WL_KMS_FORMAT_YUV420:
+		desc->format = DRM_FORMAT_YUV420;
+		break;
+	default:
+		return -1;
+	}
+
+	desc->width = kbuf->width;
+	desc->height = kbuf->height;
+	desc->num_planes = kbuf->num_planes;
+	for (i = 0; i < kbuf->num_planes; i++) {
+		desc->fds[i] = kbuf->planes[i].fd;
+		desc->strides[i] = kbuf->planes[i].stride;
+		desc->offsets[i] = 0;	// as in v4l2_renderer_attach_dmabuf()
+	}
+
+	return 0;
+}
+
 WL_EXPORT struct v4l2_renderer_interface v4l2_renderer_interface = {
 	.init = v4l2_renderer_init,
 	.output_create = v4l2_renderer_output_create,
 	.output_destroy = v4l2_renderer_output_destroy,
-	.set_output_buffer = v4l2_renderer_output_set_buffer
+	.set_output_buffer = v4l2_renderer_output_set_buffer,
+	.get_dmabuf = v4l2_renderer_get_dmabuf
 };
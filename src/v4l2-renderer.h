@@ -33,9 +33,24 @@ struct v4l2_bo_state {
 	uint32_t stride;
 };
 
+#define V4L2_DMABUF_MAX_PLANES	3
+
+// a client buffer shared as dmabufs, for the backend to scan out
+struct v4l2_dmabuf_desc {
+	uint32_t format;	// DRM fourcc
+	int width;
+	int height;
+	int num_planes;
+	int fds[V4L2_DMABUF_MAX_PLANES];
+	uint32_t strides[V4L2_DMABUF_MAX_PLANES];
+	uint32_t offsets[V4L2_DMABUF_MAX_PLANES];
+};
+
 struct v4l2_renderer_interface {
 	int (*init)(struct weston_compositor *ec, int drm_fd, char *drm_fn);
 	int (*output_create)(struct weston_output *output, struct v4l2_bo_state *bo_states, int count);
 	void (*output_destroy)(struct weston_output *output);
 	void (*set_output_buffer)(struct weston_output *output, int bo_index);
+	// returns -1 if the buffer isn't a dmabuf buffer of a known format
+	int (*get_dmabuf)(struct weston_buffer *buffer, struct v4l2_dmabuf_desc *desc);
 };
@@ -32,10 +32,13 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include <unistd.h>
 
 #include <linux/videodev2.h>
 #include <linux/v4l2-subdev.h>
@@ -57,11 +60,17 @@
 #define DBGC(...) do {} while (0)
 #endif
 
+#define VSP_SCALED_CACHE_MAX	2	// scaled copies kept per surface and device
+
 struct vsp_surface_state {
 	struct v4l2_surface_state base;
 
 	struct v4l2_format fmt;
 	enum v4l2_mbus_pixelcode mbus_code;
+
+	int buffer_key;		// dmafd given by the renderer; identifies a buffer slot
+
+	struct vsp_scaled_cache *scaled;	// copies made by any device
 };
 
 struct vsp_renderer_output {
@@ -69,9 +78,37 @@ struct vsp_renderer_output {
 	struct vsp_surface_state surface_state;
 };
 
+/*
+ * A copy of a surface scaled ahead of time, so that the view can be
+ * composed without a scaler as long as neither the contents nor the
+ * geometry change.
+ */
+struct vsp_scaled_key {
+	unsigned int serial;		// contents of the surface
+	struct v4l2_rect src;		// area of the surface
+	unsigned int width, height;	// size it's scaled to
+	int opaque;
+};
+
+struct vsp_scaled_cache {
+	struct vsp_scaled_cache *next;
+	struct vsp_device *vsp;		// which makes and reads the copy
+
+	struct vsp_scaled_key key;	// of the copy in state, if valid
+	struct vsp_scaled_key seen;	// of the previous frame
+	int valid;
+	uint32_t age;
+
+	void *buffer;			// from the renderer
+	unsigned int size;
+	struct vsp_renderer_output state;
+};
+
 #define VSP_INPUT_MAX	4
 #define VSP_SCALER_MAX	1
 #define VSP_SCALER_MIN_PIXELS	4	// UDS can't take pixels smaller than this
+#define VSP_BUFFER_SLOTS	4	// DMABUF buffers kept on each video node
+#define VSP_SHADOW_MAX		32	// pads whose state is cached
 
 const char *vsp_input_links[] = {
 	"'%s rpf.0':1 -> '%s bru':0",
@@ -138,6 +175,28 @@ const char *vsp_scaler_links[] = {
 const char *vsp_scaler_infmt = "'%s uds.%d':0";
 const char *vsp_scaler_outfmt = "'%s uds.%d':1";
 
+/*
+ * A V4L2 buffer queue of a video node. It keeps DMABUF buffer slots keyed
+ * by dmafd and stays streaming as long as the pipeline is unchanged, so
+ * buffers need only be queued and dequeued for each pass.
+ */
+struct vsp_buffer_queue {
+	int			fd;
+	int			capture;
+	int			streaming;
+
+	struct v4l2_format	fmt;		// format the buffers are allocated for
+	int			opaque;
+	unsigned int		memory;		// V4L2_MEMORY_DMABUF or V4L2_MEMORY_USERPTR
+	int			count;		// number of buffers allocated
+
+	int			keys[VSP_BUFFER_SLOTS];
+	uint32_t		ages[VSP_BUFFER_SLOTS];
+	uint32_t		serial;
+
+	uint64_t		ioctls;		// issued on the video node
+};
+
 struct vsp_media_pad {
 	struct media_pad	*infmt_pad;
 	struct media_pad	*outfmt_pad;
@@ -147,6 +206,7 @@ struct vsp_media_pad {
 	struct media_link	*link;
 
 	int			fd;
+	struct vsp_buffer_queue	queue;
 };
 
 struct vsp_scaler_template {
@@ -179,7 +239,112 @@ struct vsp_input {
 	struct vsp_scaler *use_scaler;
 	struct v4l2_rect src;
 	struct v4l2_rect dst;
+	float alpha;
+	int opaque;
+};
+
+/*
+ * A view (or its opaque part) to be composed in the current frame. Layers
+ * are collected in stacking order and scheduled into passes when the
+ * composition finishes.
+ */
+struct vsp_layer {
+	struct vsp_surface_state *vs;
+	struct v4l2_rect src;
+	struct v4l2_rect dst;
+	float alpha;
 	int opaque;
+	int scaled;
+	int pass;		// pass the layer is composed in, -1 if not scheduled yet
+};
+
+/*
+ * The last state applied to a subdev pad. Formats and rectangles are
+ * cached as requested and as adjusted by the driver, so that identical
+ * requests can be answered without an ioctl.
+ */
+struct vsp_pad_shadow {
+	struct media_pad *pad;
+
+	int fmt_valid;
+	struct v4l2_mbus_framefmt fmt_req;
+	struct v4l2_mbus_framefmt fmt;
+
+	int crop_valid;
+	struct v4l2_rect crop_req;
+	struct v4l2_rect crop;
+
+	int compose_valid;
+	struct v4l2_rect compose_req;
+	struct v4l2_rect compose;
+};
+
+struct vsp_alpha_shadow {
+	struct media_entity *entity;
+	int value;
+};
+
+struct vsp_ioctl_stats {
+	unsigned int issued;
+	unsigned int skipped;
+};
+
+struct vsp_stats {
+	unsigned int frames;
+	unsigned int passes;
+	unsigned int max_passes;	// passes of the most expensive frame
+	unsigned int reconfigs;
+	unsigned int scaled_hits;	// scaled views composed from a cache
+	unsigned int scaled_updates;	// scaled copies made
+
+	struct vsp_ioctl_stats links;
+	struct vsp_ioctl_stats formats;
+	struct vsp_ioctl_stats selections;
+	struct vsp_ioctl_stats alpha;
+};
+
+/*
+ * Pipeline configuration applied when the streams were started. A pass
+ * with the same configuration is run by just queueing buffers.
+ */
+struct vsp_input_config {
+	int scaler;		// index of the scaler in use, or -1
+	int width;
+	int height;
+	enum v4l2_mbus_pixelcode code;
+	float alpha;
+	struct v4l2_rect src;
+	struct v4l2_rect dst;
+};
+
+struct vsp_pipe_config {
+	int output_width;
+	int output_height;
+	int input_count;
+	struct vsp_input_config inputs[VSP_INPUT_MAX];
+};
+
+/*
+ * A snapshot of a single composition pass. Surface states are copied and
+ * dmabuf fds are duplicated, so that clients may attach new buffers or
+ * go away while the pass is waiting for the hardware.
+ */
+struct vsp_pass {
+	struct wl_list link;
+
+	struct vsp_renderer_output output;
+
+	int input_count;
+	struct vsp_input inputs[VSP_INPUT_MAX];
+	struct vsp_surface_state surface_states[VSP_INPUT_MAX];
+	struct weston_buffer_reference buffer_refs[VSP_INPUT_MAX];
+
+	// called when the last pass of a composition completes
+	v4l2_compose_done_t done;
+	void *data;
+
+	// buffers from create_buffer() to destroy once the pass completes
+	struct wl_array released;
 };
 
 struct vsp_device {
@@ -199,14 +364,40 @@ struct vsp_device {
 	struct vsp_scaler scalers[VSP_SCALER_MAX];
 
 	struct vsp_output output;
+
+	struct wl_array layers;			// struct vsp_layer of the current frame
+	int frame_passes;
+
+	int streaming;
+	struct vsp_pipe_config active;
+
+	int shadow_count;
+	struct vsp_pad_shadow shadows[VSP_SHADOW_MAX];
+	struct vsp_alpha_shadow alpha_shadows[VSP_INPUT_MAX];
+
+	int stats_interval;
+	struct vsp_stats stats;
+	struct v4l2_device_stats totals;	// queue ioctls are counted in the queues
+
+	int scaled_cache;
+	uint32_t scaled_serial;
+
+	struct wl_event_loop *loop;
+	struct wl_event_source *output_source;
+
+	struct wl_list pass_queue;		// passes waiting for the hardware
+	struct vsp_pass *current_pass;		// pass on the hardware
+	struct vsp_pass *last_pass;		// last pass of the current composition
 };
 
 static void
-video_debug_mediactl(void)
+video_debug_mediactl(struct media_device *media)
 {
-	FILE *p = popen("media-ctl -d /dev/media0 -p", "r");
 	char buf[BUFSIZ * 16];
+	FILE *p;
 
+	snprintf(buf, sizeof(buf), "media-ctl -d %s -p", media_get_devnode(media));
+	p = popen(buf, "r");
 	if (!p)
 		return;
 
@@ -258,8 +449,39 @@ vsp_check_capabiility(int fd, const char *devname)
 		   (video_is_streaming(cap.device_caps) ? "w/" : "w/o"));
 }
 
+static void
+vsp_queue_init(struct vsp_buffer_queue *queue, int fd, int capture)
+{
+	int i;
+
+	memset(queue, 0, sizeof *queue);
+	queue->fd = fd;
+	queue->capture = capture;
+	queue->memory = V4L2_MEMORY_DMABUF;
+	for (i = 0; i < VSP_BUFFER_SLOTS; i++)
+		queue->keys[i] = -1;
+}
+
+/*
+ * The VSP can read SHM buffers straight from the client's memory if the
+ * video node accepts user pointers.
+ */
+static int
+vsp_check_userptr(int fd)
+{
+	struct v4l2_requestbuffers reqbuf;
+
+	memset(&reqbuf, 0, sizeof(reqbuf));
+	reqbuf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	reqbuf.memory = V4L2_MEMORY_USERPTR;
+	reqbuf.count = 0;
+
+	return (ioctl(fd, VIDIOC_REQBUFS, &reqbuf) == 0);
+}
+
 static struct v4l2_renderer_device*
-vsp_init(struct media_device *media, struct weston_config *config)
+vsp_init(struct media_device *media, struct weston_config *config,
+	 struct wl_event_loop *loop)
 {
 	struct vsp_device *vsp = NULL;
 	struct media_link *link;
@@ -269,7 +491,12 @@ vsp_init(struct media_device *media, struct weston_config *config)
 	const char *device_name, *devname;
 	int i, j;
 	struct weston_config_section *section;
-	
+
+	if (!media) {
+		weston_log("VSP1 requires a media controller device.\n");
+		goto error;
+	}
+
 	/* Get device name */
 	info = media_get_info(media);
 	if ((p = strchr(info->bus_info, ':')))
@@ -291,11 +518,16 @@ vsp_init(struct media_device *media, struct weston_config *config)
 	vsp->base.device_name = device_name;
 	vsp->state = VSP_STATE_IDLE;
 	vsp->scaler_max = VSP_SCALER_MAX;
+	vsp->loop = loop;
+	wl_list_init(&vsp->pass_queue);
+	wl_array_init(&vsp->layers);
 
 	/* check configuration */
 	section = weston_config_get_section(config,
 					    "vsp-renderer", NULL, NULL);
 	weston_config_section_get_int(section, "max_inputs", &vsp->input_max, VSP_INPUT_MAX);
+	weston_config_section_get_int(section, "stats_interval", &vsp->stats_interval, 0);
+	weston_config_section_get_bool(section, "scaled_cache", &vsp->scaled_cache, 1);
 
 	if (vsp->input_max < 2)
 		vsp->input_max = 2;
@@ -367,6 +599,12 @@ vsp_init(struct media_device *media, struct weston_config *config)
 
 		pads->fd = entity->fd;
 		vsp_check_capabiility(pads->fd, media_entity_get_devname(entity));
+		vsp_queue_init(&pads->queue, pads->fd, 0);
+
+		if (i == 0) {
+			vsp->base.userptr = vsp_check_userptr(pads->fd);
+			weston_log("USERPTR is %ssupported.\n", vsp->base.userptr ? "" : "not ");
+		}
 
 		/* set an input format for BRU to be ARGB (default) */
 		{
@@ -463,34 +701,62 @@ vsp_init(struct media_device *media, struct weston_config *config)
 		goto error;
 	}
 	vsp_check_capabiility(vsp->output_pad.fd, devname);
+	vsp_queue_init(&vsp->output_pad.queue, vsp->output_pad.fd, 1);
 
 	return (struct v4l2_renderer_device*)vsp;
 
 error:
-	if (vsp)
+	if (vsp) {
+		wl_array_release(&vsp->layers);
 		free(vsp);
+	}
 	weston_log("VSP device init failed...\n");
 
 	return NULL;
 }
 
+static void
+vsp_destroy(struct v4l2_renderer_device *dev)
+{
+	struct vsp_device *vsp = (struct vsp_device*)dev;
+
+	// the subdevs are closed along with the media device
+	if (vsp->output_source)
+		wl_event_source_remove(vsp->output_source);
+	close(vsp->output_pad.fd);
+	wl_array_release(&vsp->layers);
+	free(vsp);
+}
+
+static void
+vsp_release_buffer(struct vsp_device *vsp, void *buffer);
+
 static struct v4l2_surface_state*
 vsp_create_surface(struct v4l2_renderer_device *dev)
 {
 	return (struct v4l2_surface_state*)calloc(1, sizeof(struct vsp_surface_state));
 }
 
-static int
-vsp_attach_buffer(struct v4l2_surface_state *surface_state)
+static void
+vsp_destroy_surface(struct v4l2_renderer_device *dev, struct v4l2_surface_state *surface_state)
 {
 	struct vsp_surface_state *vs = (struct vsp_surface_state*)surface_state;
-	enum v4l2_mbus_pixelcode code;
-	int i;
+	struct vsp_scaled_cache *cache, *next;
 
-	if (vs->base.width > 8190 || vs->base.height > 8190)
-		return -1;
+	for (cache = vs->scaled; cache; cache = next) {
+		next = cache->next;
+		if (cache->buffer)
+			vsp_release_buffer(cache->vsp, cache->buffer);
+		free(cache);
+	}
 
-	switch(vs->base.pixel_format) {
+	free(vs);
+}
+
+static int
+vsp_get_mbus_code(unsigned int pixel_format, enum v4l2_mbus_pixelcode *code)
+{
+	switch(pixel_format) {
 	case V4L2_PIX_FMT_XRGB32:
 	case V4L2_PIX_FMT_ARGB32:
 	case V4L2_PIX_FMT_XBGR32:
@@ -499,8 +765,8 @@ vsp_attach_buffer(struct v4l2_surface_state *surface_state)
 	case V4L2_PIX_FMT_BGR24:
 	case V4L2_PIX_FMT_RGB565:
 	case V4L2_PIX_FMT_RGB332:
-		code = V4L2_MBUS_FMT_ARGB8888_1X32;
-		break;
+		*code = V4L2_MBUS_FMT_ARGB8888_1X32;
+		return 0;
 
 	case V4L2_PIX_FMT_YUYV:
 	case V4L2_PIX_FMT_YVYU:
@@ -510,12 +776,33 @@ vsp_attach_buffer(struct v4l2_surface_state *surface_state)
 	case V4L2_PIX_FMT_NV16M:
 	case V4L2_PIX_FMT_NV61M:
 	case V4L2_PIX_FMT_YUV420M:
-		code = V4L2_MBUS_FMT_AYUV8_1X32;
-		break;
+		*code = V4L2_MBUS_FMT_AYUV8_1X32;
+		return 0;
+	}
 
-	default:
+	return -1;
+}
+
+static int
+vsp_check_format(unsigned int pixel_format, int num_planes)
+{
+	enum v4l2_mbus_pixelcode code;
+
+	return vsp_get_mbus_code(pixel_format, &code) == 0;
+}
+
+static int
+vsp_attach_buffer(struct v4l2_surface_state *surface_state)
+{
+	struct vsp_surface_state *vs = (struct vsp_surface_state*)surface_state;
+	enum v4l2_mbus_pixelcode code;
+	int i;
+
+	if (vs->base.width > 8190 || vs->base.height > 8190)
+		return -1;
+
+	if (vsp_get_mbus_code(vs->base.pixel_format, &code) == -1)
 		return -1;
-	}
 
 	// create v4l2_fmt to use later
 	vs->mbus_code = code;
@@ -590,6 +877,153 @@ vsp_set_format(int fd, struct v4l2_format *fmt, int opaque)
 	return 0;
 }
 
+static struct vsp_pad_shadow*
+vsp_get_pad_shadow(struct vsp_device *vsp, struct media_pad *pad)
+{
+	struct vsp_pad_shadow *shadow;
+	int i;
+
+	for (i = 0; i < vsp->shadow_count; i++) {
+		if (vsp->shadows[i].pad == pad)
+			return &vsp->shadows[i];
+	}
+
+	if (vsp->shadow_count == VSP_SHADOW_MAX)
+		return NULL;
+
+	shadow = &vsp->shadows[vsp->shadow_count++];
+	memset(shadow, 0, sizeof *shadow);
+	shadow->pad = pad;
+
+	return shadow;
+}
+
+/*
+ * Drivers propagate a format set on a sink pad to its selection
+ * rectangles and to the source pads, and a crop rectangle to the source
+ * pads. Forget whatever may have been changed that way.
+ */
+static void
+vsp_invalidate_shadows(struct vsp_device *vsp, struct media_pad *pad, int format)
+{
+	struct vsp_pad_shadow *shadow;
+	int i;
+
+	if (pad->flags & MEDIA_PAD_FL_SOURCE)
+		return;
+
+	for (i = 0; i < vsp->shadow_count; i++) {
+		shadow = &vsp->shadows[i];
+		if (shadow->pad->entity != pad->entity)
+			continue;
+
+		if (shadow->pad->flags & MEDIA_PAD_FL_SOURCE) {
+			shadow->fmt_valid = 0;
+		} else if (format && shadow->pad == pad) {
+			shadow->crop_valid = 0;
+			shadow->compose_valid = 0;
+		}
+	}
+}
+
+static int
+vsp_setup_link(struct vsp_device *vsp, struct media_link *link, int enable)
+{
+	// libmediactl keeps track of the link state for us.
+	if (!(link->flags & MEDIA_LNK_FL_ENABLED) == !enable) {
+		vsp->stats.links.skipped++;
+		return 0;
+	}
+
+	vsp->stats.links.issued++;
+	vsp->totals.ioctls++;
+	return media_setup_link(vsp->base.media, link->source, link->sink, enable);
+}
+
+static int
+vsp_set_pad_format(struct vsp_device *vsp, struct media_pad *pad, struct v4l2_mbus_framefmt *format)
+{
+	struct vsp_pad_shadow *shadow = vsp_get_pad_shadow(vsp, pad);
+	int ret;
+
+	if (shadow && shadow->fmt_valid &&
+	    !memcmp(&shadow->fmt_req, format, sizeof *format)) {
+		vsp->stats.formats.skipped++;
+		*format = shadow->fmt;
+		return 0;
+	}
+
+	vsp->stats.formats.issued++;
+	vsp->totals.ioctls++;
+	if (shadow) {
+		shadow->fmt_req = *format;
+		shadow->fmt_valid = 0;
+	}
+
+	ret = v4l2_subdev_set_format(pad->entity, format, pad->index, V4L2_SUBDEV_FORMAT_ACTIVE);
+	vsp_invalidate_shadows(vsp, pad, 1);
+	if (ret)
+		return ret;
+
+	if (shadow) {
+		shadow->fmt = *format;
+		shadow->fmt_valid = 1;
+	}
+
+	return 0;
+}
+
+static int
+vsp_set_pad_selection(struct vsp_device *vsp, struct media_pad *pad, unsigned int target,
+		      struct v4l2_rect *rect)
+{
+	struct vsp_pad_shadow *shadow = vsp_get_pad_shadow(vsp, pad);
+	struct v4l2_rect *req = NULL, *applied = NULL;
+	int *valid = NULL;
+	int ret;
+
+	if (shadow) {
+		switch (target) {
+		case V4L2_SEL_TGT_CROP:
+			valid = &shadow->crop_valid;
+			req = &shadow->crop_req;
+			applied = &shadow->crop;
+			break;
+		case V4L2_SEL_TGT_COMPOSE:
+			valid = &shadow->compose_valid;
+			req = &shadow->compose_req;
+			applied = &shadow->compose;
+			break;
+		}
+	}
+
+	if (valid && *valid && !memcmp(req, rect, sizeof *rect)) {
+		vsp->stats.selections.skipped++;
+		*rect = *applied;
+		return 0;
+	}
+
+	vsp->stats.selections.issued++;
+	vsp->totals.ioctls++;
+	if (valid) {
+		*req = *rect;
+		*valid = 0;
+	}
+
+	ret = v4l2_subdev_set_selection(pad->entity, rect, pad->index, target,
+					V4L2_SUBDEV_FORMAT_ACTIVE);
+	vsp_invalidate_shadows(vsp, pad, 0);
+	if (ret)
+		return ret;
+
+	if (valid) {
+		*applied = *rect;
+		*valid = 1;
+	}
+
+	return 0;
+}
+
 static int
 vsp_set_output(struct vsp_device *vsp, struct vsp_renderer_output *out)
 {
@@ -605,7 +1039,7 @@ vsp_set_output(struct vsp_device *vsp, struct vsp_renderer_output *out)
 
 	for (i = 0; i < (int)ARRAY_SIZE(vsp->output.pads); i++) {
 		struct media_pad *pad = vsp->output.pads[i];
-		if (v4l2_subdev_set_format(pad->entity, &format, pad->index, V4L2_SUBDEV_FORMAT_ACTIVE)) {
+		if (vsp_set_pad_format(vsp, pad, &format)) {
 			weston_log("set sbudev format for failed at index %d.\n", i);
 			return -1;
 		}
@@ -649,17 +1083,17 @@ vsp_create_output(struct v4l2_renderer_device *dev, int width, int height)
 }
 
 static int
-vsp_dequeue_buffer(int fd, int capture)
+vsp_dequeue_buffer(int fd, int capture, unsigned int memory)
 {
 	struct v4l2_buffer buf;
 	struct v4l2_plane planes[VIDEO_MAX_PLANES];
 
 	memset(&buf, 0, sizeof buf);
 	buf.type = (capture) ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-	buf.memory = V4L2_MEMORY_DMABUF;
+	buf.memory = memory;
 	buf.index = 0;
 	buf.m.planes = planes;
-	buf.length = 1;
+	buf.length = VIDEO_MAX_PLANES;
 	memset(planes, 0, sizeof(planes));
 
 	if (ioctl(fd, VIDIOC_DQBUF, &buf) == -1) {
@@ -697,8 +1131,14 @@ vsp_plane_height(int plane, int height, unsigned int format)
 	return 0;
 }
 
+static inline unsigned int
+vsp_surface_memory(struct vsp_surface_state *vs)
+{
+	return (vs->base.planes[0].userptr) ? V4L2_MEMORY_USERPTR : V4L2_MEMORY_DMABUF;
+}
+
 static int
-vsp_queue_buffer(int fd, int capture, struct vsp_surface_state *vs)
+vsp_queue_buffer(int fd, int capture, int index, struct vsp_surface_state *vs)
 {
 	struct v4l2_buffer buf;
 	struct v4l2_plane planes[VIDEO_MAX_PLANES];
@@ -706,21 +1146,30 @@ vsp_queue_buffer(int fd, int capture, struct vsp_surface_state *vs)
 
 	memset(&buf, 0, sizeof buf);
 	buf.type = (capture) ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-	buf.memory = V4L2_MEMORY_DMABUF;
-	buf.index = 0;
+	buf.memory = vsp_surface_memory(vs);
+	buf.index = index;
 	buf.m.planes = planes;
 	buf.length = vs->base.num_planes;
 	memset(planes, 0, sizeof(planes));
 	for (i = 0; i < vs->base.num_planes; i++) {
-		buf.m.planes[i].m.fd = vs->base.planes[i].dmafd;
 		buf.m.planes[i].bytesused = vs->base.planes[i].stride *
 			vsp_plane_height(i, vs->base.height,
 					 vs->base.pixel_format);
+		if (buf.memory == V4L2_MEMORY_USERPTR) {
+			buf.m.planes[i].m.userptr = (unsigned long)vs->base.planes[i].userptr;
+			buf.m.planes[i].length = buf.m.planes[i].bytesused;
+		} else {
+			// planes may share a dmabuf. bytesused covers the offset.
+			buf.m.planes[i].m.fd = vs->base.planes[i].dmafd;
+			buf.m.planes[i].data_offset = vs->base.planes[i].offset;
+			buf.m.planes[i].bytesused += vs->base.planes[i].offset;
+		}
 	}
 
 	if (ioctl(fd, VIDIOC_QBUF, &buf) == -1) {
-		weston_log("VIDIOC_QBUF failed for dmafd=%d(%d planes) on %d (%s).\n",
-			   vs->base.planes[i].dmafd, vs->base.num_planes, fd, strerror(errno));
+		weston_log("VIDIOC_QBUF failed for %s=%d(%d planes) on %d (%s).\n",
+			   (buf.memory == V4L2_MEMORY_USERPTR) ? "userptr" : "dmafd",
+			   vs->base.planes[0].dmafd, vs->base.num_planes, fd, strerror(errno));
 		return -1;
 	}
 
@@ -728,78 +1177,240 @@ vsp_queue_buffer(int fd, int capture, struct vsp_surface_state *vs)
 }
 
 static int
-vsp_request_buffer(int fd, int capture, int count)
+vsp_request_buffer(int fd, int capture, unsigned int memory, int count)
 {
 	struct v4l2_requestbuffers reqbuf;
 
 	memset(&reqbuf, 0, sizeof(reqbuf));
 	reqbuf.type = (capture) ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-	reqbuf.memory = V4L2_MEMORY_DMABUF;
+	reqbuf.memory = memory;
 	reqbuf.count = count;
 	if (ioctl(fd, VIDIOC_REQBUFS, &reqbuf) == -1) {
 		weston_log("clearing VIDIOC_REQBUFS failed (%s).\n", strerror(errno));
 		return -1;
 	}
 
-	return 0;
+	return reqbuf.count;
 }
 
-static void
-vsp_comp_begin(struct v4l2_renderer_device *dev, struct v4l2_renderer_output *out)
+static int
+vsp_format_equal(struct v4l2_format *a, struct v4l2_format *b)
 {
-	struct vsp_device *vsp = (struct vsp_device*)dev;
-	struct vsp_renderer_output *output = (struct vsp_renderer_output*)out;
-	struct v4l2_format *fmt = &output->surface_state.fmt;
+	struct v4l2_pix_format_mplane *pa = &a->fmt.pix_mp, *pb = &b->fmt.pix_mp;
+	int i;
 
-	DBG("start vsp composition.\n");
+	if (pa->width != pb->width || pa->height != pb->height ||
+	    pa->pixelformat != pb->pixelformat || pa->num_planes != pb->num_planes)
+		return 0;
 
-	vsp->state = VSP_STATE_START;
+	for (i = 0; i < pa->num_planes; i++) {
+		if (pa->plane_fmt[i].bytesperline != pb->plane_fmt[i].bytesperline)
+			return 0;
+	}
 
-	vsp_set_output(vsp, output);
+	return 1;
+}
 
-	// just in case
-	vsp_request_buffer(vsp->output_pad.fd, 1, 0);
+/*
+ * Set a format of the video node. Buffers are reallocated only if the
+ * format actually changes. The queue must not be streaming.
+ */
+static int
+vsp_queue_set_format(struct vsp_buffer_queue *queue, struct v4l2_format *fmt, int opaque,
+		     unsigned int memory)
+{
+	int i, count;
 
-	fmt->type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-	vsp_set_format(vsp->output_pad.fd, fmt, 0);
-	fmt->type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	if (queue->count > 0 && queue->opaque == opaque && queue->memory == memory &&
+	    vsp_format_equal(&queue->fmt, fmt))
+		return 0;
 
-	vsp->output_surface_state = &output->surface_state;
+	DBG("reallocating buffers on %d.\n", queue->fd);
+	queue->ioctls += 4;	// REQBUFS, G_FMT, S_FMT and REQBUFS
+
+	if (vsp_request_buffer(queue->fd, queue->capture, queue->memory, 0) < 0)
+		goto error;
 
-	vsp_request_buffer(vsp->output_pad.fd, 1, 1);
+	if (vsp_set_format(queue->fd, fmt, opaque))
+		goto error;
 
-	DBG("output set to dmabuf=%d\n", vsp->output_surface_state->base.planes[0].dmafd);
+	count = vsp_request_buffer(queue->fd, queue->capture, memory, VSP_BUFFER_SLOTS);
+	if (count < 1)
+		goto error;
+
+	queue->fmt = *fmt;
+	queue->opaque = opaque;
+	queue->memory = memory;
+	queue->count = (count > VSP_BUFFER_SLOTS) ? VSP_BUFFER_SLOTS : count;
+	for (i = 0; i < VSP_BUFFER_SLOTS; i++)
+		queue->keys[i] = -1;
+
+	return 0;
+
+error:
+	queue->count = 0;
+	return -1;
 }
 
+/*
+ * Find a buffer slot the buffer was queued with before, so that the
+ * kernel can reuse its DMABUF attachment. Otherwise, recycle the least
+ * recently used slot.
+ */
 static int
-vsp_set_alpha(struct media_entity *entity, float alpha)
+vsp_queue_get_slot(struct vsp_buffer_queue *queue, int key)
 {
-	struct v4l2_control ctrl;
-
-	ctrl.id = V4L2_CID_ALPHA_COMPONENT;
-	ctrl.value = (__s32)(alpha * 0xff);
+	int i, lru = 0;
 
-	if (ioctl(entity->fd, VIDIOC_S_CTRL, &ctrl) == -1) {
-		weston_log("failed to set alpha value (%d)\n", ctrl.value);
-		return -1;
+	for (i = 0; i < queue->count; i++) {
+		if (queue->keys[i] == key)
+			goto found;
+		if (queue->ages[i] < queue->ages[lru])
+			lru = i;
 	}
 
-	return 0;
+	i = lru;
+	queue->keys[i] = key;
+
+found:
+	queue->ages[i] = ++queue->serial;
+	return i;
 }
 
 static int
-vsp_comp_setup_inputs(struct vsp_device *vsp, struct vsp_input *input, int enable)
+vsp_queue_enqueue(struct vsp_buffer_queue *queue, struct vsp_surface_state *vs)
 {
-	struct v4l2_mbus_framefmt format = { 0 };
-	struct vsp_media_pad *mpad = &input->input_pads;
-	struct vsp_scaler *scaler = input->use_scaler;
-	struct vsp_surface_state *vs = input->input_surface_states;
-	struct v4l2_rect *src = &input->src;
-	struct v4l2_rect *dst = &input->dst;
+	queue->ioctls++;
+	return vsp_queue_buffer(queue->fd, queue->capture,
+				vsp_queue_get_slot(queue, vs->buffer_key), vs);
+}
+
+static int
+vsp_queue_streamon(struct vsp_buffer_queue *queue)
+{
+	int type = (queue->capture) ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+
+	if (queue->streaming)
+		return 0;
+
+	queue->ioctls++;
+	if (ioctl(queue->fd, VIDIOC_STREAMON, &type) == -1) {
+		weston_log("VIDIOC_STREAMON failed on %d (%s).\n", queue->fd, strerror(errno));
+		return -1;
+	}
+
+	queue->streaming = 1;
+	return 0;
+}
+
+static void
+vsp_queue_streamoff(struct vsp_buffer_queue *queue)
+{
+	int type = (queue->capture) ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+
+	if (!queue->streaming)
+		return;
+
+	queue->ioctls++;
+	// this also returns all queued buffers to us
+	if (ioctl(queue->fd, VIDIOC_STREAMOFF, &type) == -1)
+		weston_log("VIDIOC_STREAMOFF failed on %d (%s).\n", queue->fd, strerror(errno));
+
+	queue->streaming = 0;
+}
+
+static void
+vsp_comp_begin(struct v4l2_renderer_device *dev, struct v4l2_renderer_output *out,
+	       int preserve)
+{
+	struct vsp_device *vsp = (struct vsp_device*)dev;
+	struct vsp_renderer_output *output = (struct vsp_renderer_output*)out;
+
+	DBG("start vsp composition.\n");
+
+	// the first view composed pulls in the current output as input 0.
+	vsp->state = (preserve) ? VSP_STATE_COMPOSING : VSP_STATE_START;
+
+	// the output is set up when each pass is submitted to the hardware.
+	vsp->output_surface_state = &output->surface_state;
+	vsp->last_pass = NULL;
+
+	vsp->layers.size = 0;
+	vsp->frame_passes = 0;
+
+	DBG("output set to dmabuf=%d\n", vsp->output_surface_state->base.planes[0].dmafd);
+}
+
+static int
+vsp_comp_setup_output(struct vsp_device *vsp, struct vsp_renderer_output *output)
+{
+	struct v4l2_format *fmt = &output->surface_state.fmt;
+	int ret;
+
+	if (vsp_set_output(vsp, output))
+		return -1;
+
+	fmt->type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	ret = vsp_queue_set_format(&vsp->output_pad.queue, fmt, 0, V4L2_MEMORY_DMABUF);
+	fmt->type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+
+	return ret;
+}
+
+static int
+vsp_set_alpha(struct vsp_device *vsp, struct media_entity *entity, float alpha)
+{
+	struct vsp_alpha_shadow *shadow = NULL;
+	struct v4l2_control ctrl;
+	int i;
+
+	ctrl.id = V4L2_CID_ALPHA_COMPONENT;
+	ctrl.value = (__s32)(alpha * 0xff);
+
+	for (i = 0; i < VSP_INPUT_MAX; i++) {
+		if (vsp->alpha_shadows[i].entity == entity ||
+		    !vsp->alpha_shadows[i].entity) {
+			shadow = &vsp->alpha_shadows[i];
+			break;
+		}
+	}
+
+	if (shadow && shadow->entity == entity && shadow->value == ctrl.value) {
+		vsp->stats.alpha.skipped++;
+		return 0;
+	}
+
+	vsp->stats.alpha.issued++;
+	vsp->totals.ioctls++;
+	if (shadow)
+		shadow->entity = NULL;
+
+	if (ioctl(entity->fd, VIDIOC_S_CTRL, &ctrl) == -1) {
+		weston_log("failed to set alpha value (%d)\n", ctrl.value);
+		return -1;
+	}
+
+	if (shadow) {
+		shadow->entity = entity;
+		shadow->value = ctrl.value;
+	}
+
+	return 0;
+}
+
+static int
+vsp_comp_setup_inputs(struct vsp_device *vsp, struct vsp_input *input, int enable)
+{
+	struct v4l2_mbus_framefmt format = { 0 };
+	struct vsp_media_pad *mpad = &input->input_pads;
+	struct vsp_scaler *scaler = input->use_scaler;
+	struct vsp_surface_state *vs = input->input_surface_states;
+	struct v4l2_rect *src = &input->src;
+	struct v4l2_rect *dst = &input->dst;
 
 	// enable link associated with this pad
 	if (!scaler) {
-		if (media_setup_link(vsp->base.media, mpad->link->source, mpad->link->sink, enable)) {
+		if (vsp_setup_link(vsp, mpad->link, enable)) {
 			weston_log("enabling media link setup failed.\n");
 			return -1;
 		}
@@ -807,14 +1418,14 @@ vsp_comp_setup_inputs(struct vsp_device *vsp, struct vsp_input *input, int enabl
 		struct vsp_scaler_template *temp = &scaler->templates[scaler->input];
 
 		if (enable)
-			media_setup_link(vsp->base.media, mpad->link->source, mpad->link->sink, 0);
+			vsp_setup_link(vsp, mpad->link, 0);
 
-		if (media_setup_link(vsp->base.media, temp->link0->source, temp->link0->sink, enable)) {
+		if (vsp_setup_link(vsp, temp->link0, enable)) {
 			weston_log("enabling scaler link0 setup failed.\n");
 			return -1;
 		}
 
-		if (media_setup_link(vsp->base.media, temp->link1->source, temp->link1->sink, enable)) {
+		if (vsp_setup_link(vsp, temp->link1, enable)) {
 			weston_log("enabling scaler link1 setup failed.\n");
 			return -1;
 		}
@@ -827,21 +1438,19 @@ vsp_comp_setup_inputs(struct vsp_device *vsp, struct vsp_input *input, int enabl
 	format.width = vs->base.width;
 	format.height = vs->base.height;
 	format.code = vs->mbus_code;	// this is input format
-	if (v4l2_subdev_set_format(mpad->infmt_pad->entity, &format, mpad->infmt_pad->index,
-				   V4L2_SUBDEV_FORMAT_ACTIVE)) {
+	if (vsp_set_pad_format(vsp, mpad->infmt_pad, &format)) {
 		weston_log("set input format via subdev failed.\n");
 		return -1;
 	}
 
 	// set an alpha
-	if (vsp_set_alpha(mpad->input_entity, vs->base.alpha)) {
+	if (vsp_set_alpha(vsp, mpad->input_entity, vs->base.alpha)) {
 		weston_log("setting alpha (=%f) failed.", vs->base.alpha);
 		return -1;
 	}
 
 	// set a crop paramters
-	if (v4l2_subdev_set_selection(mpad->infmt_pad->entity, src, mpad->infmt_pad->index,
-				      V4L2_SEL_TGT_CROP, V4L2_SUBDEV_FORMAT_ACTIVE)) {
+	if (vsp_set_pad_selection(vsp, mpad->infmt_pad, V4L2_SEL_TGT_CROP, src)) {
 		weston_log("set crop parameter failed: %dx%d@(%d,%d).\n",
 			   src->width, src->height, src->left, src->top);
 		return -1;
@@ -851,8 +1460,7 @@ vsp_comp_setup_inputs(struct vsp_device *vsp, struct vsp_input *input, int enabl
 
 	// this is an output towards BRU. this shall be consistent among all inputs.
 	format.code = V4L2_MBUS_FMT_ARGB8888_1X32;
-	if (v4l2_subdev_set_format(mpad->outfmt_pad->entity, &format, mpad->outfmt_pad->index,
-				   V4L2_SUBDEV_FORMAT_ACTIVE)) {
+	if (vsp_set_pad_format(vsp, mpad->outfmt_pad, &format)) {
 		weston_log("set output format via subdev failed.\n");
 		return -1;
 	}
@@ -860,8 +1468,7 @@ vsp_comp_setup_inputs(struct vsp_device *vsp, struct vsp_input *input, int enabl
 	// if we enabled the scaler, we should set resize parameters.
 	if (scaler) {
 		// a sink of UDS should be the same as a source of RPF.
-		if (v4l2_subdev_set_format(scaler->infmt_pad->entity, &format, scaler->infmt_pad->index,
-					   V4L2_SUBDEV_FORMAT_ACTIVE)) {
+		if (vsp_set_pad_format(vsp, scaler->infmt_pad, &format)) {
 			weston_log("set input format of UDS via subdev failed.\n");
 			return -1;
 		}
@@ -869,177 +1476,466 @@ vsp_comp_setup_inputs(struct vsp_device *vsp, struct vsp_input *input, int enabl
 		// a source of UDS should be the same as a sink of BRU.
 		format.width  = dst->width;
 		format.height = dst->height;
-		if (v4l2_subdev_set_format(scaler->outfmt_pad->entity, &format, scaler->outfmt_pad->index,
-					   V4L2_SUBDEV_FORMAT_ACTIVE)) {
+		if (vsp_set_pad_format(vsp, scaler->outfmt_pad, &format)) {
 			weston_log("set output format of UDS via subdev failed.\n");
 			return -1;
 		}
 	}
 
 	// so does the BRU input
-	if (v4l2_subdev_set_format(mpad->compose_pad->entity, &format, mpad->compose_pad->index,
-				   V4L2_SUBDEV_FORMAT_ACTIVE)) {
+	if (vsp_set_pad_format(vsp, mpad->compose_pad, &format)) {
 		weston_log("set composition format via subdev failed.\n");
 		return -1;
 	}
 
 	// set a composition paramters
-	if (v4l2_subdev_set_selection(mpad->compose_pad->entity, dst, mpad->compose_pad->index,
-				      V4L2_SEL_TGT_COMPOSE, V4L2_SUBDEV_FORMAT_ACTIVE)) {
+	if (vsp_set_pad_selection(vsp, mpad->compose_pad, V4L2_SEL_TGT_COMPOSE, dst)) {
 		weston_log("set compose parameter failed: %dx%d@(%d,%d).\n",
 			   dst->width, dst->height, dst->left, dst->top);
 		return -1;
 	}
 
-	// just in case
-	if (vsp_request_buffer(mpad->fd, 0, 0) < 0)
-		return -1;
+	return 0;
+}
 
-	// set input format
-	if (vsp_set_format(mpad->fd, &vs->fmt, input->opaque))
-		return -1;
+static void
+vsp_pass_copy_surface(struct vsp_surface_state *dst, struct vsp_surface_state *src)
+{
+	int i;
 
-	// request a buffer
-	if (vsp_request_buffer(mpad->fd, 0, 1) < 0)
-		return -1;
+	*dst = *src;
+	dst->buffer_key = src->base.planes[0].dmafd;
+	for (i = 0; i < src->base.num_planes; i++) {
+		if (src->base.planes[i].dmafd <= 0)
+			continue;
+		dst->base.planes[i].dmafd = fcntl(src->base.planes[i].dmafd, F_DUPFD_CLOEXEC, 0);
+		if (dst->base.planes[i].dmafd < 0)
+			weston_log("can't duplicate dmafd=%d (%s).\n",
+				   src->base.planes[i].dmafd, strerror(errno));
+	}
+}
 
-	// queue buffer
-	if (vsp_queue_buffer(mpad->fd, 0, vs) < 0)
-		return -1;
+static void
+vsp_pass_release_surface(struct vsp_surface_state *vs)
+{
+	int i;
 
-	return 0;
+	for (i = 0; i < vs->base.num_planes; i++) {
+		if (vs->base.planes[i].dmafd > 0)
+			close(vs->base.planes[i].dmafd);
+		vs->base.planes[i].dmafd = -1;
+	}
+}
+
+static void
+vsp_pass_destroy(struct vsp_pass *pass)
+{
+	int i;
+
+	for (i = 0; i < pass->input_count; i++) {
+		vsp_pass_release_surface(&pass->surface_states[i]);
+		weston_buffer_reference(&pass->buffer_refs[i], NULL);
+	}
+	vsp_pass_release_surface(&pass->output.surface_state);
+
+	free(pass);
+}
+
+/*
+ * Destroy a buffer from create_buffer() once the passes queued so far,
+ * which may read it, have completed. The renderer hands it out again
+ * as soon as it is destroyed.
+ */
+static void
+vsp_release_buffer(struct vsp_device *vsp, void *buffer)
+{
+	struct vsp_pass *pass = vsp->current_pass;
+	void **p;
+
+	if (!wl_list_empty(&vsp->pass_queue))
+		pass = container_of(vsp->pass_queue.prev, struct vsp_pass, link);
+
+	if (pass && (p = wl_array_add(&pass->released, sizeof *p))) {
+		*p = buffer;
+		return;
+	}
+
+	vsp->base.destroy_buffer(&vsp->base, buffer);
+}
+
+static void
+vsp_pass_release_buffers(struct vsp_device *vsp, struct vsp_pass *pass)
+{
+	void **p;
+
+	wl_array_for_each(p, &pass->released)
+		vsp->base.destroy_buffer(&vsp->base, *p);
+	wl_array_release(&pass->released);
 }
 
+static void
+vsp_comp_complete(struct vsp_device *vsp, int error);
+
 static int
-vsp_comp_flush(struct vsp_device *vsp)
+vsp_comp_handle_output(int fd, uint32_t mask, void *data)
 {
-	int i, fd;
-	int type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	struct vsp_device *vsp = data;
 
-	DBG("flush vsp composition.\n");
+	DBG("output pad fd=%d ready (mask=%x).\n", fd, mask);
 
-	// enable links and queue buffer
-	for (i = 0; i < vsp->input_count; i++)
-		vsp_comp_setup_inputs(vsp, &vsp->inputs[i], 1);
+	vsp_comp_complete(vsp, mask & (WL_EVENT_HANGUP | WL_EVENT_ERROR));
 
-	// disable unused inputs
-	for (i = vsp->input_count; i < vsp->input_max; i++)
-		vsp_comp_setup_inputs(vsp, &vsp->inputs[i], 0);
+	return 1;
+}
 
-	// get an output pad
-	fd = vsp->output_pad.fd;
+static void
+vsp_comp_get_config(struct vsp_device *vsp, struct vsp_pass *pass, struct vsp_pipe_config *config)
+{
+	int i;
 
-	// queue buffer
-	if (vsp_queue_buffer(fd, 1, vsp->output_surface_state) < 0)
-		goto error;
+	memset(config, 0, sizeof *config);
+	config->output_width = pass->output.base.width;
+	config->output_height = pass->output.base.height;
+	config->input_count = pass->input_count;
+
+	for (i = 0; i < pass->input_count; i++) {
+		struct vsp_input *input = &pass->inputs[i];
+		struct vsp_surface_state *vs = input->input_surface_states;
+		struct vsp_input_config *in = &config->inputs[i];
+
+		in->scaler = (input->use_scaler) ? input->use_scaler - vsp->scalers : -1;
+		in->width = vs->base.width;
+		in->height = vs->base.height;
+		in->code = vs->mbus_code;
+		in->alpha = vs->base.alpha;
+		in->src = input->src;
+		in->dst = input->dst;
+	}
+}
 
-//	video_debug_mediactl();
+static int
+vsp_queue_match(struct vsp_buffer_queue *queue, struct vsp_surface_state *vs, int opaque)
+{
+	return (queue->count > 0 && queue->opaque == opaque &&
+		queue->memory == vsp_surface_memory(vs) &&
+		vsp_format_equal(&queue->fmt, &vs->fmt));
+}
 
-	// stream on
-	type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-	for (i = 0; i < vsp->input_count; i++) {
-		if (ioctl(vsp->inputs[i].input_pads.fd, VIDIOC_STREAMON, &type) == -1) {
-			weston_log("VIDIOC_STREAMON failed for input %d. (%s)\n", i, strerror(errno));
-		}
+/*
+ * Stop all streams and tear down the scaler routes of the active
+ * configuration, so that the pipeline can be reconfigured.
+ */
+static void
+vsp_comp_stop(struct vsp_device *vsp)
+{
+	struct vsp_input input;
+	int i;
+
+	vsp_queue_streamoff(&vsp->output_pad.queue);
+	for (i = 0; i < vsp->input_max; i++)
+		vsp_queue_streamoff(&vsp->inputs[i].input_pads.queue);
+
+	for (i = 0; i < vsp->active.input_count; i++) {
+		struct vsp_input_config *in = &vsp->active.inputs[i];
+
+		if (in->scaler < 0)
+			continue;
+
+		input = vsp->inputs[i];
+		input.use_scaler = &vsp->scalers[in->scaler];
+		input.use_scaler->input = i;
+		vsp_comp_setup_inputs(vsp, &input, 0);
+		input.use_scaler->input = -1;
 	}
 
-	type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-	if (ioctl(fd, VIDIOC_STREAMON, &type) == -1) {
-		weston_log("VIDIOC_STREAMON failed for output (%s).\n", strerror(errno));
-		goto error;
+	memset(&vsp->active, 0, sizeof vsp->active);
+	vsp->streaming = 0;
+}
+
+/*
+ * Program the VSP for the current pass and start it.
+ *
+ * The streams are kept on across passes. The pipeline is reconfigured
+ * only if the pass differs from the active configuration; otherwise it's
+ * enough to queue buffers.
+ */
+static int
+vsp_comp_run(struct vsp_device *vsp, struct vsp_pass *pass)
+{
+	struct vsp_pipe_config config;
+	int i, restart;
+
+	DBG("submit vsp composition (%d inputs).\n", pass->input_count);
+
+	vsp_comp_get_config(vsp, pass, &config);
+	restart = (!vsp->streaming ||
+		   memcmp(&config, &vsp->active, sizeof config) ||
+		   !vsp_queue_match(&vsp->output_pad.queue, &pass->output.surface_state, 0));
+	for (i = 0; !restart && i < pass->input_count; i++)
+		restart = !vsp_queue_match(&vsp->inputs[i].input_pads.queue,
+					   &pass->surface_states[i], pass->inputs[i].opaque);
+
+	vsp->stats.passes++;
+	vsp->totals.passes++;
+	vsp->totals.inputs += pass->input_count;
+	for (i = 0; i < pass->input_count; i++) {
+		if (pass->inputs[i].use_scaler)
+			vsp->totals.scaled++;
 	}
 
-	// dequeue buffer
-	if (vsp_dequeue_buffer(fd, 1) < 0)
-		goto error;
+	if (restart) {
+		DBG("reconfigure the pipeline.\n");
+		vsp->stats.reconfigs++;
 
-	type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-	if (ioctl(fd, VIDIOC_STREAMOFF, &type) == -1) {
-		weston_log("%s: VIDIOC_STREAMOFF failed on %d (%s).\n", __func__, fd, strerror(errno));
-		goto error;
+		vsp_comp_stop(vsp);
+		vsp->active = config;
+
+		if (vsp_comp_setup_output(vsp, &pass->output) < 0)
+			return -1;
+
+		// enable links and set formats
+		for (i = 0; i < pass->input_count; i++) {
+			struct vsp_input *input = &pass->inputs[i];
+
+			if (input->use_scaler)
+				input->use_scaler->input = i;
+			if (vsp_comp_setup_inputs(vsp, input, 1) < 0)
+				return -1;
+			if (vsp_queue_set_format(&vsp->inputs[i].input_pads.queue,
+						 &input->input_surface_states->fmt,
+						 input->opaque,
+						 vsp_surface_memory(input->input_surface_states)) < 0)
+				return -1;
+		}
+
+		// disable unused inputs
+		for (i = pass->input_count; i < vsp->input_max; i++)
+			vsp_comp_setup_inputs(vsp, &vsp->inputs[i], 0);
 	}
 
-	// stream off
-	type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-	for (i = 0; i < vsp->input_count; i++) {
-		if (ioctl(vsp->inputs[i].input_pads.fd, VIDIOC_STREAMOFF, &type) == -1) {
-			weston_log("VIDIOC_STREAMOFF failed for input %d.\n", i);
+	// queue buffers
+	for (i = 0; i < pass->input_count; i++) {
+		if (vsp_queue_enqueue(&vsp->inputs[i].input_pads.queue,
+				      &pass->surface_states[i]) < 0) {
+			// the renderer copies SHM buffers from now on
+			if (vsp_surface_memory(&pass->surface_states[i]) == V4L2_MEMORY_USERPTR &&
+			    vsp->base.userptr) {
+				weston_log("USERPTR import failed. fall back to copying SHM buffers.\n");
+				vsp->base.userptr = 0;
+			}
+			return -1;
 		}
 	}
 
-	// disable UDS if used
-	if (vsp->scaler_count) {
-		for (i = 0; i < vsp->input_count; i++) {
-			struct vsp_input *input = &vsp->inputs[i];
-			if (input->use_scaler) {
-				vsp_comp_setup_inputs(vsp, input, 0);
-				input->use_scaler->input = -1;
-				input->use_scaler = NULL;
+	if (vsp_queue_enqueue(&vsp->output_pad.queue, &pass->output.surface_state) < 0)
+		return -1;
+
+//	video_debug_mediactl(vsp->base.media);
+
+	// stream on
+	if (restart) {
+		for (i = 0; i < pass->input_count; i++) {
+			if (vsp_queue_streamon(&vsp->inputs[i].input_pads.queue) < 0) {
+				weston_log("stream on failed for input %d.\n", i);
+				return -1;
 			}
 		}
-		vsp->scaler_count = 0;
+
+		if (vsp_queue_streamon(&vsp->output_pad.queue) < 0) {
+			weston_log("stream on failed for output.\n");
+			return -1;
+		}
+
+		vsp->streaming = 1;
 	}
-	vsp->input_count = 0;
-	return 0;
 
-error:
-	video_debug_mediactl();
-	vsp->input_count = 0;
-	return -1;
+	return 0;
 }
 
+/*
+ * Start the next pass in the queue. The pass is completed by
+ * vsp_comp_complete() once the output buffer is ready, either from the
+ * event loop or by waiting for it in vsp_comp_wait().
+ */
 static void
-vsp_comp_finish(struct v4l2_renderer_device *dev)
+vsp_comp_submit(struct vsp_device *vsp)
 {
-	struct vsp_device *vsp = (struct vsp_device*)dev;
+	struct vsp_pass *pass;
 
-	if (vsp->input_count > 0)
-		vsp_comp_flush(vsp);
+	if (vsp->current_pass || wl_list_empty(&vsp->pass_queue))
+		return;
 
-	vsp->state = VSP_STATE_IDLE;
-	DBG("complete vsp composition.\n");
-	vsp->output_surface_state = NULL;
-}
+	pass = container_of(vsp->pass_queue.next, struct vsp_pass, link);
+	wl_list_remove(&pass->link);
+	vsp->current_pass = pass;
 
-#define IS_IDENTICAL_RECT(a, b) ((a)->width == (b)->width && (a)->height == (b)->height && \
-				 (a)->left  == (b)->left  && (a)->top    == (b)->top)
+	if (vsp_comp_run(vsp, pass) < 0) {
+		vsp_comp_complete(vsp, 1);
+		return;
+	}
+
+	// wait for the output buffer without blocking the compositor
+	if (vsp->loop && !vsp->output_source) {
+		vsp->output_source = wl_event_loop_add_fd(vsp->loop, vsp->output_pad.fd,
+							  WL_EVENT_READABLE,
+							  vsp_comp_handle_output, vsp);
+		if (!vsp->output_source)
+			weston_log("can't watch the output pad. wait for the VSP.\n");
+	}
 
+	if (!vsp->output_source)
+		vsp_comp_complete(vsp, 0);
+}
+
+/*
+ * Wait for the current pass and take its buffers back. Returns non-zero
+ * if the pass failed.
+ */
 static int
-vsp_do_draw_view(struct vsp_device *vsp, struct vsp_surface_state *vs, struct v4l2_rect *src, struct v4l2_rect *dst,
-		 int opaque)
+vsp_comp_retire(struct vsp_device *vsp, int error)
 {
-	int should_use_scaler = 0;
-	struct vsp_input *input;
+	struct vsp_pass *pass = vsp->current_pass;
+	struct timespec start, end;
+	int i, fd;
 
-	if (src->width < 1 || src->height < 1) {
-		DBG("ignoring the size of zeros < (%dx%d)\n", src->width, src->height);
-		return 0;
+	// get an output pad
+	fd = vsp->output_pad.fd;
+
+	/*
+	 * The output pad is watched only while a buffer is queued;
+	 * poll() returns POLLERR on a V4L2 queue without buffers.
+	 */
+	if (vsp->output_source) {
+		wl_event_source_remove(vsp->output_source);
+		vsp->output_source = NULL;
 	}
 
-	if (src->width > 8190 || src->height > 8190) {
-		weston_log("ignoring the size exceeding the limit (8190x8190) < (%dx%d)\n", src->width, src->height);
-		return 0;
+	// dequeue buffers. the inputs are done as well as the output.
+	if (!error) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		vsp->output_pad.queue.ioctls++;
+		if (vsp_dequeue_buffer(fd, 1, vsp->output_pad.queue.memory) < 0)
+			error = 1;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		vsp->totals.wait_nsec += (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000ULL +
+			end.tv_nsec - start.tv_nsec;
 	}
 
-	if (dst->width != src->width || dst->height != src->height) {
-		if (src->width < VSP_SCALER_MIN_PIXELS || src->height < VSP_SCALER_MIN_PIXELS) {
-			weston_log("ignoring the size the scaler can't handle (input size=%dx%d).\n",
-				   src->width, src->height);
-			return 0;
-		}
-		should_use_scaler = 1;
+	for (i = 0; !error && i < pass->input_count; i++) {
+		struct vsp_buffer_queue *queue = &vsp->inputs[i].input_pads.queue;
+
+		queue->ioctls++;
+		if (vsp_dequeue_buffer(queue->fd, 0, queue->memory) < 0)
+			error = 1;
 	}
 
-	if (src->left < 0) {
-		src->width += src->left;
-		src->left = 0;
+	// start over from a clean state
+	if (error) {
+		vsp_comp_stop(vsp);
+		video_debug_mediactl(vsp->base.media);
 	}
 
-	if (src->top < 0) {
-		src->height += src->top;
-		src->top = 0;
+	vsp->current_pass = NULL;
+	if (vsp->last_pass == pass)
+		vsp->last_pass = NULL;
+
+	return error;
+}
+
+static void
+vsp_comp_complete(struct vsp_device *vsp, int error)
+{
+	struct vsp_pass *pass = vsp->current_pass;
+
+	if (!pass)
+		return;
+
+	vsp_comp_retire(vsp, error);
+	if (pass->done)
+		pass->done(pass->data);
+	vsp_pass_release_buffers(vsp, pass);
+	vsp_pass_destroy(pass);
+
+	// kick the next pass
+	vsp_comp_submit(vsp);
+}
+
+static void
+vsp_comp_wait(struct vsp_device *vsp)
+{
+	// VIDIOC_DQBUF blocks until the hardware completes the pass.
+	while (vsp->current_pass)
+		vsp_comp_complete(vsp, 0);
+}
+
+/*
+ * Queue the inputs set so far as a composition pass. Following passes of
+ * the same composition take the output of this pass as their first input,
+ * so passes are run on the hardware strictly in the queued order.
+ */
+static int
+vsp_comp_flush(struct vsp_device *vsp)
+{
+	struct vsp_pass *pass;
+	struct weston_buffer *buffer;
+	int i;
+
+	DBG("flush vsp composition.\n");
+
+	pass = calloc(1, sizeof *pass);
+	if (!pass) {
+		weston_log("can't allocate a composition pass.\n");
+		goto out;
 	}
 
+	pass->output = *container_of(vsp->output_surface_state,
+				     struct vsp_renderer_output, surface_state);
+	vsp_pass_copy_surface(&pass->output.surface_state, vsp->output_surface_state);
+
+	pass->input_count = vsp->input_count;
+	for (i = 0; i < vsp->input_count; i++) {
+		struct vsp_surface_state *vs = vsp->inputs[i].input_surface_states;
+
+		pass->inputs[i] = vsp->inputs[i];
+		pass->inputs[i].input_surface_states = &pass->surface_states[i];
+		vsp_pass_copy_surface(&pass->surface_states[i], vs);
+
+		// views of the same surface may differ in alpha
+		pass->surface_states[i].base.alpha = vsp->inputs[i].alpha;
+
+		// keep client buffers until the hardware has read them
+		buffer = vs->base.buffer_ref.buffer;
+		if (buffer && (!buffer->shm_buffer || vs->base.planes[0].userptr))
+			weston_buffer_reference(&pass->buffer_refs[i], buffer);
+	}
+
+	wl_list_insert(vsp->pass_queue.prev, &pass->link);
+	vsp->last_pass = pass;
+	vsp->frame_passes++;
+
+out:
+	// inputs and scalers are free for the next pass
+	for (i = 0; i < vsp->input_count; i++)
+		vsp->inputs[i].use_scaler = NULL;
+	for (i = 0; i < vsp->scaler_count; i++)
+		vsp->scalers[i].input = -1;
+	vsp->scaler_count = 0;
+	vsp->input_count = 0;
+
+	if (!pass)
+		return -1;
+
+	vsp_comp_submit(vsp);
+	return 0;
+}
+
+static int
+vsp_do_draw_view(struct vsp_device *vsp, struct vsp_surface_state *vs, struct v4l2_rect *src, struct v4l2_rect *dst,
+		 int opaque)
+{
+	int should_use_scaler = (dst->width != src->width || dst->height != src->height);
+	struct vsp_input *input;
+
 	DBG("set input %d (dmafd=%d): %dx%d@(%d,%d)->%dx%d@(%d,%d). alpha=%f\n",
 	    vsp->input_count,
 	    vs->base.planes[0].dmafd,
@@ -1091,6 +1987,7 @@ vsp_do_draw_view(struct vsp_device *vsp, struct vsp_surface_state *vs, struct v4
 	input->input_surface_states = vs;
 	input->src = *src;
 	input->dst = *dst;
+	input->alpha = vs->base.alpha;
 	input->opaque = opaque;
 
 	// check if we should flush now
@@ -1101,23 +1998,542 @@ vsp_do_draw_view(struct vsp_device *vsp, struct vsp_surface_state *vs, struct v4
 	return 0;
 }
 
+/*
+ * Queue a pass copying a rectangle of a surface into dst, with the scaler
+ * if the size of dst differs from the rectangle.
+ */
+static struct vsp_pass *
+vsp_comp_queue_copy(struct vsp_device *vsp, struct vsp_surface_state *vs, struct v4l2_rect *src,
+		    struct vsp_renderer_output *dst, int opaque)
+{
+	struct vsp_pass *pass;
+	struct vsp_input *input;
+
+	pass = calloc(1, sizeof *pass);
+	if (!pass)
+		return NULL;
+
+	pass->output = *dst;
+	vsp_pass_copy_surface(&pass->output.surface_state, &dst->surface_state);
+
+	input = &pass->inputs[0];
+	*input = vsp->inputs[0];
+	input->input_surface_states = &pass->surface_states[0];
+	input->src = *src;
+	input->dst.left = 0;
+	input->dst.top = 0;
+	input->dst.width = dst->base.width;
+	input->dst.height = dst->base.height;
+	input->alpha = 1.0;
+	input->opaque = opaque;
+	input->use_scaler = NULL;
+	if (input->dst.width != src->width || input->dst.height != src->height)
+		input->use_scaler = &vsp->scalers[0];
+
+	pass->input_count = 1;
+	vsp_pass_copy_surface(&pass->surface_states[0], vs);
+	pass->surface_states[0].base.alpha = 1.0;
+
+	wl_list_insert(vsp->pass_queue.prev, &pass->link);
+
+	return pass;
+}
+
+// whether an RPF can read src, and the scaler can fit it in dst if needed
+static int
+vsp_check_rect(struct v4l2_rect *src, struct v4l2_rect *dst)
+{
+	if (src->width > 8190 || src->height > 8190)
+		return 0;
+
+	if (dst->width != src->width || dst->height != src->height) {
+		if (src->width < VSP_SCALER_MIN_PIXELS || src->height < VSP_SCALER_MIN_PIXELS)
+			return 0;
+	}
+
+	return 1;
+}
+
+static int
+vsp_comp_add_layer(struct vsp_device *vsp, struct vsp_surface_state *vs, struct v4l2_rect *src,
+		   struct v4l2_rect *dst, int opaque)
+{
+	struct vsp_layer *layer;
+	struct v4l2_rect s = *src;
+
+	if (s.width < 1 || s.height < 1) {
+		DBG("ignoring the size of zeros < (%dx%d)\n", s.width, s.height);
+		return 0;
+	}
+
+	if (!vsp_check_rect(&s, dst)) {
+		weston_log("ignoring a rectangle the VSP can't handle (%dx%d -> %dx%d).\n",
+			   s.width, s.height, dst->width, dst->height);
+		return 0;
+	}
+
+	if (s.left < 0) {
+		s.width += s.left;
+		s.left = 0;
+	}
+
+	if (s.top < 0) {
+		s.height += s.top;
+		s.top = 0;
+	}
+
+	layer = wl_array_add(&vsp->layers, sizeof *layer);
+	if (!layer) {
+		weston_log("can't allocate a layer.\n");
+		return -1;
+	}
+
+	layer->vs = vs;
+	layer->src = s;
+	layer->dst = *dst;
+	layer->alpha = vs->base.alpha;
+	layer->opaque = opaque;
+	layer->scaled = (dst->width != s.width || dst->height != s.height);
+	layer->pass = -1;
+
+	return 0;
+}
+
+static int
+vsp_rect_overlap(struct v4l2_rect *a, struct v4l2_rect *b)
+{
+	return (a->left < b->left + (int)b->width && b->left < a->left + (int)a->width &&
+		a->top < b->top + (int)b->height && b->top < a->top + (int)a->height);
+}
+
+/*
+ * A layer can be composed once all the layers below it which it overlaps
+ * are scheduled. Layers which don't overlap can go in any order.
+ */
+static int
+vsp_layer_is_ready(struct vsp_layer *layers, int index)
+{
+	int i;
+
+	for (i = 0; i < index; i++) {
+		if (layers[i].pass < 0 &&
+		    vsp_rect_overlap(&layers[i].dst, &layers[index].dst))
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Assign the layers to passes. Each pass takes as many ready layers as
+ * there are free inputs and scalers. As a layer only has to wait for the
+ * layers below it that it overlaps, a layer which doesn't fit in a pass,
+ * e.g. for want of a scaler, doesn't hold back the unrelated ones above
+ * it. Every pass but the first one spends an input for the output of the
+ * previous pass. Returns the number of passes.
+ */
+static int
+vsp_comp_schedule(struct vsp_device *vsp, struct vsp_layer *layers, int count)
+{
+	int refeed = (vsp->state == VSP_STATE_COMPOSING);
+	int scheduled = 0, pass = 0;
+	int i, inputs, scalers;
+
+	while (scheduled < count) {
+		inputs = (refeed) ? 1 : 0;
+		scalers = 0;
+
+		for (i = 0; i < count && inputs < vsp->input_max; i++) {
+			if (layers[i].pass >= 0)
+				continue;
+			if (layers[i].scaled && scalers == vsp->scaler_max)
+				continue;
+			if (!vsp_layer_is_ready(layers, i))
+				continue;
+
+			layers[i].pass = pass;
+			inputs++;
+			if (layers[i].scaled)
+				scalers++;
+			scheduled++;
+		}
+
+		pass++;
+		refeed = 1;
+	}
+
+	return pass;
+}
+
+static struct vsp_scaled_cache *
+vsp_scaled_cache_get(struct vsp_device *vsp, struct vsp_surface_state *vs, struct vsp_scaled_key *key)
+{
+	struct vsp_scaled_cache *cache, *lru = NULL;
+	int count = 0;
+
+	// an entry for the key, a new one, or the least recently used one.
+	// the queues of other devices may still be reading their copies, so
+	// only the entries of this device are looked at.
+	for (cache = vs->scaled; cache; cache = cache->next) {
+		if (cache->vsp != vsp)
+			continue;
+
+		if (!memcmp(&cache->key, key, sizeof *key) ||
+		    !memcmp(&cache->seen, key, sizeof *key))
+			goto found;
+
+		if (!lru || cache->age < lru->age)
+			lru = cache;
+		count++;
+	}
+
+	if (count < VSP_SCALED_CACHE_MAX) {
+		if (!(cache = calloc(1, sizeof(struct vsp_scaled_cache))))
+			return NULL;
+		cache->vsp = vsp;
+		cache->next = vs->scaled;
+		vs->scaled = cache;
+	} else {
+		cache = lru;
+	}
+
+found:
+	cache->age = ++vsp->scaled_serial;
+	return cache;
+}
+
+static int
+vsp_scaled_cache_update(struct vsp_device *vsp, struct vsp_scaled_cache *cache,
+			struct vsp_surface_state *vs, struct vsp_scaled_key *key)
+{
+	struct vsp_surface_state *ss = &cache->state.surface_state;
+	struct v4l2_format *fmt = &ss->fmt;
+	unsigned int stride = key->width * 4;
+	unsigned int size = stride * key->height;
+	int dmafd;
+
+	if (cache->buffer && cache->size != size) {
+		vsp_release_buffer(vsp, cache->buffer);
+		cache->buffer = NULL;
+	}
+
+	if (!cache->buffer) {
+		if (!vsp->base.create_buffer)
+			return -1;
+
+		cache->buffer = vsp->base.create_buffer(&vsp->base, size, &dmafd);
+		if (!cache->buffer)
+			return -1;
+		cache->size = size;
+
+		memset(&cache->state, 0, sizeof cache->state);
+		cache->state.base.width = key->width;
+		cache->state.base.height = key->height;
+		ss->mbus_code = V4L2_MBUS_FMT_ARGB8888_1X32;
+		ss->base.width = key->width;
+		ss->base.height = key->height;
+		ss->base.pixel_format = V4L2_PIX_FMT_ABGR32;
+		ss->base.num_planes = 1;
+		ss->base.planes[0].dmafd = dmafd;
+		ss->base.planes[0].stride = stride;
+		ss->buffer_key = dmafd;
+
+		fmt->type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+		fmt->fmt.pix_mp.width = key->width;
+		fmt->fmt.pix_mp.height = key->height;
+		fmt->fmt.pix_mp.pixelformat = V4L2_PIX_FMT_ABGR32;
+		fmt->fmt.pix_mp.num_planes = 1;
+		fmt->fmt.pix_mp.plane_fmt[0].bytesperline = stride;
+	}
+
+	if (!vsp_comp_queue_copy(vsp, vs, &key->src, &cache->state, key->opaque))
+		return -1;
+	vsp_comp_submit(vsp);
+
+	cache->key = *key;
+	cache->valid = 1;
+	vsp->stats.scaled_updates++;
+
+	return 0;
+}
+
+/*
+ * Compose a scaled layer from a copy scaled ahead of time, which leaves
+ * the scaler to other layers. A copy is made once a layer shows up
+ * unchanged in two frames in a row, so that views which change every
+ * frame don't pay for the extra pass.
+ */
+static void
+vsp_comp_use_scaled_cache(struct vsp_device *vsp, struct vsp_layer *layer)
+{
+	struct vsp_scaled_cache *cache;
+	struct vsp_scaled_key key;
+
+	memset(&key, 0, sizeof key);
+	key.serial = layer->vs->base.content_serial;
+	key.src = layer->src;
+	key.width = layer->dst.width;
+	key.height = layer->dst.height;
+	key.opaque = layer->opaque;
+
+	cache = vsp_scaled_cache_get(vsp, layer->vs, &key);
+	if (!cache)
+		return;
+
+	if (!cache->valid || memcmp(&cache->key, &key, sizeof key)) {
+		if (memcmp(&cache->seen, &key, sizeof key)) {
+			cache->seen = key;
+			return;
+		}
+
+		if (vsp_scaled_cache_update(vsp, cache, layer->vs, &key) < 0) {
+			cache->valid = 0;
+			return;
+		}
+	}
+
+	DBG("compose a scaled view from dmafd=%d.\n",
+	    cache->state.surface_state.base.planes[0].dmafd);
+
+	layer->vs = &cache->state.surface_state;
+	layer->src.left = 0;
+	layer->src.top = 0;
+	layer->src.width = key.width;
+	layer->src.height = key.height;
+	layer->scaled = 0;
+	vsp->stats.scaled_hits++;
+}
+
+static void
+vsp_comp_draw_layers(struct vsp_device *vsp)
+{
+	struct vsp_layer *layers = vsp->layers.data;
+	int count = vsp->layers.size / sizeof *layers;
+	int i, pass, passes;
+
+	for (i = 0; vsp->scaled_cache && i < count; i++) {
+		if (layers[i].scaled)
+			vsp_comp_use_scaled_cache(vsp, &layers[i]);
+	}
+
+	passes = vsp_comp_schedule(vsp, layers, count);
+
+	DBG("%d layers scheduled in %d passes.\n", count, passes);
+
+	for (pass = 0; pass < passes; pass++) {
+		// the layers of a pass are set in stacking order
+		for (i = 0; i < count; i++) {
+			if (layers[i].pass != pass)
+				continue;
+
+			layers[i].vs->base.alpha = layers[i].alpha;
+			if (vsp_do_draw_view(vsp, layers[i].vs, &layers[i].src,
+					     &layers[i].dst, layers[i].opaque) < 0)
+				weston_log("failed to compose a view.\n");
+		}
+
+		if (vsp->input_count > 0)
+			vsp_comp_flush(vsp);
+	}
+
+	DBG("frame composed in %d passes.\n", vsp->frame_passes);
+
+	vsp->layers.size = 0;
+}
+
+static void
+vsp_comp_update_stats(struct vsp_device *vsp)
+{
+	struct vsp_stats *stats = &vsp->stats;
+
+	stats->frames++;
+	if ((unsigned int)vsp->frame_passes > stats->max_passes)
+		stats->max_passes = vsp->frame_passes;
+
+	if (vsp->stats_interval <= 0 || stats->frames < (unsigned int)vsp->stats_interval)
+		return;
+
+	weston_log("vsp: %u frames, %u passes (max %u per frame), %u reconfigurations\n",
+		   stats->frames, stats->passes, stats->max_passes, stats->reconfigs);
+	weston_log_continue("  scaled views: %u from cache, %u copies made\n",
+			    stats->scaled_hits, stats->scaled_updates);
+	weston_log_continue("  ioctls issued/skipped: links %u/%u, formats %u/%u, "
+			    "selections %u/%u, alpha %u/%u\n",
+			    stats->links.issued, stats->links.skipped,
+			    stats->formats.issued, stats->formats.skipped,
+			    stats->selections.issued, stats->selections.skipped,
+			    stats->alpha.issued, stats->alpha.skipped);
+
+	memset(stats, 0, sizeof(*stats));
+}
+
+static void
+vsp_comp_finish(struct v4l2_renderer_device *dev)
+{
+	struct vsp_device *vsp = (struct vsp_device*)dev;
+
+	vsp_comp_draw_layers(vsp);
+
+	// wait for all passes to complete
+	vsp_comp_wait(vsp);
+	vsp_comp_update_stats(vsp);
+
+	vsp->state = VSP_STATE_IDLE;
+	DBG("complete vsp composition.\n");
+	vsp->output_surface_state = NULL;
+	vsp->last_pass = NULL;
+}
+
+static int
+vsp_comp_finish_async(struct v4l2_renderer_device *dev, v4l2_compose_done_t done, void *data)
+{
+	struct vsp_device *vsp = (struct vsp_device*)dev;
+	struct vsp_pass *pass;
+
+	vsp_comp_draw_layers(vsp);
+
+	vsp->state = VSP_STATE_IDLE;
+	vsp->output_surface_state = NULL;
+	vsp_comp_update_stats(vsp);
+
+	pass = vsp->last_pass;
+	vsp->last_pass = NULL;
+
+	// nothing is left on the hardware for this composition
+	if (!pass) {
+		DBG("complete vsp composition.\n");
+		return -1;
+	}
+
+	DBG("vsp composition in progress.\n");
+	pass->done = done;
+	pass->data = data;
+
+	return 0;
+}
+
+static void
+vsp_comp_wait_compose(struct v4l2_renderer_device *dev)
+{
+	vsp_comp_wait((struct vsp_device*)dev);
+}
+
+static int
+vsp_can_compose(struct v4l2_renderer_device *dev, struct v4l2_surface_state *surface_state)
+{
+	int i;
+
+	for (i = 0; i < surface_state->num_rects; i++) {
+		if (!vsp_check_rect(&surface_state->rects[i].src, &surface_state->rects[i].dst))
+			return 0;
+	}
+
+	return 1;
+}
+
 static int
 vsp_comp_draw_view(struct v4l2_renderer_device *dev, struct v4l2_surface_state *surface_state)
 {
 	struct vsp_device *vsp = (struct vsp_device*)dev;
 	struct vsp_surface_state *vs = (struct vsp_surface_state*)surface_state;
 
-	DBG("start rendering a view.\n");
-	if (!IS_IDENTICAL_RECT(&surface_state->dst_rect, &surface_state->opaque_dst_rect)) {
-		DBG("rendering non-opaque region.\n");
-		if (vsp_do_draw_view(vsp, vs, &surface_state->src_rect, &surface_state->dst_rect, 0) < 0)
+	struct v4l2_view_rect *rect;
+	int i;
+
+	DBG("start rendering a view in %d rectangle(s).\n", surface_state->num_rects);
+	for (i = 0; i < surface_state->num_rects; i++) {
+		rect = &surface_state->rects[i];
+		if (vsp_comp_add_layer(vsp, vs, &rect->src, &rect->dst, rect->opaque) < 0)
 			return -1;
 	}
 
-	DBG("rendering opaque region if available.\n");
-	if (vsp_do_draw_view(vsp, vs, &surface_state->opaque_src_rect, &surface_state->opaque_dst_rect, 1) < 0)
+	return 0;
+}
+
+/*
+ * Copy a rectangle of the current output buffer into the caller's memory
+ * with the VSP, converting it to the requested format on the way. The
+ * output buffer is fed to an RPF, and the WPF writes into a buffer of our
+ * own, so the output queue stays on DMABUF. The pixels are copied out
+ * once the pass completes.
+ *
+ * The readback is run only while the hardware is idle, e.g. from the
+ * frame_signal once the composition of the output completed. Passes of
+ * other outputs queued meanwhile are run after it. Otherwise the renderer
+ * reads the buffer with the CPU.
+ */
+static int
+vsp_read_pixels(struct v4l2_renderer_device *dev, struct v4l2_renderer_output *out,
+		unsigned int pixel_format, void *pixels, uint32_t stride,
+		struct v4l2_rect *rect)
+{
+	struct vsp_device *vsp = (struct vsp_device*)dev;
+	struct vsp_renderer_output *output = (struct vsp_renderer_output*)out;
+	struct vsp_renderer_output dst;
+	struct vsp_pass *pass;
+	struct v4l2_format *fmt;
+	unsigned int size = stride * rect->height;
+	void *buffer, *map;
+	int dmafd, error;
+
+	if (vsp->state != VSP_STATE_IDLE || vsp->current_pass || !vsp->base.create_buffer)
+		return -1;
+
+	buffer = vsp->base.create_buffer(&vsp->base, size, &dmafd);
+	if (!buffer)
 		return -1;
 
+	memset(&dst, 0, sizeof dst);
+	dst.base.width = rect->width;
+	dst.base.height = rect->height;
+	dst.surface_state.mbus_code = V4L2_MBUS_FMT_ARGB8888_1X32;
+	dst.surface_state.base.width = rect->width;
+	dst.surface_state.base.height = rect->height;
+	dst.surface_state.base.pixel_format = pixel_format;
+	dst.surface_state.base.num_planes = 1;
+	dst.surface_state.base.planes[0].dmafd = dmafd;
+	dst.surface_state.base.planes[0].stride = stride;
+	dst.surface_state.buffer_key = dmafd;
+
+	fmt = &dst.surface_state.fmt;
+	fmt->type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	fmt->fmt.pix_mp.width = rect->width;
+	fmt->fmt.pix_mp.height = rect->height;
+	fmt->fmt.pix_mp.pixelformat = pixel_format;
+	fmt->fmt.pix_mp.num_planes = 1;
+	fmt->fmt.pix_mp.plane_fmt[0].bytesperline = stride;
+
+	pass = vsp_comp_queue_copy(vsp, &output->surface_state, rect, &dst, 1);
+	if (!pass) {
+		vsp->base.destroy_buffer(&vsp->base, buffer);
+		return -1;
+	}
+
+	// run it right away. no other pass or done callback runs meanwhile.
+	wl_list_remove(&pass->link);
+	vsp->current_pass = pass;
+	error = vsp_comp_run(vsp, pass);
+	error = vsp_comp_retire(vsp, error);
+	vsp_pass_release_buffers(vsp, pass);
+	vsp_pass_destroy(pass);
+
+	if (error) {
+		weston_log("VSP readback failed. fall back to the CPU.\n");
+		vsp->base.destroy_buffer(&vsp->base, buffer);
+		return -1;
+	}
+
+	map = mmap(NULL, size, PROT_READ, MAP_SHARED, dmafd, 0);
+	if (map == MAP_FAILED) {
+		weston_log("mmap failed for dmafd=%d (%s).\n", dmafd, strerror(errno));
+		vsp->base.destroy_buffer(&vsp->base, buffer);
+		return -1;
+	}
+
+	memcpy(pixels, map, size);
+	munmap(map, size);
+	vsp->base.destroy_buffer(&vsp->base, buffer);
+
 	return 0;
 }
 
@@ -1130,6 +2546,18 @@ vsp_set_output_buffer(struct v4l2_renderer_output *out, struct v4l2_bo_state *bo
 	output->surface_state.fmt.fmt.pix_mp.plane_fmt[0].bytesperline = bo->stride;
 }
 
+static void
+vsp_get_stats(struct v4l2_renderer_device *dev, struct v4l2_device_stats *stats)
+{
+	struct vsp_device *vsp = (struct vsp_device*)dev;
+	int i;
+
+	*stats = vsp->totals;
+	stats->ioctls += vsp->output_pad.queue.ioctls;
+	for (i = 0; i < vsp->input_max; i++)
+		stats->ioctls += vsp->inputs[i].input_pads.queue.ioctls;
+}
+
 static uint32_t
 vsp_get_capabilities(void)
 {
@@ -1138,16 +2566,25 @@ vsp_get_capabilities(void)
 
 WL_EXPORT struct v4l2_device_interface v4l2_device_interface = {
 	.init = vsp_init,
+	.destroy = vsp_destroy,
 
 	.create_output = vsp_create_output,
 	.set_output_buffer = vsp_set_output_buffer,
 
 	.create_surface = vsp_create_surface,
+	.destroy_surface = vsp_destroy_surface,
 	.attach_buffer = vsp_attach_buffer,
+	.check_format = vsp_check_format,
 
 	.begin_compose = vsp_comp_begin,
 	.finish_compose = vsp_comp_finish,
+	.finish_compose_async = vsp_comp_finish_async,
+	.wait_compose = vsp_comp_wait_compose,
 	.draw_view = vsp_comp_draw_view,
+	.can_compose = vsp_can_compose,
+
+	.read_pixels = vsp_read_pixels,
+	.get_stats = vsp_get_stats,
 
 	.get_capabilities = vsp_get_capabilities,
 };
@@ -22,6 +22,7 @@
 
 #include "config.h"
 
+#include <stdlib.h>
 #include <string.h>
 
 #include "weston-test-client-helper.h"
@@ -548,3 +549,160 @@ TEST(test_subsurface_destroy_permutations)
 	client_roundtrip(client);
 	fprintf(stderr, "tried %d destroy permutations\n", counter);
 }
+
+static struct surface *
+create_child_surface(struct client *client, struct wl_subcompositor *subco,
+		     struct wl_subsurface **sub, int x, int y)
+{
+	struct surface *surface;
+	int size = 40;
+
+	surface = calloc(1, sizeof *surface);
+	assert(surface);
+
+	surface->wl_surface = wl_compositor_create_surface(client->wl_compositor);
+	assert(surface->wl_surface);
+	wl_surface_set_user_data(surface->wl_surface, surface);
+
+	surface->width = size;
+	surface->height = size;
+	surface->x = client->surface->x + x;
+	surface->y = client->surface->y + y;
+	surface->wl_buffer = create_shm_buffer(client, size, size,
+					       &surface->data);
+	memset(surface->data, 128, size * size * 4);
+
+	*sub = wl_subcompositor_get_subsurface(subco, surface->wl_surface,
+					       client->surface->wl_surface);
+	wl_subsurface_set_position(*sub, x, y);
+
+	wl_surface_attach(surface->wl_surface, surface->wl_buffer, 0, 0);
+	wl_surface_damage(surface->wl_surface, 0, 0, size, size);
+	wl_surface_commit(surface->wl_surface);
+
+	return surface;
+}
+
+static void
+destroy_child_surface(struct surface *surface)
+{
+	wl_surface_destroy(surface->wl_surface);
+	wl_buffer_destroy(surface->wl_buffer);
+	free(surface);
+}
+
+/* Commits the parent and waits until the compositor repainted. The
+ * compositor picks the pointer focus from the view list that the repaint
+ * rebuilt. */
+static void
+commit_parent(struct client *client)
+{
+	int done;
+
+	frame_callback_set(client->surface->wl_surface, &done);
+	wl_surface_commit(client->surface->wl_surface);
+	frame_callback_wait(client, &done);
+}
+
+static void
+check_pointer_focus(struct client *client, int x, int y,
+		    struct surface *expected)
+{
+	wl_test_move_pointer(client->test->wl_test, x, y);
+	client_roundtrip(client);
+
+	assert(client->input->pointer->focus == expected);
+}
+
+TEST(test_subsurface_view_list)
+{
+	/*
+	 * Check that the view list the compositor picks the pointer focus
+	 * from follows restacking, creating, destroying and unmapping
+	 * sub-surfaces. Two sub-surfaces overlap at (x, y).
+	 */
+
+	struct client *client;
+	struct wl_subcompositor *subco;
+	struct wl_subsurface *sub_a, *sub_b, *sub_c;
+	struct surface *a, *b, *c;
+	int x, y;
+
+	client = client_create(100, 50, 123, 77);
+	assert(client);
+
+	subco = get_subcompositor(client);
+	x = client->surface->x + 40;
+	y = client->surface->y + 40;
+
+	a = create_child_surface(client, subco, &sub_a, 10, 10);
+	b = create_child_surface(client, subco, &sub_b, 30, 30);
+	commit_parent(client);
+	assert(surface_contains(a, x, y));
+	assert(surface_contains(b, x, y));
+
+	/* the most recently added sub-surface is on top */
+	check_pointer_focus(client, x, y, b);
+
+	/* restack */
+	wl_subsurface_place_above(sub_a, b->wl_surface);
+	commit_parent(client);
+	check_pointer_focus(client, x, y, a);
+
+	wl_subsurface_place_below(sub_a, b->wl_surface);
+	commit_parent(client);
+	check_pointer_focus(client, x, y, b);
+
+	wl_subsurface_place_below(sub_b, client->surface->wl_surface);
+	commit_parent(client);
+	check_pointer_focus(client, x, y, a);
+
+	wl_subsurface_place_above(sub_b, client->surface->wl_surface);
+	commit_parent(client);
+	check_pointer_focus(client, x, y, a);
+
+	wl_subsurface_place_above(sub_b, a->wl_surface);
+	commit_parent(client);
+	check_pointer_focus(client, x, y, b);
+
+	/* unmap and map again */
+	wl_surface_attach(b->wl_surface, NULL, 0, 0);
+	wl_surface_commit(b->wl_surface);
+	commit_parent(client);
+	check_pointer_focus(client, x, y, a);
+
+	wl_surface_attach(b->wl_surface, b->wl_buffer, 0, 0);
+	wl_surface_damage(b->wl_surface, 0, 0, b->width, b->height);
+	wl_surface_commit(b->wl_surface);
+	commit_parent(client);
+	check_pointer_focus(client, x, y, b);
+
+	/* The pointer leaves before surfaces are destroyed, so that the
+	 * leave event doesn't refer to a destroyed wl_surface. */
+	check_pointer_focus(client, 0, 0, NULL);
+
+	/* destroy */
+	wl_subsurface_destroy(sub_b);
+	commit_parent(client);
+	check_pointer_focus(client, x, y, a);
+
+	check_pointer_focus(client, 0, 0, NULL);
+	wl_subsurface_destroy(sub_a);
+	destroy_child_surface(a);
+	commit_parent(client);
+	check_pointer_focus(client, x, y, client->surface);
+
+	/* create */
+	c = create_child_surface(client, subco, &sub_c, 20, 20);
+	commit_parent(client);
+	check_pointer_focus(client, x, y, c);
+
+	check_pointer_focus(client, 0, 0, NULL);
+	destroy_child_surface(c);
+	commit_parent(client);
+	check_pointer_focus(client, x, y, client->surface);
+
+	wl_subsurface_destroy(sub_c);
+	destroy_child_surface(b);
+	client_roundtrip(client);
+}
@@ -27,9 +27,8 @@
 #include "../src/compositor.h"
 
 static void
-surface_transform(void *data)
+surface_transform(struct weston_compositor *compositor)
 {
-	struct weston_compositor *compositor = data;
 	struct weston_surface *surface;
 	struct weston_view *view;
 	float x, y;
@@ -51,6 +50,158 @@ surface_transform(void *data)
 	weston_view_update_transform(view);
 	weston_view_to_global_float(view, 50, 40, &x, &y);
 	assert(x == 200 && y == 340);
+}
+
+static struct weston_view *
+create_view(struct weston_compositor *compositor, struct weston_layer *layer,
+	    int32_t x, int32_t y)
+{
+	struct weston_surface *surface;
+	struct weston_view *view;
+
+	surface = weston_surface_create(compositor);
+	assert(surface);
+	view = weston_view_create(surface);
+	assert(view);
+	surface->width = 50;
+	surface->height = 50;
+	weston_view_set_position(view, x, y);
+	wl_list_insert(layer->view_list.prev, &view->layer_link);
+	weston_view_update_transform(view);
+
+	return view;
+}
+
+/*
+ * Checks that the views in views[] appear in the compositor's view list
+ * in the given order, and that no other view of views[] is in it.
+ */
+static void
+check_view_list(struct weston_compositor *compositor,
+		struct weston_view **views, int n, struct weston_view **all)
+{
+	struct weston_view *view;
+	int i, j = 0;
+
+	weston_compositor_update_view_list(compositor);
+
+	wl_list_for_each(view, &compositor->view_list, link) {
+		for (i = 0; all[i]; i++)
+			if (all[i] == view)
+				break;
+		if (!all[i])
+			continue;
+
+		assert(j < n);
+		assert(view == views[j]);
+		j++;
+	}
+	assert(j == n);
+}
+
+static void
+view_list_update(struct weston_compositor *compositor)
+{
+	struct weston_layer layer;
+	struct weston_surface *surface;
+	struct weston_view *a, *b, *c, *d;
+	struct weston_view *all[5];
+
+	weston_layer_init(&layer, &compositor->layer_list);
+
+	a = create_view(compositor, &layer, 0, 0);
+	b = create_view(compositor, &layer, 20, 20);
+	c = create_view(compositor, &layer, 40, 40);
+	d = NULL;
+	all[0] = a;
+	all[1] = b;
+	all[2] = c;
+	all[3] = NULL;
+	all[4] = NULL;
+
+	check_view_list(compositor, (struct weston_view *[]) { a, b, c }, 3,
+			all);
+
+	/* Nothing changed, the list is kept */
+	check_view_list(compositor, (struct weston_view *[]) { a, b, c }, 3,
+			all);
+
+	/* Restack within the layer */
+	wl_list_remove(&c->layer_link);
+	wl_list_insert(&layer.view_list, &c->layer_link);
+	check_view_list(compositor, (struct weston_view *[]) { c, a, b }, 3,
+			all);
+
+	/* Move the layer below the others and back */
+	wl_list_remove(&layer.link);
+	wl_list_insert(compositor->layer_list.prev, &layer.link);
+	check_view_list(compositor, (struct weston_view *[]) { c, a, b }, 3,
+			all);
+	wl_list_remove(&layer.link);
+	wl_list_insert(&compositor->layer_list, &layer.link);
+	check_view_list(compositor, (struct weston_view *[]) { c, a, b }, 3,
+			all);
+
+	/* Unmap */
+	weston_view_unmap(a);
+	assert(!weston_view_is_mapped(a));
+	check_view_list(compositor, (struct weston_view *[]) { c, b }, 2,
+			all);
+
+	/* Add */
+	d = create_view(compositor, &layer, 60, 60);
+	all[3] = d;
+	check_view_list(compositor, (struct weston_view *[]) { c, b, d }, 3,
+			all);
+
+	/* Remap at the top */
+	wl_list_insert(&layer.view_list, &a->layer_link);
+	weston_view_update_transform(a);
+	check_view_list(compositor, (struct weston_view *[]) { a, c, b, d },
+			4, all);
+
+	/* Remove */
+	wl_list_remove(&b->layer_link);
+	wl_list_init(&b->layer_link);
+	check_view_list(compositor, (struct weston_view *[]) { a, c, d }, 3,
+			all);
+
+	weston_surface_destroy(c->surface);
+	all[1] = b;
+	all[2] = d;
+	all[3] = NULL;
+	check_view_list(compositor, (struct weston_view *[]) { a, d }, 2,
+			all);
+
+	/* A view destroyed without being mapped may leave its address to a
+	 * new one, so the list is rebuilt too */
+	c = create_view(compositor, &layer, 80, 80);
+	wl_list_remove(&c->layer_link);
+	wl_list_init(&c->layer_link);
+	weston_view_unmap(c);
+	check_view_list(compositor, (struct weston_view *[]) { a, d }, 2,
+			all);
+	surface = c->surface;
+	weston_view_destroy(c);
+	assert(compositor->view_list_dirty);
+	weston_surface_destroy(surface);
+	check_view_list(compositor, (struct weston_view *[]) { a, d }, 2,
+			all);
+
+	weston_surface_destroy(a->surface);
+	weston_surface_destroy(b->surface);
+	weston_surface_destroy(d->surface);
+	wl_list_remove(&layer.link);
+	weston_compositor_update_view_list(compositor);
+}
+
+static void
+surface_test(void *data)
+{
+	struct weston_compositor *compositor = data;
+
+	surface_transform(compositor);
+	view_list_update(compositor);
 
 	wl_display_terminate(compositor->wl_display);
 }
@@ -62,7 +213,7 @@ module_init(struct weston_compositor *compositor, int *argc, char *argv[])
 
 	loop = wl_display_get_event_loop(compositor->wl_display);
 
-	wl_event_loop_add_idle(loop, surface_transform, compositor);
+	wl_event_loop_add_idle(loop, surface_test, compositor);
 
 	return 0;
 }